@@ -0,0 +1,195 @@
+#include "trans.h"
+
+// エンコード/デコードの速度を測り、1ケース1行のCSVで出力する。
+// 使い方: bench_encode [1ケースあたりの計測ミリ秒]
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+
+#define BENCH_DEFAULT_MS 100
+#define BENCH_DATA_SIZE (4 * 1024 * 1024)
+#define BENCH_MAX_CHUNK (1024 * 1024)
+
+typedef enum {
+    PROFILE_TEXT,       // ASCIIテキスト (改行を含む)
+    PROFILE_RANDOM,     // 一様乱数
+    PROFILE_SPECIAL,    // そのエンコードでエスケープが必要なバイトだけ
+    PROFILE_SSH         // 長さヘッダ付きの暗号文に似たパケット
+} profile_t;
+
+static const char *profile_names[] = { "text", "random", "special", "ssh" };
+static const char *method_names[] = { "uuencode", "escape", "dense" };
+static const size_t buffer_sizes[] = { 64, 1024, 16 * 1024, 64 * 1024, BENCH_MAX_CHUNK };
+
+static unsigned int bench_random(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void fill_profile(unsigned char *data, size_t len, profile_t profile, encode_method_t method) {
+    static const char words[] = "the quick brown fox jumps over the lazy dog 0123456789 ls -la /tmp\n";
+    // escapeでエスケープされるバイト。uuencodeには特別なバイトがないので同じものを使う
+    static const unsigned char escape_specials[] = { 0x0a, 0x0d, 0x1c, 0x5c, 0x7f };
+    // denseはオフセット42を足した後に0x0a, 0x0d, 0x1c, 0x7f, 0x3dになるバイト
+    static const unsigned char dense_specials[] = { 0xe0, 0xe3, 0xf2, 0x55, 0x13 };
+    const unsigned char *specials = (method == METHOD_DENSE) ? dense_specials : escape_specials;
+    unsigned int state = 0x12345678;
+    size_t i = 0;
+
+    switch (profile) {
+    case PROFILE_TEXT:
+        for (i = 0; i < len; i++) {
+            data[i] = (unsigned char)words[(i + bench_random(&state) % 3) % (sizeof(words) - 1)];
+        }
+        break;
+    case PROFILE_RANDOM:
+        for (i = 0; i < len; i++) {
+            data[i] = (unsigned char)bench_random(&state);
+        }
+        break;
+    case PROFILE_SPECIAL:
+        for (i = 0; i < len; i++) {
+            data[i] = specials[bench_random(&state) % sizeof(escape_specials)];
+        }
+        break;
+    case PROFILE_SSH:
+        while (i < len) {
+            // packet_length(4, big endian) + 暗号化されたペイロードとMAC
+            size_t packet = 32 + bench_random(&state) % 1400;
+            for (int k = 0; k < 4 && i < len; k++, i++) {
+                data[i] = (unsigned char)(packet >> (24 - 8 * k));
+            }
+            for (size_t k = 0; k < packet && i < len; k++, i++) {
+                data[i] = (unsigned char)bench_random(&state);
+            }
+        }
+        break;
+    }
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long cycles(void) {
+#ifdef BENCH_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+typedef struct {
+    double mb_per_s;
+    double cycles_per_byte;     // TSCがなければ負
+} bench_result_t;
+
+static volatile size_t bench_sink;
+
+// dataをbuffer_sizeずつ区切って変換し続け、入力側のバイト数で速度を求める。
+// デコードでは、中継と同じように次の区切りをremaining_bytesの分だけ戻す
+static bench_result_t run_case(encode_method_t method, int encoding, const unsigned char *data, size_t len,
+                               size_t buffer_size, unsigned char *output, double seconds) {
+    bench_result_t result;
+    size_t processed = 0;
+    size_t remaining_bytes = 0;
+    double start = now_seconds();
+    unsigned long long start_cycles = cycles();
+    double elapsed;
+
+    do {
+        size_t offset = 0;
+        while (offset < len) {
+            size_t chunk = (len - offset < buffer_size) ? len - offset : buffer_size;
+            if (encoding) {
+                bench_sink += encode_data(method, data + offset, chunk, output);
+            } else {
+                bench_sink += decode_data(method, data + offset, chunk, output, &remaining_bytes);
+                if (remaining_bytes == chunk) {
+                    break; // 末尾の不完全な行
+                }
+                chunk -= remaining_bytes;
+            }
+            offset += chunk;
+            processed += chunk;
+        }
+        elapsed = now_seconds() - start;
+    } while (elapsed < seconds);
+
+    result.mb_per_s = processed / elapsed / 1e6;
+    result.cycles_per_byte = -1;
+#ifdef BENCH_HAVE_TSC
+    result.cycles_per_byte = (double)(cycles() - start_cycles) / processed;
+#else
+    (void)start_cycles;
+#endif
+    return result;
+}
+
+static void bench_method(encode_method_t method, simd_level_t level, profile_t profile,
+                         const unsigned char *data, size_t len, unsigned char *encoded,
+                         unsigned char *output, double seconds) {
+    size_t encoded_len = encode_data(method, data, len, encoded);
+    double expansion = (double)encoded_len / len;
+
+    for (size_t i = 0; i < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); i++) {
+        size_t buffer_size = buffer_sizes[i];
+        bench_result_t enc = run_case(method, 1, data, len, buffer_size, output, seconds);
+        // デコード側の区切りは、同じ量の元データに相当する大きさにする
+        size_t wire_size = (size_t)(buffer_size * expansion) + 1;
+        bench_result_t dec = run_case(method, 0, encoded, encoded_len, wire_size, output, seconds);
+        // デコードの速度は元データの量で表す
+        dec.mb_per_s /= expansion;
+        if (dec.cycles_per_byte >= 0) {
+            dec.cycles_per_byte *= expansion;
+        }
+
+        printf("%s,%s,%s,%lu,encode,%.1f,%.3f,%.4f\n", method_names[method], simd_level_name(level),
+               profile_names[profile], (unsigned long)buffer_size, enc.mb_per_s, enc.cycles_per_byte,
+               expansion);
+        printf("%s,%s,%s,%lu,decode,%.1f,%.3f,%.4f\n", method_names[method], simd_level_name(level),
+               profile_names[profile], (unsigned long)buffer_size, dec.mb_per_s, dec.cycles_per_byte,
+               expansion);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = (argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_MS) / 1000.0;
+    size_t len = BENCH_DATA_SIZE;
+    unsigned char *data = malloc(len);
+    // escapeの上限が一番大きい。デコードの区切りもエンコード後の大きさまで広がる
+    unsigned char *encoded = malloc(ESCAPE_ENCODE_BOUND(len));
+    unsigned char *output = malloc(ESCAPE_ENCODE_BOUND(BENCH_MAX_CHUNK) + 1);
+    simd_level_t detected = simd_detect_level();
+
+    if (!data || !encoded || !output) {
+        perror("malloc");
+        return 1;
+    }
+
+    // cycles_per_byteはTSCの周期で数える。TSCがなければ-1
+    printf("method,simd,profile,buffer_size,op,mb_per_s,cycles_per_byte,expansion\n");
+    for (int profile = PROFILE_TEXT; profile <= PROFILE_SSH; profile++) {
+        for (int method = METHOD_UUENCODE; method <= METHOD_DENSE; method++) {
+            fill_profile(data, len, (profile_t)profile, (encode_method_t)method);
+            for (int level = SIMD_NONE; level <= (int)detected; level++) {
+                if (codec_set_simd_level((simd_level_t)level) != (simd_level_t)level) continue;
+                bench_method((encode_method_t)method, (simd_level_t)level, (profile_t)profile,
+                             data, len, encoded, output, seconds);
+            }
+        }
+    }
+
+    free(data);
+    free(encoded);
+    free(output);
+    return 0;
+}
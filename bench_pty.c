@@ -0,0 +1,357 @@
+#include "trans.h"
+#include <termios.h>
+#include <netinet/tcp.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+// sshなしでトンネルを測る。from側とto側のtransを、rawモードのptyを2つつないだ
+// 経路で結び、転送ポート越しにエコーさせてgoodput、経路上の膨張率、往復時間を測る。
+//
+//   client -> [from] <-pty1-> 中継(ここでワイヤのバイト数を数える) <-pty2-> [to] -> echo
+//
+// 使い方: bench_pty [transのパス] [bulkのバイト数] [往復の回数]
+// 結果は1設定1行のCSVで標準出力に出る
+
+#define BENCH_PTY_BULK_BYTES (4 * 1024 * 1024)
+#define BENCH_PTY_RTT_SAMPLES 200
+#define BENCH_PTY_TIMEOUT_US (60LL * 1000000)
+#define PUMP_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+    unsigned char data[PUMP_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+} pump_buffer_t;
+
+// 一方向のコピー: from_fdから読んでto_fdに書く
+typedef struct {
+    int from_fd;
+    int to_fd;
+    pump_buffer_t buf;
+    unsigned long long bytes;
+} pump_t;
+
+typedef struct {
+    pid_t from_pid;
+    pid_t to_pid;
+    int client_fd;      // 転送ポートへの接続
+    int echo_fd;        // to側からの接続。読んだものを返す
+    pump_t wire_ps;     // pty1 -> pty2 (from側がエンコードした向き)
+    pump_t wire_sp;     // pty2 -> pty1
+    pump_t echo;
+} tunnel_t;
+
+static const char *methods[] = { "uuencode", "escape", "dense" };
+static const char *flushes[] = { "interactive", "bulk" };
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+static int open_raw_pty(int *master, int *slave) {
+    struct termios tio;
+
+    if (openpty(master, slave, NULL, NULL, NULL) < 0) {
+        perror("openpty");
+        return -1;
+    }
+    tcgetattr(*slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(*slave, TCSANOW, &tio);
+    return 0;
+}
+
+static int listen_loopback(int *port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("listen");
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static pid_t spawn_trans(const char *trans, int tty_fd, const char *mode, int port,
+                         const char *method, const char *flush) {
+    char port_str[16];
+    pid_t pid = fork();
+
+    if (pid != 0) {
+        return pid;
+    }
+    sprintf(port_str, "%d", port);
+    dup2(tty_fd, STDIN_FILENO);
+    dup2(tty_fd, STDOUT_FILENO);
+    for (int fd = 3; fd < 256; fd++) {
+        close(fd);
+    }
+    execl(trans, trans, "-q", "-m", mode, "-p", port_str, "-e", method, "--flush", flush, (char *)NULL);
+    perror("execl");
+    _exit(1);
+}
+
+// 読めるだけ読み、書けるだけ書く。相手がいなくなったら-1を返す
+static int pump_run(pump_t *p) {
+    if (p->buf.end < PUMP_BUFFER_SIZE) {
+        ssize_t n = read(p->from_fd, p->buf.data + p->buf.end, PUMP_BUFFER_SIZE - p->buf.end);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            return -1;
+        }
+        if (n > 0) {
+            p->buf.end += (size_t)n;
+            p->bytes += (unsigned long long)n;
+        }
+    }
+    if (p->buf.end > p->buf.start) {
+        ssize_t n = write(p->to_fd, p->buf.data + p->buf.start, p->buf.end - p->buf.start);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            return -1;
+        }
+        if (n > 0) {
+            p->buf.start += (size_t)n;
+        }
+    }
+    if (p->buf.start == p->buf.end) {
+        p->buf.start = p->buf.end = 0;
+    }
+    return 0;
+}
+
+static void pump_events(const pump_t *p, struct pollfd *in, struct pollfd *out) {
+    in->fd = p->from_fd;
+    in->events = (p->buf.end < PUMP_BUFFER_SIZE) ? POLLIN : 0;
+    out->fd = p->to_fd;
+    out->events = (p->buf.end > p->buf.start) ? POLLOUT : 0;
+}
+
+// トンネルの中継とエコーを1回分進め、clientが読めるようになるまで待つ。
+// 受け取ったバイト数を返す
+static ssize_t tunnel_step(tunnel_t *t, unsigned char *recv_buf, size_t recv_len, int want_write) {
+    struct pollfd pfds[7];
+
+    pump_events(&t->wire_ps, &pfds[0], &pfds[1]);
+    pump_events(&t->wire_sp, &pfds[2], &pfds[3]);
+    pump_events(&t->echo, &pfds[4], &pfds[5]);
+    pfds[6].fd = t->client_fd;
+    pfds[6].events = POLLIN | (want_write ? POLLOUT : 0);
+    if (poll(pfds, 7, 1000) < 0 && errno != EINTR) {
+        return -1;
+    }
+    if (pump_run(&t->wire_ps) < 0 || pump_run(&t->wire_sp) < 0 || pump_run(&t->echo) < 0) {
+        return -1;
+    }
+
+    ssize_t n = read(t->client_fd, recv_buf, recv_len);
+    if (n == 0) {
+        return -1;
+    }
+    return (n < 0) ? ((errno == EAGAIN || errno == EINTR) ? 0 : -1) : n;
+}
+
+static int connect_retry(int port) {
+    struct sockaddr_in addr;
+    long long deadline = now_us() + 5 * 1000000;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    while (now_us() < deadline) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+static int free_port(void) {
+    int port;
+    int fd = listen_loopback(&port);
+    close(fd);
+    return port;
+}
+
+static int tunnel_open(tunnel_t *t, const char *trans, const char *method, const char *flush) {
+    int master1, slave1, master2, slave2;
+    int echo_port;
+    int forward_port = free_port();
+
+    memset(t, 0, sizeof(*t));
+    t->client_fd = t->echo_fd = -1;
+    int listen_fd = listen_loopback(&echo_port);
+    if (listen_fd < 0 || open_raw_pty(&master1, &slave1) < 0 || open_raw_pty(&master2, &slave2) < 0) {
+        return -1;
+    }
+    t->wire_ps.from_fd = t->wire_sp.to_fd = master1;
+    t->wire_sp.from_fd = t->wire_ps.to_fd = master2;
+
+    t->to_pid = spawn_trans(trans, slave2, "to", echo_port, method, flush);
+    t->from_pid = spawn_trans(trans, slave1, "from", forward_port, method, flush);
+    close(slave1);
+    close(slave2);
+
+    struct pollfd pfd = { listen_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 5000) <= 0) {
+        fprintf(stderr, "to side did not connect\n");
+        close(listen_fd);
+        return -1;
+    }
+    t->echo_fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    t->client_fd = connect_retry(forward_port);
+    if (t->echo_fd < 0 || t->client_fd < 0) {
+        fprintf(stderr, "could not connect through the tunnel\n");
+        return -1;
+    }
+
+    t->echo.from_fd = t->echo_fd;
+    t->echo.to_fd = t->echo_fd;
+    set_nonblocking(master1);
+    set_nonblocking(master2);
+    set_nonblocking(t->echo_fd);
+    set_nonblocking(t->client_fd);
+    return 0;
+}
+
+static void tunnel_close(tunnel_t *t) {
+    if (t->client_fd >= 0) close(t->client_fd);
+    if (t->echo_fd >= 0) close(t->echo_fd);
+    if (t->from_pid > 0) kill(t->from_pid, SIGTERM);
+    if (t->to_pid > 0) kill(t->to_pid, SIGTERM);
+    if (t->from_pid > 0) waitpid(t->from_pid, NULL, 0);
+    if (t->to_pid > 0) waitpid(t->to_pid, NULL, 0);
+    if (t->wire_ps.from_fd > 0) close(t->wire_ps.from_fd);
+    if (t->wire_sp.from_fd > 0) close(t->wire_sp.from_fd);
+}
+
+static int compare_long_long(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// 1バイトずつ送って返ってくるまでの時間を測る
+static int measure_rtt(tunnel_t *t, long long *samples, int count) {
+    unsigned char buf[256];
+
+    for (int i = 0; i < count; i++) {
+        unsigned char c = (unsigned char)i;
+        long long start = now_us();
+        if (write(t->client_fd, &c, 1) != 1) {
+            return -1;
+        }
+        ssize_t n;
+        while ((n = tunnel_step(t, buf, sizeof(buf), 0)) == 0) {
+            if (now_us() - start > BENCH_PTY_TIMEOUT_US) {
+                return -1;
+            }
+        }
+        if (n != 1 || buf[0] != c) {
+            return -1;
+        }
+        samples[i] = now_us() - start;
+    }
+    qsort(samples, (size_t)count, sizeof(*samples), compare_long_long);
+    return 0;
+}
+
+// lenバイトを送り、同じものが返ってくるまでの時間を測る
+static double measure_bulk(tunnel_t *t, const unsigned char *data, size_t len, double *expansion) {
+    unsigned char buf[PUMP_BUFFER_SIZE];
+    size_t sent = 0, received = 0;
+    unsigned long long wire_start = t->wire_ps.bytes;
+    long long start = now_us();
+
+    while (received < len) {
+        if (sent < len) {
+            ssize_t n = write(t->client_fd, data + sent, len - sent);
+            if (n > 0) {
+                sent += (size_t)n;
+            } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+        }
+        ssize_t n = tunnel_step(t, buf, sizeof(buf), sent < len);
+        if (n < 0 || now_us() - start > BENCH_PTY_TIMEOUT_US) {
+            return -1;
+        }
+        if (n > 0) {
+            if ((size_t)n > len - received || memcmp(buf, data + received, (size_t)n) != 0) {
+                fprintf(stderr, "data corrupted at offset %lu\n", (unsigned long)received);
+                return -1;
+            }
+            received += (size_t)n;
+        }
+    }
+    *expansion = (double)(t->wire_ps.bytes - wire_start) / len;
+    return len / ((now_us() - start) / 1e6) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    const char *trans = (argc > 1) ? argv[1] : "./trans";
+    size_t bulk_len = (argc > 2) ? (size_t)atol(argv[2]) : BENCH_PTY_BULK_BYTES;
+    int samples = (argc > 3) ? atoi(argv[3]) : BENCH_PTY_RTT_SAMPLES;
+    unsigned char *data = malloc(bulk_len);
+    long long *rtt = malloc(sizeof(*rtt) * (size_t)samples);
+    unsigned int state = 0x12345678;
+    int failed = 0;
+
+    if (!data || !rtt || samples <= 0) {
+        fprintf(stderr, "usage: %s [trans] [bulk bytes] [rtt samples]\n", argv[0]);
+        return 1;
+    }
+    // 暗号文に似た一様乱数を流す
+    for (size_t i = 0; i < bulk_len; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        data[i] = (unsigned char)state;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("method,flush,goodput_mb_s,expansion,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us\n");
+    for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+        for (size_t f = 0; f < sizeof(flushes) / sizeof(flushes[0]); f++) {
+            tunnel_t t;
+            double expansion = 0;
+            double goodput = -1;
+            int ok = tunnel_open(&t, trans, methods[m], flushes[f]) == 0 &&
+                     measure_rtt(&t, rtt, samples) == 0 &&
+                     (goodput = measure_bulk(&t, data, bulk_len, &expansion)) >= 0;
+            tunnel_close(&t);
+
+            if (!ok) {
+                printf("%s,%s,fail,,,,,\n", methods[m], flushes[f]);
+                failed = 1;
+            } else {
+                printf("%s,%s,%.2f,%.4f,%lld,%lld,%lld,%lld\n", methods[m], flushes[f], goodput, expansion,
+                       rtt[samples / 2], rtt[samples * 9 / 10], rtt[samples * 99 / 100], rtt[samples - 1]);
+            }
+            fflush(stdout);
+        }
+    }
+
+    free(data);
+    free(rtt);
+    return failed;
+}
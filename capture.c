@@ -0,0 +1,284 @@
+#include "trans.h"
+#include <pthread.h>
+
+// 通信内容のバイナリキャプチャ。
+// 記録は確保済みのリングバッファに積み、書き出しは別スレッドで行う。
+//
+// ファイル: "TRANSCAP" バージョン(1) プレフィックス長(1) プレフィックス
+// レコード: 種別(1) 長さ(4, little endian) 時刻(8, little endianのUNIX時刻μs) データ
+
+#define CAPTURE_MAGIC "TRANSCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_RECORD_HEADER_SIZE 13
+#define CAPTURE_RING_SIZE (4 * 1024 * 1024)
+// これより長いデータは複数のレコードに分ける (テキストではタグごとに連結されるので同じになる)
+#define CAPTURE_MAX_RECORD (CAPTURE_RING_SIZE / 4)
+
+struct capture {
+    FILE *file;
+    unsigned char *ring;
+    size_t head;                // 次に書き込む位置 (累積)
+    size_t tail;                // 次にファイルへ書き出す位置 (累積)
+    int closing;
+    pthread_mutex_t lock;
+    pthread_cond_t readable;    // 書き出すものがある
+    pthread_cond_t writable;    // リングに空きができた
+    pthread_t writer;
+};
+
+static const char *capture_tags[] = {
+    [CAPTURE_MESSAGE] = "",
+    [CAPTURE_TOENC] = "toenc:",
+    [CAPTURE_ENC_D] = "enc-d:",
+    [CAPTURE_TODEC] = "todec:",
+    [CAPTURE_DEC_D] = "dec-d:"
+};
+
+static long long realtime_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void put_le(unsigned char *p, unsigned long long value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static unsigned long long get_le(const unsigned char *p, int bytes) {
+    unsigned long long value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+// リングの内容をファイルに書き出し続ける
+static void *capture_writer(void *arg) {
+    capture_t *cap = arg;
+
+    pthread_mutex_lock(&cap->lock);
+    while (1) {
+        while (cap->head == cap->tail && !cap->closing) {
+            fflush(cap->file);
+            pthread_cond_wait(&cap->readable, &cap->lock);
+        }
+        if (cap->head == cap->tail) {
+            break; // closingで空になった
+        }
+
+        // 折り返しまでの連続した部分をロックの外で書く
+        size_t offset = cap->tail % CAPTURE_RING_SIZE;
+        size_t len = cap->head - cap->tail;
+        if (len > CAPTURE_RING_SIZE - offset) {
+            len = CAPTURE_RING_SIZE - offset;
+        }
+        pthread_mutex_unlock(&cap->lock);
+        fwrite(cap->ring + offset, 1, len, cap->file);
+        pthread_mutex_lock(&cap->lock);
+
+        cap->tail += len;
+        pthread_cond_signal(&cap->writable);
+    }
+    pthread_mutex_unlock(&cap->lock);
+    fflush(cap->file);
+    return NULL;
+}
+
+capture_t *capture_open(const char *path, const config_t *config) {
+    capture_t *cap = calloc(1, sizeof(*cap));
+    if (!cap) {
+        perror("calloc");
+        return NULL;
+    }
+    cap->file = fopen(path, "wb");
+    cap->ring = malloc(CAPTURE_RING_SIZE);
+    if (!cap->file || !cap->ring) {
+        perror(path);
+        if (cap->file) fclose(cap->file);
+        free(cap->ring);
+        free(cap);
+        return NULL;
+    }
+
+    const char *prefix = (config && config->log_prefix) ? config->log_prefix : "";
+    size_t prefix_len = strlen(prefix) > 255 ? 255 : strlen(prefix);
+    unsigned char header[10];
+    memcpy(header, CAPTURE_MAGIC, 8);
+    header[8] = CAPTURE_VERSION;
+    header[9] = (unsigned char)prefix_len;
+    fwrite(header, 1, sizeof(header), cap->file);
+    fwrite(prefix, 1, prefix_len, cap->file);
+
+    pthread_mutex_init(&cap->lock, NULL);
+    pthread_cond_init(&cap->readable, NULL);
+    pthread_cond_init(&cap->writable, NULL);
+    if (pthread_create(&cap->writer, NULL, capture_writer, cap) != 0) {
+        perror("pthread_create");
+        fclose(cap->file);
+        free(cap->ring);
+        free(cap);
+        return NULL;
+    }
+    return cap;
+}
+
+void capture_close(capture_t *cap) {
+    if (!cap) return;
+
+    pthread_mutex_lock(&cap->lock);
+    cap->closing = 1;
+    pthread_cond_signal(&cap->readable);
+    pthread_mutex_unlock(&cap->lock);
+    pthread_join(cap->writer, NULL);
+
+    pthread_mutex_destroy(&cap->lock);
+    pthread_cond_destroy(&cap->readable);
+    pthread_cond_destroy(&cap->writable);
+    fclose(cap->file);
+    free(cap->ring);
+    free(cap);
+}
+
+static void ring_copy(capture_t *cap, const unsigned char *data, size_t len) {
+    size_t offset = cap->head % CAPTURE_RING_SIZE;
+    size_t first = (len < CAPTURE_RING_SIZE - offset) ? len : CAPTURE_RING_SIZE - offset;
+
+    memcpy(cap->ring + offset, data, first);
+    memcpy(cap->ring, data + first, len - first);
+    cap->head += len;
+}
+
+void capture_record(capture_t *cap, capture_type_t type, const void *data, size_t len) {
+    const unsigned char *p = data;
+    long long now;
+
+    if (!cap || len == 0) return;
+
+    now = realtime_us();
+    do {
+        size_t chunk = (len < CAPTURE_MAX_RECORD) ? len : CAPTURE_MAX_RECORD;
+        unsigned char header[CAPTURE_RECORD_HEADER_SIZE];
+        header[0] = (unsigned char)type;
+        put_le(header + 1, chunk, 4);
+        put_le(header + 5, (unsigned long long)now, 8);
+
+        pthread_mutex_lock(&cap->lock);
+        // 書き出しが追いつかなければ待つ。記録を落とすと--check-dumpで照合できなくなる
+        while (CAPTURE_RING_SIZE - (cap->head - cap->tail) < sizeof(header) + chunk) {
+            pthread_cond_wait(&cap->writable, &cap->lock);
+        }
+        ring_copy(cap, header, sizeof(header));
+        ring_copy(cap, p, chunk);
+        pthread_cond_signal(&cap->readable);
+        pthread_mutex_unlock(&cap->lock);
+
+        p += chunk;
+        len -= chunk;
+    } while (len > 0);
+}
+
+void capture_message(capture_t *cap, const char *message) {
+    if (message) {
+        capture_record(cap, CAPTURE_MESSAGE, message, strlen(message));
+    }
+}
+
+// メモリ上のキャプチャ (--check-dump)。キャプチャならprefixに接頭辞を入れて最初のレコードの位置を返し、
+// 違えば0を返す。prefixは256バイト
+size_t capture_map_header(const unsigned char *map, size_t size, char *prefix) {
+    if (size < 10 || memcmp(map, CAPTURE_MAGIC, 8) != 0 || map[8] != CAPTURE_VERSION ||
+        size < 10 + (size_t)map[9]) {
+        return 0;
+    }
+    memcpy(prefix, map + 10, map[9]);
+    prefix[map[9]] = '\0';
+    return 10 + (size_t)map[9];
+}
+
+// *offsetのレコードを読んで次へ進める。1を返し、終わりなら0、壊れていれば-1を返す
+int capture_map_record(const unsigned char *map, size_t size, size_t *offset, capture_type_t *type,
+                       long long *time_us, const unsigned char **data, size_t *len) {
+    const unsigned char *header = map + *offset;
+
+    if (*offset == size) {
+        return 0;
+    }
+    if (size - *offset < CAPTURE_RECORD_HEADER_SIZE) {
+        return -1;
+    }
+    *len = (size_t)get_le(header + 1, 4);
+    if (header[0] > CAPTURE_DEC_D || *len > CAPTURE_MAX_RECORD ||
+        size - *offset - CAPTURE_RECORD_HEADER_SIZE < *len) {
+        return -1;
+    }
+    *type = (capture_type_t)header[0];
+    *time_us = (long long)get_le(header + 5, 8);
+    *data = header + CAPTURE_RECORD_HEADER_SIZE;
+    *offset += CAPTURE_RECORD_HEADER_SIZE + *len;
+    return 1;
+}
+
+// キャプチャを従来のテキストログの形式で書き出す
+int capture_convert(const char *path, FILE *out) {
+    FILE *in = fopen(path, "rb");
+    unsigned char header[CAPTURE_RECORD_HEADER_SIZE];
+    char prefix[256];
+    unsigned char *data = malloc(CAPTURE_MAX_RECORD);
+    int result = 0;
+
+    if (!in || !data) {
+        perror(path);
+        if (in) fclose(in);
+        free(data);
+        return -1;
+    }
+    if (fread(header, 1, 10, in) != 10 || memcmp(header, CAPTURE_MAGIC, 8) != 0 ||
+        header[8] != CAPTURE_VERSION || fread(prefix, 1, header[9], in) != header[9]) {
+        fprintf(stderr, "%s: not a trans capture file\n", path);
+        fclose(in);
+        free(data);
+        return -1;
+    }
+    prefix[header[9]] = '\0';
+
+    while (fread(header, 1, sizeof(header), in) == sizeof(header)) {
+        unsigned int type = header[0];
+        size_t len = (size_t)get_le(header + 1, 4);
+        long long us = (long long)get_le(header + 5, 8);
+        time_t seconds = (time_t)(us / 1000000);
+        struct tm *tm_info = localtime(&seconds);
+
+        if (type > CAPTURE_DEC_D || len > CAPTURE_MAX_RECORD || fread(data, 1, len, in) != len) {
+            fprintf(stderr, "%s: truncated or corrupted record\n", path);
+            result = -1;
+            break;
+        }
+
+        fprintf(out, "%02d:%02d:%02d.%06d %s:%s", tm_info->tm_hour, tm_info->tm_min, tm_info->tm_sec,
+                (int)(us % 1000000), prefix, capture_tags[type]);
+        if (type == CAPTURE_MESSAGE) {
+            fwrite(data, 1, len, out);
+            continue;
+        }
+        // 1バイトずつfprintfせず、行をまとめて作る
+        static const char hex[] = "0123456789abcdef";
+        char line[3 * 64];
+        size_t pos = 0;
+        for (size_t i = 0; i < len; i++) {
+            line[pos++] = hex[data[i] >> 4];
+            line[pos++] = hex[data[i] & 0x0f];
+            line[pos++] = (i + 1 < len) ? ' ' : '\n';
+            if (pos == sizeof(line)) {
+                fwrite(line, 1, pos, out);
+                pos = 0;
+            }
+        }
+        fwrite(line, 1, pos, out);
+    }
+
+    fclose(in);
+    free(data);
+    return result;
+}
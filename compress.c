@@ -0,0 +1,121 @@
+#include "trans.h"
+#include <zlib.h>
+
+// 展開結果を一度に返す大きさ
+#define INFLATE_CHUNK_SIZE (64 * 1024)
+
+// 圧縮したストリームの最初の1バイト: 上位4ビットが方式、下位4ビットが圧縮レベル。
+// zlibのストリームの最初のバイトは上位4ビットが7以下なので、ヘッダのない古い版の-zとも区別できる。
+// レベルは両端で違ってよい (展開はレベルによらない) ので、知らせるだけで比べない
+#define COMPRESS_METHOD_ZLIB 0xa
+
+struct compress_stage {
+    z_stream stream;
+    int deflating;
+    int header_done;            // ヘッダを書いた、または読んだ
+    int level;                  // 圧縮側: 自分のレベル、展開側: 相手が知らせたレベル
+    unsigned char *buffer;      // 展開結果の置き場 (展開側のみ)
+};
+
+compress_stage_t *compress_stage_new(int deflating, int level) {
+    compress_stage_t *stage = calloc(1, sizeof(*stage));
+    if (!stage) {
+        return NULL;
+    }
+
+    stage->deflating = deflating;
+    stage->level = deflating ? level : -1;
+    if (deflating) {
+        if (deflateInit(&stage->stream, level) != Z_OK) {
+            free(stage);
+            return NULL;
+        }
+    } else {
+        stage->buffer = malloc(INFLATE_CHUNK_SIZE);
+        if (!stage->buffer || inflateInit(&stage->stream) != Z_OK) {
+            free(stage->buffer);
+            free(stage);
+            return NULL;
+        }
+    }
+    return stage;
+}
+
+void compress_stage_free(compress_stage_t *stage) {
+    if (!stage) return;
+
+    if (stage->deflating) {
+        deflateEnd(&stage->stream);
+    } else {
+        inflateEnd(&stage->stream);
+    }
+    free(stage->buffer);
+    free(stage);
+}
+
+size_t compress_bound(size_t input_len) {
+    // 圧縮できないデータはstored blockになる。zlibのヘッダとsync flushの空ブロック、-zのヘッダ分を足す
+    return input_len + input_len / 8 + 64 + 1;
+}
+
+// ストリームの最初の1バイトから相手の圧縮レベルを読む。-zの圧縮でなければ-1を返す
+int compress_parse_header(unsigned char header) {
+    if ((header >> 4) != COMPRESS_METHOD_ZLIB || (header & 0x0f) > 9) {
+        return -1;
+    }
+    return header & 0x0f;
+}
+
+size_t compress_stage_deflate(compress_stage_t *stage, const unsigned char *input, size_t input_len,
+                              unsigned char *output) {
+    size_t output_size = compress_bound(input_len);
+    size_t header_len = 0;
+
+    if (!stage->header_done) {
+        output[header_len++] = (unsigned char)(COMPRESS_METHOD_ZLIB << 4 | stage->level);
+        stage->header_done = 1;
+    }
+    stage->stream.next_in = (unsigned char *)input;
+    stage->stream.avail_in = (uInt)input_len;
+    stage->stream.next_out = output + header_len;
+    stage->stream.avail_out = (uInt)(output_size - header_len);
+
+    // Z_SYNC_FLUSHで、ここまでの入力を相手がすぐに展開できるようにする。
+    // 辞書はリセットしないので、次のflush以降も過去のデータを参照できる
+    int ret = deflate(&stage->stream, Z_SYNC_FLUSH);
+    if ((ret != Z_OK && ret != Z_BUF_ERROR) || stage->stream.avail_in != 0 || stage->stream.avail_out == 0) {
+        fprintf(stderr, "deflate failed: %d\n", ret);
+        exit(1);
+    }
+    return output_size - stage->stream.avail_out;
+}
+
+size_t compress_stage_inflate(compress_stage_t *stage, const unsigned char **input, size_t *input_len,
+                              const unsigned char **output) {
+    if (!stage->header_done && *input_len > 0) {
+        stage->level = compress_parse_header(**input);
+        if (stage->level < 0) {
+            fprintf(stderr, "compress: the peer is not sending -z compressed data (first byte 0x%02x). "
+                            "Enable -z on both ends\n", **input);
+            exit(1);
+        }
+        stage->header_done = 1;
+        (*input)++;
+        (*input_len)--;
+    }
+    stage->stream.next_in = (unsigned char *)*input;
+    stage->stream.avail_in = (uInt)*input_len;
+    stage->stream.next_out = stage->buffer;
+    stage->stream.avail_out = INFLATE_CHUNK_SIZE;
+
+    int ret = inflate(&stage->stream, Z_SYNC_FLUSH);
+    if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) {
+        fprintf(stderr, "inflate failed: %s\n", stage->stream.msg ? stage->stream.msg : "unknown error");
+        exit(1);
+    }
+
+    *input += *input_len - stage->stream.avail_in;
+    *input_len = stage->stream.avail_in;
+    *output = stage->buffer;
+    return INFLATE_CHUNK_SIZE - stage->stream.avail_out;
+}
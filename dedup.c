@@ -0,0 +1,372 @@
+#include "trans.h"
+#include <stdint.h>
+
+// --dedup: 送る側は内容で決まる位置 (FastCDC) でストリームをチャンクに分け、
+// 両端が同じ順で溜めるキャッシュに既にあるチャンクは、番号だけを送る。
+//
+//   開始: varint キャッシュの大きさ (KB単位)
+//   記録: varint (長さ << 2 | 終わり << 1)  データ   リテラル
+//         varint (遡る数 << 2 | 1)                  参照 (1で直前に加えたチャンク)
+//         varint (遡る数 << 2 | 3)                  参照したチャンクの、送った分より後
+//
+// flushはチャンクの途中でも待たずに送るので、チャンクは複数のリテラルに分かれることがある。
+// 境界は前のflushから続けて探すので、flushの区切りが変わっても同じ内容なら同じ位置で切れる。
+// 終わりの付いたリテラルでチャンクが閉じ、両端ともその時点でキャッシュに加える。
+// 閉じたチャンクがキャッシュにあれば、残りは参照で送り、キャッシュには加えない。
+// キャッシュは大きさが一定のリングで、古いチャンクから上書きする。受け取る側は
+// 送る側が知らせた大きさでキャッシュを作るので、両端で同じチャンクが同じ順に消える。
+// ただし自分の--dedupより大きなキャッシュは作らない
+
+#define DEDUP_MIN_CHUNK 2048
+#define DEDUP_AVG_CHUNK 8192
+#define DEDUP_MAX_CHUNK (64 * 1024)
+
+// FastCDCの正規化した判定。平均より前は厳しく、後は緩くして大きさを平均に寄せる
+#define DEDUP_MASK_S 0x0003590703530000ULL
+#define DEDUP_MASK_L 0x0000d90003530000ULL
+
+typedef struct {
+    size_t offset;
+    size_t len;
+    uint64_t hash;
+} dedup_chunk_t;
+
+struct dedup_stage {
+    int encoding;
+    int started;                    // 開始の記録を送った、または受け取った
+    unsigned char *arena;           // チャンクの中身。先頭から順に置き、収まらなければ0に戻る
+    size_t arena_size;
+    size_t head;
+    dedup_chunk_t *chunks;          // 番号 % max_chunks の位置に置く
+    size_t max_chunks;
+    unsigned long long first_id;    // キャッシュに残っている最も古い番号
+    unsigned long long next_id;
+    unsigned long long *index;      // 送る側: ハッシュ -> 番号+1 (同じ場所に来たら上書き)
+    size_t index_mask;
+    size_t cache_limit;             // 受ける側: 相手が知らせてよい大きさの上限 (自分の--dedup)
+    bytebuf_t open;                 // 閉じていないチャンクの、送った/受け取った分
+    uint64_t fp;                    // 送る側: openの続きから境界を探すローリングハッシュ
+    // 受ける側: 読みかけの記録
+    unsigned long long header;
+    int header_shift;
+    size_t literal_left;
+    int literal_ends;               // 読み終えたらチャンクを閉じる
+    unsigned long long refs;        // 送る側: 参照で送ったチャンク
+    unsigned long long saved;       // 送る側: 参照で送らずに済んだバイト数
+};
+
+static uint64_t gear[256];
+
+static void init_gear(void) {
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+    if (gear[0] != 0) return;
+    for (int i = 0; i < 256; i++) {
+        // splitmix64
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// openの続きから境界を探す。見つかれば1を返し、*nにチャンクの残りの長さを入れる。
+// 見つからなければ全部をopenに続くものとして*n = lenにする
+static int find_boundary(dedup_stage_t *stage, const unsigned char *p, size_t len, size_t *n) {
+    size_t pos = bytebuf_len(&stage->open);
+    uint64_t fp = stage->fp;
+
+    // 最小の大きさまではハッシュも計算しない
+    for (size_t i = (pos < DEDUP_MIN_CHUNK) ? DEDUP_MIN_CHUNK - pos : 0; i < len; i++) {
+        size_t at = pos + i;
+        fp = (fp << 1) + gear[p[i]];
+        if (!(fp & ((at < DEDUP_AVG_CHUNK) ? DEDUP_MASK_S : DEDUP_MASK_L)) || at + 1 >= DEDUP_MAX_CHUNK) {
+            stage->fp = 0;
+            *n = i + 1;
+            return 1;
+        }
+    }
+    stage->fp = fp;
+    *n = len;
+    return 0;
+}
+
+static uint64_t chunk_hash(const unsigned char *p, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ len;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; i < len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h ^ (h >> 32);
+}
+
+static dedup_chunk_t *chunk_at(dedup_stage_t *stage, unsigned long long id) {
+    return &stage->chunks[id % stage->max_chunks];
+}
+
+// 大きさsizeのキャッシュを作る。送る側はチャンクを探す索引も作る
+static int cache_init(dedup_stage_t *stage, size_t size) {
+    stage->arena_size = size;
+    stage->max_chunks = size / DEDUP_MIN_CHUNK + 1;
+    stage->arena = malloc(size);
+    stage->chunks = calloc(stage->max_chunks, sizeof(*stage->chunks));
+    if (stage->encoding) {
+        size_t buckets = 1024;
+        while (buckets < stage->max_chunks * 2) {
+            buckets *= 2;
+        }
+        stage->index = calloc(buckets, sizeof(*stage->index));
+        stage->index_mask = buckets - 1;
+    }
+    if (!stage->arena || !stage->chunks || (stage->encoding && !stage->index)) {
+        perror("malloc");
+        return -1;
+    }
+    return 0;
+}
+
+// lenバイトのチャンクを加え、中身の置き場を返す。重なる古いチャンクは捨てる。
+// 両端で同じ順に呼ぶので、同じチャンクが同じ番号で残る
+static unsigned char *cache_insert(dedup_stage_t *stage, size_t len, uint64_t hash) {
+    if (stage->head + len > stage->arena_size) {
+        // 末尾の余りにある、前の周のチャンクを捨てて先頭に戻る
+        while (stage->first_id < stage->next_id && chunk_at(stage, stage->first_id)->offset >= stage->head) {
+            stage->first_id++;
+        }
+        stage->head = 0;
+    }
+    while (stage->first_id < stage->next_id) {
+        const dedup_chunk_t *oldest = chunk_at(stage, stage->first_id);
+        if (stage->next_id - stage->first_id < stage->max_chunks &&
+            !(oldest->offset >= stage->head && oldest->offset < stage->head + len)) {
+            break;
+        }
+        stage->first_id++;
+    }
+
+    dedup_chunk_t *chunk = chunk_at(stage, stage->next_id);
+    chunk->offset = stage->head;
+    chunk->len = len;
+    chunk->hash = hash;
+    if (stage->index) {
+        stage->index[hash & stage->index_mask] = stage->next_id + 1;
+    }
+    stage->next_id++;
+    stage->head += len;
+    return stage->arena + chunk->offset;
+}
+
+// 送る側: 同じ中身のチャンクがキャッシュにあれば、その番号+1を返す
+static unsigned long long cache_find(dedup_stage_t *stage, const unsigned char *p, size_t len, uint64_t hash) {
+    unsigned long long slot = stage->index[hash & stage->index_mask];
+
+    if (slot == 0 || slot - 1 < stage->first_id) {
+        return 0;
+    }
+    const dedup_chunk_t *chunk = chunk_at(stage, slot - 1);
+    if (chunk->hash != hash || chunk->len != len || memcmp(stage->arena + chunk->offset, p, len) != 0) {
+        return 0;
+    }
+    return slot;
+}
+
+static void put_varint(bytebuf_t *out, unsigned long long value) {
+    unsigned char buf[10];
+    size_t n = 0;
+
+    while (value >= 0x80) {
+        buf[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (unsigned char)value;
+    bytebuf_append(out, buf, n);
+}
+
+static void broken_stream(const char *reason) {
+    fprintf(stderr, "dedup: broken stream: %s\n", reason);
+    exit(1);
+}
+
+// cache_sizeは送る側が使うキャッシュの大きさ。受ける側は相手が知らせた大きさを、
+// cache_sizeまで受け入れて使う
+dedup_stage_t *dedup_stage_new(int encoding, size_t cache_size) {
+    dedup_stage_t *stage = calloc(1, sizeof(*stage));
+    if (!stage) {
+        perror("calloc");
+        return NULL;
+    }
+    stage->encoding = encoding;
+    stage->cache_limit = cache_size;
+    if (encoding) {
+        init_gear();
+        if (cache_init(stage, cache_size) < 0) {
+            dedup_stage_free(stage);
+            return NULL;
+        }
+    }
+    return stage;
+}
+
+void dedup_stage_free(dedup_stage_t *stage) {
+    if (!stage) return;
+
+    free(stage->arena);
+    free(stage->chunks);
+    free(stage->index);
+    bytebuf_free(&stage->open);
+    free(stage);
+}
+
+static void put_literal(bytebuf_t *out, const unsigned char *data, size_t len, int ends) {
+    put_varint(out, ((unsigned long long)len << 2) | ((unsigned long long)ends << 1));
+    bytebuf_append(out, data, len);
+}
+
+// openに続けたチャンクを閉じてキャッシュに加える
+static void close_chunk(dedup_stage_t *stage) {
+    size_t len = bytebuf_len(&stage->open);
+    const unsigned char *chunk = stage->open.data + stage->open.start;
+
+    memcpy(cache_insert(stage, len, stage->index ? chunk_hash(chunk, len) : 0), chunk, len);
+    bytebuf_consume(&stage->open, len);
+}
+
+// flushした単位をチャンクに分けて記録をoutに書く。閉じなかった末尾も待たずに送る
+void dedup_stage_encode(dedup_stage_t *stage, const unsigned char *data, size_t len, bytebuf_t *out) {
+    if (!stage->started) {
+        put_varint(out, stage->arena_size / 1024);
+        stage->started = 1;
+    }
+    while (len > 0) {
+        size_t n;
+        int ends = find_boundary(stage, data, len, &n);
+        if (ends && bytebuf_len(&stage->open) == 0) {
+            // チャンクがまるごとこのflushにある。キャッシュにあれば参照で送る
+            uint64_t hash = chunk_hash(data, n);
+            unsigned long long slot = cache_find(stage, data, n, hash);
+            if (slot) {
+                put_varint(out, ((stage->next_id - (slot - 1)) << 2) | 1);
+                stats_add(&stage->refs, 1);
+                stats_add(&stage->saved, n);
+            } else {
+                memcpy(cache_insert(stage, n, hash), data, n);
+                put_literal(out, data, n, 1);
+            }
+        } else if (ends) {
+            // 前のflushから続くチャンクが閉じた。キャッシュにあれば送っていない分だけを参照で送る
+            size_t sent = bytebuf_len(&stage->open);
+            bytebuf_append(&stage->open, data, n);
+            const unsigned char *chunk = stage->open.data + stage->open.start;
+            uint64_t hash = chunk_hash(chunk, sent + n);
+            unsigned long long slot = cache_find(stage, chunk, sent + n, hash);
+            if (slot) {
+                put_varint(out, ((stage->next_id - (slot - 1)) << 2) | 3);
+                stats_add(&stage->refs, 1);
+                stats_add(&stage->saved, n);
+                bytebuf_consume(&stage->open, sent + n);
+            } else {
+                put_literal(out, data, n, 1);
+                close_chunk(stage);
+            }
+        } else {
+            put_literal(out, data, n, 0);
+            bytebuf_append(&stage->open, data, n);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// 届いた記録を元のデータに戻してoutに書く。途中で切れた記録は次の呼び出しへ持ち越す
+void dedup_stage_decode(dedup_stage_t *stage, const unsigned char *data, size_t len, bytebuf_t *out) {
+    while (len > 0) {
+        if (stage->literal_left > 0) {
+            size_t n = (len < stage->literal_left) ? len : stage->literal_left;
+            bytebuf_append(out, data, n);
+            bytebuf_append(&stage->open, data, n);
+            stage->literal_left -= n;
+            data += n;
+            len -= n;
+            if (stage->literal_left == 0 && stage->literal_ends) {
+                close_chunk(stage);
+            }
+            continue;
+        }
+
+        // varintを1バイトずつ読む
+        unsigned char c = *data++;
+        len--;
+        if (stage->header_shift > 56) {
+            broken_stream("header too long");
+        }
+        stage->header |= (unsigned long long)(c & 0x7f) << stage->header_shift;
+        stage->header_shift += 7;
+        if (c & 0x80) {
+            continue;
+        }
+        unsigned long long value = stage->header;
+        stage->header = 0;
+        stage->header_shift = 0;
+
+        if (!stage->started) {
+            if (value * 1024 < DEDUP_MAX_CHUNK) {
+                broken_stream("bad cache size");
+            }
+            if (value > stage->cache_limit / 1024) {
+                fprintf(stderr, "dedup: peer cache size %lluk exceeds the local --dedup %zuk\n", value,
+                        stage->cache_limit / 1024);
+                exit(1);
+            }
+            if (cache_init(stage, (size_t)value * 1024) < 0) {
+                exit(1);
+            }
+            stage->started = 1;
+        } else if (value & 1) {
+            unsigned long long back = value >> 2;
+            size_t sent = bytebuf_len(&stage->open);
+            if (back == 0 || back > stage->next_id - stage->first_id || (sent > 0) != ((value & 2) != 0)) {
+                broken_stream("bad reference");
+            }
+            const dedup_chunk_t *chunk = chunk_at(stage, stage->next_id - back);
+            if (sent >= chunk->len) {
+                broken_stream("bad reference");
+            }
+            bytebuf_append(out, stage->arena + chunk->offset + sent, chunk->len - sent);
+            bytebuf_consume(&stage->open, sent);
+        } else {
+            size_t literal_len = (size_t)(value >> 2);
+            if (literal_len == 0 || bytebuf_len(&stage->open) + literal_len > DEDUP_MAX_CHUNK) {
+                broken_stream("bad literal length");
+            }
+            stage->literal_left = literal_len;
+            stage->literal_ends = (int)((value >> 1) & 1);
+        }
+    }
+}
+
+// 参照で送ったチャンクの数と、それで送らずに済んだバイト数
+// キャッシュと索引、閉じていないチャンクの大きさの合計
+size_t dedup_stage_memory(const dedup_stage_t *stage) {
+    size_t total = sizeof(*stage) + stage->open.cap;
+
+    if (stage->arena) {
+        total += stage->arena_size + stage->max_chunks * sizeof(*stage->chunks);
+    }
+    if (stage->index) {
+        total += (stage->index_mask + 1) * sizeof(*stage->index);
+    }
+    return total;
+}
+
+unsigned long long dedup_stage_saved(const dedup_stage_t *stage, unsigned long long *refs) {
+    *refs = stats_get(&stage->refs);
+    return stats_get(&stage->saved);
+}
+
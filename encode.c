@@ -1,121 +1,278 @@
 #include "trans.h"
-#include <ctype.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRANS_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// CPUに合わせてcodec_set_simd_level()が選んだ実装
+static struct {
+    int initialized;
+    simd_level_t level;
+    void (*uuencode_line)(const unsigned char *, unsigned char *);
+    int (*uudecode_line)(const unsigned char *, unsigned char *);
+    size_t (*escape_encode)(const unsigned char *, size_t, unsigned char *);
+    size_t (*escape_decode)(const unsigned char *, size_t, unsigned char *, size_t *);
+    size_t (*dense_encode)(const unsigned char *, size_t, unsigned char *);
+    size_t (*dense_decode)(const unsigned char *, size_t, unsigned char *, size_t *);
+    size_t (*escape_encode_set)(const escape_set_t *, const unsigned char *, size_t, unsigned char *);
+} codec_impl;
+
+// uuencodeの1行に入る最大バイト数と、それをエンコードした文字数
+#define UU_LINE_BYTES 45
+#define UU_LINE_CHARS 60
+
+// uuencode文字の値+1 (0はuuencode文字でない)。'`'は' 'と同じく0を表す
+static const unsigned char uu_values[256] = {
+    [0x20] = 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+    17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32,
+    33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48,
+    49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64,
+    [0x60] = 1
+};
+
+static void uuencode_group(unsigned char c1, unsigned char c2, unsigned char c3, unsigned char *output) {
+    output[0] = ' ' + ((c1 >> 2) & 0x3f);
+    output[1] = ' ' + (((c1 << 4) & 0x30) | ((c2 >> 4) & 0x0f));
+    output[2] = ' ' + (((c2 << 2) & 0x3c) | ((c3 >> 6) & 0x03));
+    output[3] = ' ' + (c3 & 0x3f);
+}
+
+// 4文字をデコードしてoutputにcountバイト書く。不正な文字があれば0を返す
+static int uudecode_group(const unsigned char *input, unsigned char *output, int count) {
+    unsigned char v1 = uu_values[input[0]];
+    unsigned char v2 = uu_values[input[1]];
+    unsigned char v3 = uu_values[input[2]];
+    unsigned char v4 = uu_values[input[3]];
+
+    if (!v1 || !v2 || !v3 || !v4) {
+        return 0;
+    }
+    v1--; v2--; v3--; v4--;
+
+    output[0] = (unsigned char)((v1 << 2) | (v2 >> 4));
+    if (count > 1) {
+        output[1] = (unsigned char)((v2 << 4) | (v3 >> 2));
+    }
+    if (count > 2) {
+        output[2] = (unsigned char)((v3 << 6) | v4);
+    }
+    return 1;
+}
+
+// 45バイトの完全な行を60文字にエンコードする
+static void uuencode_line_scalar(const unsigned char *input, unsigned char *output) {
+    for (int g = 0; g < UU_LINE_BYTES / 3; g++) {
+        uuencode_group(input[0], input[1], input[2], output);
+        input += 3;
+        output += 4;
+    }
+}
+
+// 60文字を45バイトにデコードする。不正な文字があれば0を返す
+static int uudecode_line_scalar(const unsigned char *input, unsigned char *output) {
+    for (int g = 0; g < UU_LINE_BYTES / 3; g++) {
+        if (!uudecode_group(input, output, 3)) {
+            return 0;
+        }
+        input += 4;
+        output += 3;
+    }
+    return 1;
+}
+
+#ifdef TRANS_X86_SIMD
+// 12バイトを16文字に広げる。W. Mułaのbase64エンコードと同じ手順で6bitずつ取り出す
+__attribute__((target("ssse3")))
+static __m128i uuencode_12_ssse3(__m128i in) {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_add_epi8(_mm_or_si128(t1, t3), _mm_set1_epi8(' '));
+}
+
+// 16バイト読んで12バイトずつ3回、残り9バイトはスカラーで処理する。行をはみ出して読み書きしない
+__attribute__((target("ssse3")))
+static void uuencode_line_ssse3(const unsigned char *input, unsigned char *output) {
+    for (int k = 0; k < 3; k++) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(input + k * 12));
+        _mm_storeu_si128((__m128i *)(output + k * 16), uuencode_12_ssse3(in));
+    }
+    for (int g = 12; g < UU_LINE_BYTES / 3; g++) {
+        uuencode_group(input[g * 3], input[g * 3 + 1], input[g * 3 + 2], output + g * 4);
+    }
+}
+
+__attribute__((target("ssse3")))
+static int uudecode_line_ssse3(const unsigned char *input, unsigned char *output) {
+    __m128i valid = _mm_set1_epi8(-1);
+
+    for (int k = 0; k < 3; k++) {
+        __m128i v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(input + k * 16)), _mm_set1_epi8(' '));
+        // ' '..'`' の範囲外は引き算で0x40より大きくなる
+        valid = _mm_and_si128(valid, _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x40)), v));
+        v = _mm_and_si128(v, _mm_set1_epi8(0x3f));
+
+        __m128i merged = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128((__m128i *)(output + k * 12), packed);
+    }
+    if (_mm_movemask_epi8(valid) != 0xffff) {
+        return 0;
+    }
+    for (int g = 12; g < UU_LINE_BYTES / 3; g++) {
+        if (!uudecode_group(input + g * 4, output + g * 3, 3)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+#endif
 
 size_t uuencode_data(const unsigned char *input, size_t input_len, unsigned char *output) {
-    size_t i, j = 0;
+    size_t j = 0;
     size_t bytes_processed = 0;
-    
-    while (bytes_processed < input_len) {
-        size_t line_bytes = (input_len - bytes_processed > 45) ? 45 : (input_len - bytes_processed);
-        
-        // 行の長さを書く
+
+    codec_simd_level();
+
+    // 完全な行は境界チェックなしで変換する
+    while (input_len - bytes_processed >= UU_LINE_BYTES) {
+        output[j++] = ' ' + UU_LINE_BYTES;
+        codec_impl.uuencode_line(input + bytes_processed, output + j);
+        j += UU_LINE_CHARS;
+        output[j++] = '\n';
+        bytes_processed += UU_LINE_BYTES;
+    }
+
+    // 最後の短い行は足りないバイトを0で埋める
+    if (bytes_processed < input_len || input_len == 0) {
+        size_t line_bytes = input_len - bytes_processed;
+        size_t i;
+
         output[j++] = ' ' + line_bytes;
-        
         for (i = 0; i < line_bytes; i += 3) {
             unsigned char c1 = input[bytes_processed + i];
-            unsigned char c2 = (bytes_processed + i + 1 < input_len) ? input[bytes_processed + i + 1] : 0;
-            unsigned char c3 = (bytes_processed + i + 2 < input_len) ? input[bytes_processed + i + 2] : 0;
-            
-            output[j++] = ' ' + ((c1 >> 2) & 0x3f);
-            output[j++] = ' ' + (((c1 << 4) & 0x30) | ((c2 >> 4) & 0x0f));
-            output[j++] = ' ' + (((c2 << 2) & 0x3c) | ((c3 >> 6) & 0x03));
-            output[j++] = ' ' + (c3 & 0x3f);
+            unsigned char c2 = (i + 1 < line_bytes) ? input[bytes_processed + i + 1] : 0;
+            unsigned char c3 = (i + 2 < line_bytes) ? input[bytes_processed + i + 2] : 0;
+            uuencode_group(c1, c2, c3, output + j);
+            j += 4;
         }
-        
-        output[j++] = '\n';
-        bytes_processed += line_bytes;
-    }
-    
-    if (input_len == 0) {
-        output[j++] = ' ';
         output[j++] = '\n';
     }
-    
+
     output[j] = '\0';
     return j;
 }
 
-size_t uudecode_data(const unsigned char *input, size_t input_len, unsigned char *output, size_t *remaining_bytes) {
+// *skippingが真なら、壊れた行の残りを改行まで読み飛ばしてから始める。
+// 読み飛ばしている途中で入力が終わったら、*skippingを真にして返す
+static size_t uudecode_from(const unsigned char *input, size_t input_len, unsigned char *output,
+                            size_t *remaining_bytes, int *skipping) {
     size_t i = 0, j = 0;
     *remaining_bytes = 0;
-    
+
+    if (*skipping) {
+        while (i < input_len && input[i] != '\n') {
+            i++;
+        }
+        *skipping = (i == input_len);
+    }
+
     while (i < input_len) {
         if (input[i] == '\n') {
             i++;
             continue;
         }
-        
-        if (i >= input_len) break;
-        
+
         // 行の開始位置を記録
         size_t line_start = i;
-        
-        // 行長バイトがあることを確認
-        if (i >= input_len) {
-            *remaining_bytes = input_len - line_start;
-            break;
-        }
-        
         int line_len = input[i] - ' ';
         i++;
-        
-        if (line_len < 0 || line_len > 45) {
+
+        if (line_len < 0 || line_len > UU_LINE_BYTES) {
             // 不正な行長 - 行の終わりまでスキップ
             while (i < input_len && input[i] != '\n') {
                 i++;
             }
+            *skipping = (i == input_len);
             continue;
         }
 
         // 行全体が存在するかどうかをチェック
-        if (i + line_len * 4 / 3 > input_len) {
+        size_t line_chars = (size_t)(line_len + 2) / 3 * 4;
+        if (i + line_chars > input_len) {
             *remaining_bytes = input_len - line_start;
             break;
         }
 
-        int decoded = 0;
-        while (decoded < line_len) {
-            
-            unsigned char c1 = input[i] - ' ';
-            unsigned char c2 = input[i + 1] - ' ';
-            unsigned char c3 = input[i + 2] - ' ';
-            unsigned char c4 = input[i + 3] - ' ';
-            
-            if (decoded < line_len) {
-                output[j++] = ((c1 << 2) & 0xfc) | ((c2 >> 4) & 0x03);
-                decoded++;
-            }
-            if (decoded < line_len) {
-                output[j++] = ((c2 << 4) & 0xf0) | ((c3 >> 2) & 0x0f);
-                decoded++;
-            }
-            if (decoded < line_len) {
-                output[j++] = ((c3 << 6) & 0xc0) | (c4 & 0x3f);
-                decoded++;
+        int valid;
+        if (line_len == UU_LINE_BYTES) {
+            valid = codec_impl.uudecode_line(input + i, output + j);
+        } else {
+            valid = 1;
+            for (int decoded = 0; valid && decoded < line_len; decoded += 3) {
+                int count = (line_len - decoded < 3) ? line_len - decoded : 3;
+                valid = uudecode_group(input + i + decoded / 3 * 4, output + j + decoded, count);
             }
-            
-            i += 4;
         }
-        
-        // 行の残りをスキップ
-        while (i < input_len && input[i] != '\n') {
+        i += line_chars;
+
+        // 不正な文字を含む行は捨てる
+        if (valid) {
+            j += (size_t)line_len;
+        }
+
+        // 通常はすぐ後ろが改行。そうでなければ行の残りをスキップ
+        if (i < input_len && input[i] == '\n') {
             i++;
+        } else {
+            while (i < input_len && input[i] != '\n') {
+                i++;
+            }
+            *skipping = (i == input_len);
         }
     }
-    
+
     return j;
 }
 
-size_t escape_encode_data(const unsigned char *input, size_t input_len, unsigned char *output) {
-    size_t i, j = 0;
-    
-    for (i = 0; i < input_len; i++) {
+size_t uudecode_data(const unsigned char *input, size_t input_len, unsigned char *output, size_t *remaining_bytes) {
+    int skipping = 0;
+
+    codec_simd_level();
+    return uudecode_from(input, input_len, output, remaining_bytes, &skipping);
+}
+
+// エスケープ対象のバイト
+static const unsigned char escape_needed[256] = {
+    [0x0a] = 1, [0x0d] = 1, [0x1c] = 1, [0x5c] = 1, [0x7f] = 1
+};
+
+static const unsigned char hex_digits[16] = {
+    '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+};
+
+// 16進数字の値+1 (0は16進数字でない)
+static const unsigned char hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+// input[i]以降をエンコードしてoutput[j]以降に書く。SIMD版の端数処理にも使う
+static size_t escape_encode_from(const unsigned char *input, size_t i, size_t input_len,
+                                 unsigned char *output, size_t j) {
+    for (; i < input_len; i++) {
         unsigned char c = input[i];
         
-        if (c == 0x0d || c == 0x0a || c == 0x1c || c == 0x7f || c == 0x5c) {
+        if (escape_needed[c]) {
             output[j++] = 0x5c;
-            sprintf((char *)&output[j], "%02x", c);
-            j += 2;
+            output[j++] = hex_digits[c >> 4];
+            output[j++] = hex_digits[c & 0x0f];
         } else {
             output[j++] = c;
         }
@@ -125,8 +282,9 @@ size_t escape_encode_data(const unsigned char *input, size_t input_len, unsigned
     return j;
 }
 
-size_t escape_decode_data(const unsigned char *input, size_t input_len, unsigned char *output, size_t *remaining_bytes) {
-    size_t i = 0, j = 0;
+// input[i]以降をデコードしてoutput[j]以降に書く。SIMD版の端数処理にも使う
+static size_t escape_decode_from(const unsigned char *input, size_t i, size_t input_len,
+                                 unsigned char *output, size_t j, size_t *remaining_bytes) {
     *remaining_bytes = 0;
     
     while (i < input_len) {
@@ -134,15 +292,11 @@ size_t escape_decode_data(const unsigned char *input, size_t input_len, unsigned
             // エスケープシーケンスの開始
             if (i + 2 < input_len) {
                 // 完全な\xxシーケンスが利用可能
-                char hex_str[3];
-                hex_str[0] = input[i + 1];
-                hex_str[1] = input[i + 2];
-                hex_str[2] = '\0';
+                unsigned char high = hex_values[input[i + 1]];
+                unsigned char low = hex_values[input[i + 2]];
                 
-                if (isxdigit(hex_str[0]) && isxdigit(hex_str[1])) {
-                    unsigned int byte_val;
-                    sscanf(hex_str, "%02x", &byte_val);
-                    output[j++] = (unsigned char)byte_val;
+                if (high && low) {
+                    output[j++] = (unsigned char)(((high - 1) << 4) | (low - 1));
                     i += 3;
                 } else {
                     output[j++] = input[i++];
@@ -159,3 +313,580 @@ size_t escape_decode_data(const unsigned char *input, size_t input_len, unsigned
     
     return j;
 }
+
+static size_t escape_encode_scalar(const unsigned char *input, size_t input_len, unsigned char *output) {
+    return escape_encode_from(input, 0, input_len, output, 0);
+}
+
+static size_t escape_decode_scalar(const unsigned char *input, size_t input_len, unsigned char *output,
+                                   size_t *remaining_bytes) {
+    return escape_decode_from(input, 0, input_len, output, 0, remaining_bytes);
+}
+
+#ifdef TRANS_X86_SIMD
+// 16/32バイトずつ特殊バイトを探し、きれいな区間はそのままコピーする。
+// ベクタは常に書き出し、特殊バイトが見つかったらその位置から上書きする
+__attribute__((target("sse2")))
+static size_t escape_encode_sse2(const unsigned char *input, size_t input_len, unsigned char *output) {
+    const __m128i cr = _mm_set1_epi8(0x0d);
+    const __m128i lf = _mm_set1_epi8(0x0a);
+    const __m128i fs = _mm_set1_epi8(0x1c);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i bs = _mm_set1_epi8(0x5c);
+    size_t i = 0, j = 0;
+
+    while (i + 16 <= input_len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(input + i));
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, fs), _mm_cmpeq_epi8(v, del)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(special, _mm_cmpeq_epi8(v, bs)));
+
+        _mm_storeu_si128((__m128i *)(output + j), v);
+        if (mask == 0) {
+            i += 16;
+            j += 16;
+            continue;
+        }
+
+        unsigned int n = (unsigned int)__builtin_ctz(mask);
+        unsigned char c = input[i + n];
+        i += n + 1;
+        j += n;
+        output[j++] = 0x5c;
+        output[j++] = hex_digits[c >> 4];
+        output[j++] = hex_digits[c & 0x0f];
+    }
+
+    return escape_encode_from(input, i, input_len, output, j);
+}
+
+__attribute__((target("sse2")))
+static size_t escape_decode_sse2(const unsigned char *input, size_t input_len, unsigned char *output,
+                                 size_t *remaining_bytes) {
+    const __m128i bs = _mm_set1_epi8(0x5c);
+    size_t i = 0, j = 0;
+
+    while (i + 16 <= input_len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(input + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, bs));
+
+        _mm_storeu_si128((__m128i *)(output + j), v);
+        if (mask == 0) {
+            i += 16;
+            j += 16;
+            continue;
+        }
+
+        unsigned int n = (unsigned int)__builtin_ctz(mask);
+        i += n;
+        j += n;
+        if (i + 2 >= input_len) {
+            break; // 末尾の不完全なシーケンスはスカラー版に任せる
+        }
+        unsigned char high = hex_values[input[i + 1]];
+        unsigned char low = hex_values[input[i + 2]];
+        if (high && low) {
+            output[j++] = (unsigned char)(((high - 1) << 4) | (low - 1));
+            i += 3;
+        } else {
+            output[j++] = input[i++];
+        }
+    }
+
+    return escape_decode_from(input, i, input_len, output, j, remaining_bytes);
+}
+
+__attribute__((target("avx2")))
+static size_t escape_encode_avx2(const unsigned char *input, size_t input_len, unsigned char *output) {
+    const __m256i cr = _mm256_set1_epi8(0x0d);
+    const __m256i lf = _mm256_set1_epi8(0x0a);
+    const __m256i fs = _mm256_set1_epi8(0x1c);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i bs = _mm256_set1_epi8(0x5c);
+    size_t i = 0, j = 0;
+
+    while (i + 32 <= input_len) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(input + i));
+        __m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)),
+                                          _mm256_or_si256(_mm256_cmpeq_epi8(v, fs), _mm256_cmpeq_epi8(v, del)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(special, _mm256_cmpeq_epi8(v, bs)));
+
+        _mm256_storeu_si256((__m256i *)(output + j), v);
+        if (mask == 0) {
+            i += 32;
+            j += 32;
+            continue;
+        }
+
+        unsigned int n = (unsigned int)__builtin_ctz(mask);
+        unsigned char c = input[i + n];
+        i += n + 1;
+        j += n;
+        output[j++] = 0x5c;
+        output[j++] = hex_digits[c >> 4];
+        output[j++] = hex_digits[c & 0x0f];
+    }
+
+    return escape_encode_from(input, i, input_len, output, j);
+}
+
+__attribute__((target("avx2")))
+static size_t escape_decode_avx2(const unsigned char *input, size_t input_len, unsigned char *output,
+                                 size_t *remaining_bytes) {
+    const __m256i bs = _mm256_set1_epi8(0x5c);
+    size_t i = 0, j = 0;
+
+    while (i + 32 <= input_len) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(input + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, bs));
+
+        _mm256_storeu_si256((__m256i *)(output + j), v);
+        if (mask == 0) {
+            i += 32;
+            j += 32;
+            continue;
+        }
+
+        unsigned int n = (unsigned int)__builtin_ctz(mask);
+        i += n;
+        j += n;
+        if (i + 2 >= input_len) {
+            break; // 末尾の不完全なシーケンスはスカラー版に任せる
+        }
+        unsigned char high = hex_values[input[i + 1]];
+        unsigned char low = hex_values[input[i + 2]];
+        if (high && low) {
+            output[j++] = (unsigned char)(((high - 1) << 4) | (low - 1));
+            i += 3;
+        } else {
+            output[j++] = input[i++];
+        }
+    }
+
+    return escape_decode_from(input, i, input_len, output, j, remaining_bytes);
+}
+#endif
+
+// --probeで決めたエスケープ対象。デコードは対象に関係なく\xxを戻すので、エンコードだけが使う
+void escape_set_init(escape_set_t *set, const unsigned char *needed) {
+    memset(set, 0, sizeof(*set));
+    for (int c = 0; c < 256; c++) {
+        if (needed[c] || c == 0x5c) {
+            set->needed[c] = 1;
+            set->lut[c >> 7][c & 0x0f] |= (unsigned char)(1 << ((c >> 4) & 7));
+        }
+    }
+}
+
+static size_t escape_encode_set_from(const escape_set_t *set, const unsigned char *input, size_t i,
+                                     size_t input_len, unsigned char *output, size_t j) {
+    for (; i < input_len; i++) {
+        unsigned char c = input[i];
+
+        if (set->needed[c]) {
+            output[j++] = 0x5c;
+            output[j++] = hex_digits[c >> 4];
+            output[j++] = hex_digits[c & 0x0f];
+        } else {
+            output[j++] = c;
+        }
+    }
+
+    output[j] = '\0';
+    return j;
+}
+
+static size_t escape_encode_set_scalar(const escape_set_t *set, const unsigned char *input, size_t input_len,
+                                       unsigned char *output) {
+    return escape_encode_set_from(set, input, 0, input_len, output, 0);
+}
+
+#ifdef TRANS_X86_SIMD
+// 任意のエスケープ対象を、下位4ビットで引いた表と上位4ビットのビット位置で判定する。
+// 特殊バイトを含むベクタは、最初の特殊バイトから残りをまとめて表で処理する
+__attribute__((target("ssse3")))
+static size_t escape_encode_set_ssse3(const escape_set_t *set, const unsigned char *input, size_t input_len,
+                                      unsigned char *output) {
+    const __m128i lut_low = _mm_loadu_si128((const __m128i *)set->lut[0]);
+    const __m128i lut_high = _mm_loadu_si128((const __m128i *)set->lut[1]);
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i seven = _mm_set1_epi8(7);
+    size_t i = 0, j = 0;
+
+    while (i + 16 <= input_len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(input + i));
+        __m128i lo = _mm_and_si128(v, nibble);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+        __m128i upper = _mm_cmpgt_epi8(hi, seven);
+        __m128i row = _mm_or_si128(_mm_andnot_si128(upper, _mm_shuffle_epi8(lut_low, lo)),
+                                   _mm_and_si128(upper, _mm_shuffle_epi8(lut_high, lo)));
+        __m128i bit = _mm_shuffle_epi8(bits, hi);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, bit), bit));
+
+        _mm_storeu_si128((__m128i *)(output + j), v);
+        if (mask == 0) {
+            i += 16;
+            j += 16;
+            continue;
+        }
+        unsigned int n = (unsigned int)__builtin_ctz(mask);
+        j = escape_encode_set_from(set, input + i, n, 16, output, j + n);
+        i += 16;
+    }
+
+    return escape_encode_set_from(set, input, i, input_len, output, j);
+}
+
+__attribute__((target("avx2")))
+static size_t escape_encode_set_avx2(const escape_set_t *set, const unsigned char *input, size_t input_len,
+                                     unsigned char *output) {
+    const __m256i lut_low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->lut[0]));
+    const __m256i lut_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->lut[1]));
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i seven = _mm256_set1_epi8(7);
+    size_t i = 0, j = 0;
+
+    while (i + 32 <= input_len) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(input + i));
+        __m256i lo = _mm256_and_si256(v, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+        __m256i upper = _mm256_cmpgt_epi8(hi, seven);
+        __m256i row = _mm256_or_si256(_mm256_andnot_si256(upper, _mm256_shuffle_epi8(lut_low, lo)),
+                                      _mm256_and_si256(upper, _mm256_shuffle_epi8(lut_high, lo)));
+        __m256i bit = _mm256_shuffle_epi8(bits, hi);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit));
+
+        _mm256_storeu_si256((__m256i *)(output + j), v);
+        if (mask == 0) {
+            i += 32;
+            j += 32;
+            continue;
+        }
+        unsigned int n = (unsigned int)__builtin_ctz(mask);
+        j = escape_encode_set_from(set, input + i, n, 32, output, j + n);
+        i += 32;
+    }
+
+    return escape_encode_set_from(set, input, i, input_len, output, j);
+}
+#endif
+
+// dense: 各バイトにDENSE_OFFSETを足し、危険なバイトになったものだけ
+// DENSE_ESCAPEの後にDENSE_SHIFTを足して送る (yEncと同じ方式)
+#define DENSE_OFFSET 42
+#define DENSE_ESCAPE 0x3d
+#define DENSE_SHIFT 64
+
+// オフセットを足した後にエスケープが必要なバイト
+static const unsigned char dense_needed[256] = {
+    [0x0a] = 1, [0x0d] = 1, [0x1c] = 1, [0x7f] = 1, [DENSE_ESCAPE] = 1
+};
+
+static size_t dense_encode_from(const unsigned char *input, size_t i, size_t input_len,
+                                unsigned char *output, size_t j) {
+    for (; i < input_len; i++) {
+        unsigned char c = (unsigned char)(input[i] + DENSE_OFFSET);
+
+        if (dense_needed[c]) {
+            output[j++] = DENSE_ESCAPE;
+            output[j++] = (unsigned char)(c + DENSE_SHIFT);
+        } else {
+            output[j++] = c;
+        }
+    }
+
+    output[j] = '\0';
+    return j;
+}
+
+static size_t dense_decode_from(const unsigned char *input, size_t i, size_t input_len,
+                                unsigned char *output, size_t j, size_t *remaining_bytes) {
+    *remaining_bytes = 0;
+
+    while (i < input_len) {
+        if (input[i] == DENSE_ESCAPE) {
+            if (i + 1 >= input_len) {
+                // バッファの末尾で不完全なエスケープシーケンス
+                *remaining_bytes = input_len - i;
+                break;
+            }
+            output[j++] = (unsigned char)(input[i + 1] - DENSE_SHIFT - DENSE_OFFSET);
+            i += 2;
+        } else {
+            output[j++] = (unsigned char)(input[i++] - DENSE_OFFSET);
+        }
+    }
+
+    return j;
+}
+
+static size_t dense_encode_scalar(const unsigned char *input, size_t input_len, unsigned char *output) {
+    return dense_encode_from(input, 0, input_len, output, 0);
+}
+
+static size_t dense_decode_scalar(const unsigned char *input, size_t input_len, unsigned char *output,
+                                  size_t *remaining_bytes) {
+    return dense_decode_from(input, 0, input_len, output, 0, remaining_bytes);
+}
+
+#ifdef TRANS_X86_SIMD
+// escapeと同じく、ベクタで変換して書き出し、エスケープが必要な位置から上書きする
+__attribute__((target("sse2")))
+static size_t dense_encode_sse2(const unsigned char *input, size_t input_len, unsigned char *output) {
+    const __m128i offset = _mm_set1_epi8(DENSE_OFFSET);
+    const __m128i cr = _mm_set1_epi8(0x0d);
+    const __m128i lf = _mm_set1_epi8(0x0a);
+    const __m128i fs = _mm_set1_epi8(0x1c);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i esc = _mm_set1_epi8(DENSE_ESCAPE);
+    size_t i = 0, j = 0;
+
+    while (i + 16 <= input_len) {
+        __m128i v = _mm_add_epi8(_mm_loadu_si128((const __m128i *)(input + i)), offset);
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, fs), _mm_cmpeq_epi8(v, del)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(special, _mm_cmpeq_epi8(v, esc)));
+
+        _mm_storeu_si128((__m128i *)(output + j), v);
+        if (mask == 0) {
+            i += 16;
+            j += 16;
+            continue;
+        }
+
+        unsigned int n = (unsigned int)__builtin_ctz(mask);
+        unsigned char c = (unsigned char)(input[i + n] + DENSE_OFFSET);
+        i += n + 1;
+        j += n;
+        output[j++] = DENSE_ESCAPE;
+        output[j++] = (unsigned char)(c + DENSE_SHIFT);
+    }
+
+    return dense_encode_from(input, i, input_len, output, j);
+}
+
+__attribute__((target("sse2")))
+static size_t dense_decode_sse2(const unsigned char *input, size_t input_len, unsigned char *output,
+                                size_t *remaining_bytes) {
+    const __m128i offset = _mm_set1_epi8(DENSE_OFFSET);
+    const __m128i esc = _mm_set1_epi8(DENSE_ESCAPE);
+    size_t i = 0, j = 0;
+
+    while (i + 16 <= input_len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(input + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, esc));
+
+        _mm_storeu_si128((__m128i *)(output + j), _mm_sub_epi8(v, offset));
+        if (mask == 0) {
+            i += 16;
+            j += 16;
+            continue;
+        }
+
+        unsigned int n = (unsigned int)__builtin_ctz(mask);
+        i += n;
+        j += n;
+        if (i + 1 >= input_len) {
+            break; // 末尾の不完全なシーケンスはスカラー版に任せる
+        }
+        output[j++] = (unsigned char)(input[i + 1] - DENSE_SHIFT - DENSE_OFFSET);
+        i += 2;
+    }
+
+    return dense_decode_from(input, i, input_len, output, j, remaining_bytes);
+}
+#endif
+
+simd_level_t simd_detect_level(void) {
+#ifdef TRANS_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return SIMD_SSSE3;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return SIMD_SSE2;
+    }
+#endif
+    return SIMD_NONE;
+}
+
+const char *simd_level_name(simd_level_t level) {
+    switch (level) {
+        case SIMD_SSE2: return "sse2";
+        case SIMD_SSSE3: return "ssse3";
+        case SIMD_AVX2: return "avx2";
+        default: return "none";
+    }
+}
+
+simd_level_t codec_set_simd_level(simd_level_t level) {
+    simd_level_t available = simd_detect_level();
+    if (level > available) {
+        level = available;
+    }
+
+    codec_impl.escape_encode = escape_encode_scalar;
+    codec_impl.escape_decode = escape_decode_scalar;
+    codec_impl.uuencode_line = uuencode_line_scalar;
+    codec_impl.uudecode_line = uudecode_line_scalar;
+    codec_impl.dense_encode = dense_encode_scalar;
+    codec_impl.dense_decode = dense_decode_scalar;
+    codec_impl.escape_encode_set = escape_encode_set_scalar;
+#ifdef TRANS_X86_SIMD
+    if (level >= SIMD_SSE2) {
+        codec_impl.escape_encode = escape_encode_sse2;
+        codec_impl.escape_decode = escape_decode_sse2;
+        codec_impl.dense_encode = dense_encode_sse2;
+        codec_impl.dense_decode = dense_decode_sse2;
+    }
+    if (level >= SIMD_SSSE3) {
+        codec_impl.uuencode_line = uuencode_line_ssse3;
+        codec_impl.uudecode_line = uudecode_line_ssse3;
+        codec_impl.escape_encode_set = escape_encode_set_ssse3;
+    }
+    if (level >= SIMD_AVX2) {
+        codec_impl.escape_encode = escape_encode_avx2;
+        codec_impl.escape_decode = escape_decode_avx2;
+        codec_impl.escape_encode_set = escape_encode_set_avx2;
+    }
+#endif
+    codec_impl.level = level;
+    codec_impl.initialized = 1;
+    return level;
+}
+
+simd_level_t codec_simd_level(void) {
+    if (!codec_impl.initialized) {
+        codec_set_simd_level(simd_detect_level());
+    }
+    return codec_impl.level;
+}
+
+size_t escape_encode_data(const unsigned char *input, size_t input_len, unsigned char *output) {
+    codec_simd_level();
+    return codec_impl.escape_encode(input, input_len, output);
+}
+
+size_t escape_decode_data(const unsigned char *input, size_t input_len, unsigned char *output, size_t *remaining_bytes) {
+    codec_simd_level();
+    return codec_impl.escape_decode(input, input_len, output, remaining_bytes);
+}
+
+size_t escape_encode_set(const escape_set_t *set, const unsigned char *input, size_t input_len,
+                         unsigned char *output) {
+    codec_simd_level();
+    return codec_impl.escape_encode_set(set, input, input_len, output);
+}
+
+size_t dense_encode_data(const unsigned char *input, size_t input_len, unsigned char *output) {
+    codec_simd_level();
+    return codec_impl.dense_encode(input, input_len, output);
+}
+
+size_t dense_decode_data(const unsigned char *input, size_t input_len, unsigned char *output, size_t *remaining_bytes) {
+    codec_simd_level();
+    return codec_impl.dense_decode(input, input_len, output, remaining_bytes);
+}
+
+size_t encode_data(encode_method_t method, const unsigned char *input, size_t input_len, unsigned char *output) {
+    switch (method) {
+        case METHOD_UUENCODE: return uuencode_data(input, input_len, output);
+        case METHOD_DENSE: return dense_encode_data(input, input_len, output);
+        default: return escape_encode_data(input, input_len, output);
+    }
+}
+
+// setがあればescapeのエンコードにそれを使う
+size_t encode_data_set(encode_method_t method, const escape_set_t *set, const unsigned char *input,
+                       size_t input_len, unsigned char *output) {
+    if (set && method == METHOD_ESCAPE) {
+        return escape_encode_set(set, input, input_len, output);
+    }
+    return encode_data(method, input, input_len, output);
+}
+
+size_t decode_data(encode_method_t method, const unsigned char *input, size_t input_len, unsigned char *output, size_t *remaining_bytes) {
+    switch (method) {
+        case METHOD_UUENCODE: return uudecode_data(input, input_len, output, remaining_bytes);
+        case METHOD_DENSE: return dense_decode_data(input, input_len, output, remaining_bytes);
+        default: return escape_decode_data(input, input_len, output, remaining_bytes);
+    }
+}
+
+// 持ち越しがあるとき、それを完成させるのに要る入力の最大の長さ
+static size_t decoder_lookahead(encode_method_t method) {
+    switch (method) {
+        case METHOD_UUENCODE: return UU_LINE_CHARS + 1;     // 長さの文字の後の60文字と改行
+        case METHOD_DENSE: return 1;
+        default: return 2;
+    }
+}
+
+static size_t decoder_run(decoder_t *dec, const unsigned char *input, size_t input_len, unsigned char *output,
+                          size_t *remaining_bytes) {
+    if (dec->method == METHOD_UUENCODE) {
+        return uudecode_from(input, input_len, output, remaining_bytes, &dec->skipping);
+    }
+    return decode_data(dec->method, input, input_len, output, remaining_bytes);
+}
+
+void decoder_init(decoder_t *dec, encode_method_t method) {
+    memset(dec, 0, sizeof(*dec));
+    dec->method = method;
+}
+
+// inputをすべて消費する。途中で切れた\xxや行はdecに持ち越し、次の入力の先頭とだけ合わせてデコードする
+size_t decoder_feed(decoder_t *dec, const unsigned char *input, size_t input_len, unsigned char *output) {
+    size_t i = 0, j = 0;
+    size_t remaining;
+
+    codec_simd_level();
+    if (dec->held_len > 0) {
+        unsigned char joined[DECODER_HELD_MAX + UU_LINE_CHARS + 1];
+        size_t held = dec->held_len;
+        size_t take = decoder_lookahead(dec->method);
+        if (take > input_len) {
+            take = input_len;
+        }
+        memcpy(joined, dec->held, held);
+        memcpy(joined + held, input, take);
+        j = decoder_run(dec, joined, held + take, output, &remaining);
+        size_t consumed = held + take - remaining;
+        if (consumed < held) {
+            // まだ揃わない。takeはinputのすべて
+            memmove(dec->held, joined + consumed, remaining);
+            dec->held_len = remaining;
+            return j;
+        }
+        // joinedで読み終えなかったinputの分は、以下でinputから直接デコードする
+        i = consumed - held;
+    }
+    j += decoder_run(dec, input + i, input_len - i, output + j, &remaining);
+    memcpy(dec->held, input + input_len - remaining, remaining);
+    dec->held_len = remaining;
+    return j;
+}
+
+size_t decoder_bound(const decoder_t *dec, size_t input_len) {
+    return decode_bound(dec->method, dec->held_len + input_len);
+}
+
+size_t encode_bound(encode_method_t method, size_t input_len) {
+    switch (method) {
+        case METHOD_UUENCODE: return UUENCODE_BOUND(input_len);
+        case METHOD_DENSE: return DENSE_ENCODE_BOUND(input_len);
+        default: return ESCAPE_ENCODE_BOUND(input_len);
+    }
+}
+
+size_t decode_bound(encode_method_t method, size_t input_len) {
+    // どの方式もデコード結果が入力より長くなることはない
+    (void)method;
+    return input_len;
+}
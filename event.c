@@ -0,0 +1,224 @@
+#include "trans.h"
+
+// Linuxではepoll、それ以外ではpollでfdを監視する
+#ifdef __linux__
+#include <sys/epoll.h>
+#define EVENT_USE_EPOLL 1
+#endif
+
+// fdごとの登録内容
+typedef struct {
+    int registered;
+    int always_ready;   // epollに登録できない通常ファイルなど
+    int events;         // 監視するイベント。0なら一時的に監視しない
+    void *data;
+    size_t index;       // pollの配列での位置
+} event_entry_t;
+
+struct event_loop {
+    event_entry_t *entries;     // fdで引く
+    size_t entry_cap;
+#ifdef EVENT_USE_EPOLL
+    int epoll_fd;
+    struct epoll_event *ready;
+    size_t ready_cap;
+    size_t always_ready_count;
+#else
+    struct pollfd *pfds;
+    size_t pfd_count;
+    size_t pfd_cap;
+#endif
+};
+
+event_loop_t *event_loop_new(void) {
+    event_loop_t *loop = calloc(1, sizeof(*loop));
+    if (!loop) {
+        return NULL;
+    }
+#ifdef EVENT_USE_EPOLL
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1");
+        free(loop);
+        return NULL;
+    }
+#endif
+    return loop;
+}
+
+void event_loop_free(event_loop_t *loop) {
+    if (!loop) return;
+#ifdef EVENT_USE_EPOLL
+    close(loop->epoll_fd);
+    free(loop->ready);
+#else
+    free(loop->pfds);
+#endif
+    free(loop->entries);
+    free(loop);
+}
+
+static event_entry_t *entry_for(event_loop_t *loop, int fd) {
+    if ((size_t)fd >= loop->entry_cap) {
+        size_t new_cap = loop->entry_cap ? loop->entry_cap : 64;
+        while (new_cap <= (size_t)fd) {
+            new_cap *= 2;
+        }
+        event_entry_t *entries = realloc(loop->entries, new_cap * sizeof(*entries));
+        if (!entries) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(entries + loop->entry_cap, 0, (new_cap - loop->entry_cap) * sizeof(*entries));
+        loop->entries = entries;
+        loop->entry_cap = new_cap;
+    }
+    return &loop->entries[fd];
+}
+
+#ifdef EVENT_USE_EPOLL
+static unsigned int to_epoll_events(int events) {
+    return ((events & EVENT_READ) ? EPOLLIN : 0) | ((events & EVENT_WRITE) ? EPOLLOUT : 0);
+}
+#endif
+
+// eventsが0のfdはHUPやエラーも報告しない。止めた読み込みが空回りしないようにするため
+int event_loop_set(event_loop_t *loop, int fd, int events, void *data) {
+    event_entry_t *entry = entry_for(loop, fd);
+
+    if (entry->registered && entry->events == events) {
+        entry->data = data;
+        return 0;
+    }
+#ifdef EVENT_USE_EPOLL
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = to_epoll_events(events);
+    ev.data.fd = fd;
+    int armed = entry->registered && entry->events != 0 && !entry->always_ready;
+    int ret = 0;
+    if (!entry->registered || !entry->always_ready) {
+        if (events == 0) {
+            ret = armed ? epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) : 0;
+        } else {
+            ret = epoll_ctl(loop->epoll_fd, armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+        }
+    }
+    if (ret < 0 && errno == EPERM && !entry->registered) {
+        // 通常ファイルはいつでも読み書きできるものとして扱う
+        entry->always_ready = 1;
+        loop->always_ready_count++;
+    } else if (ret < 0) {
+        return -1;
+    }
+#else
+    if (!entry->registered) {
+        if (loop->pfd_count == loop->pfd_cap) {
+            size_t new_cap = loop->pfd_cap ? loop->pfd_cap * 2 : 16;
+            struct pollfd *pfds = realloc(loop->pfds, new_cap * sizeof(*pfds));
+            if (!pfds) {
+                perror("realloc");
+                exit(1);
+            }
+            loop->pfds = pfds;
+            loop->pfd_cap = new_cap;
+        }
+        entry->index = loop->pfd_count++;
+    }
+    // pollは負のfdを無視するので、監視しないfdは~fdにしておく
+    loop->pfds[entry->index].fd = events ? fd : ~fd;
+    loop->pfds[entry->index].events = ((events & EVENT_READ) ? POLLIN : 0) | ((events & EVENT_WRITE) ? POLLOUT : 0);
+    loop->pfds[entry->index].revents = 0;
+#endif
+    entry->registered = 1;
+    entry->events = events;
+    entry->data = data;
+    return 0;
+}
+
+void event_loop_remove(event_loop_t *loop, int fd) {
+    if (fd < 0 || (size_t)fd >= loop->entry_cap || !loop->entries[fd].registered) {
+        return;
+    }
+#ifdef EVENT_USE_EPOLL
+    if (loop->entries[fd].always_ready) {
+        loop->always_ready_count--;
+    } else if (loop->entries[fd].events) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+#else
+    // 末尾の要素で穴を埋める
+    size_t index = loop->entries[fd].index;
+    loop->pfds[index] = loop->pfds[--loop->pfd_count];
+    if (index < loop->pfd_count) {
+        int moved = loop->pfds[index].fd;
+        loop->entries[moved < 0 ? ~moved : moved].index = index;
+    }
+#endif
+    memset(&loop->entries[fd], 0, sizeof(loop->entries[fd]));
+}
+
+int event_loop_wait(event_loop_t *loop, event_t *events, int max_events, long timeout_us) {
+    int count = 0;
+#ifdef EVENT_USE_EPOLL
+    // epoll_waitはミリ秒単位なので、epollのfd自体をppollで待ってからイベントを取り出す
+    struct pollfd pfd;
+    pfd.fd = loop->epoll_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ready = poll_with_timeout_us(&pfd, 1, loop->always_ready_count > 0 ? 0 : timeout_us);
+    if (ready < 0) {
+        return ready;
+    }
+
+    if (loop->ready_cap < (size_t)max_events) {
+        struct epoll_event *new_ready = realloc(loop->ready, (size_t)max_events * sizeof(*new_ready));
+        if (!new_ready) {
+            perror("realloc");
+            exit(1);
+        }
+        loop->ready = new_ready;
+        loop->ready_cap = (size_t)max_events;
+    }
+    int n = ready ? epoll_wait(loop->epoll_fd, loop->ready, max_events, 0) : 0;
+    if (n < 0) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        int fd = loop->ready[i].data.fd;
+        unsigned int ev = loop->ready[i].events;
+        events[count].fd = fd;
+        events[count].data = loop->entries[fd].data;
+        events[count].events = ((ev & EPOLLIN) ? EVENT_READ : 0) | ((ev & EPOLLOUT) ? EVENT_WRITE : 0) |
+                               ((ev & (EPOLLHUP | EPOLLERR)) ? EVENT_ERROR : 0);
+        count++;
+    }
+    for (size_t fd = 0; loop->always_ready_count > 0 && fd < loop->entry_cap && count < max_events; fd++) {
+        event_entry_t *entry = &loop->entries[fd];
+        if (entry->always_ready && entry->events) {
+            events[count].fd = (int)fd;
+            events[count].data = entry->data;
+            events[count].events = entry->events;
+            count++;
+        }
+    }
+    return count;
+#else
+    int ready = poll_with_timeout_us(loop->pfds, loop->pfd_count, timeout_us);
+    if (ready <= 0) {
+        return ready;
+    }
+    for (size_t i = 0; i < loop->pfd_count && count < max_events; i++) {
+        short rev = loop->pfds[i].revents;
+        if (rev == 0) continue;
+        int fd = loop->pfds[i].fd;
+        loop->pfds[i].revents = 0;
+        events[count].fd = fd;
+        events[count].data = loop->entries[fd].data;
+        events[count].events = ((rev & POLLIN) ? EVENT_READ : 0) | ((rev & POLLOUT) ? EVENT_WRITE : 0) |
+                               ((rev & (POLLHUP | POLLERR | POLLNVAL)) ? EVENT_ERROR : 0);
+        count++;
+    }
+    return count;
+#endif
+}
@@ -0,0 +1,144 @@
+#include "trans.h"
+
+// --muxのフロー制御の窓 (--window)。送ったのに相手がまだttyから読んでいないバイト数を、窓の大きさまでに抑える。
+//
+// autoでは、窓を帯域と遅延の積 (BDP) に、待ち行列で待たせてよい時間FLOW_TARGET_DELAY_US分を足した大きさにする。
+//   遅延: flushごとに送った位置と時刻を覚えておき、その位置までのCREDITが届くまでの時間。
+//         最小値を経路そのものの遅延とみなす (待ち行列が空のときに最小になる)
+//   帯域: 測る間隔のうちにCREDITで返ってきたバイト数
+// 窓が閉じて送るのを待たされたのに遅延が増えていなければ、経路にまだ余裕があるので窓を倍にする。
+// 遅延が増えていれば、経路は埋まっているので 帯域×(最小の遅延+目標) にする。
+// 窓が閉じなかった間 (送るものが少なかった) は、測った帯域は経路の速さではないので変えない。
+// 待ち行列が空にならないと最小の遅延が膨らんでいくので、FLOW_MIN_RTT_PERIOD_USごとに窓を
+// MIN_FLOW_WINDOWまで絞って待ち行列を空にし、その間の最小値で測り直す (往復2回分、元の窓に戻す)
+
+#define FLOW_INITIAL_WINDOW (256 * 1024)
+#define FLOW_MAX_WINDOW (8 * 1024 * 1024)
+#define FLOW_TARGET_DELAY_US 50000
+#define FLOW_SAMPLE_US 100000               // 窓を決め直す最短の間隔 (遅延がこれより長ければ遅延ごと)
+#define FLOW_MIN_RTT_PERIOD_US 10000000     // 最小の遅延を測り直す間隔
+
+void flow_init(flow_t *flow, size_t window, int automatic) {
+    memset(flow, 0, sizeof(*flow));
+    flow->automatic = automatic;
+    flow->window = automatic ? FLOW_INITIAL_WINDOW : window;
+}
+
+// 今送ってよいバイト数
+size_t flow_room(const flow_t *flow) {
+    unsigned long long in_flight = flow->sent - flow->acked;
+    return (in_flight < flow->window) ? flow->window - (size_t)in_flight : 0;
+}
+
+void flow_sent(flow_t *flow, size_t len, long long now) {
+    flow->sent += len;
+    // 印が溢れたら次に空くまで付けない (残った印で遅延は測れる)
+    if (flow->mark_count < FLOW_MARKS) {
+        flow_mark_t *mark = &flow->marks[(flow->mark_head + flow->mark_count) % FLOW_MARKS];
+        mark->end = flow->sent;
+        mark->at = now;
+        flow->mark_count++;
+    }
+}
+
+// 窓が閉じていて送れないものがあった
+void flow_blocked(flow_t *flow) {
+    flow->blocked = 1;
+}
+
+static void rtt_sampled(flow_t *flow, long long rtt, long long now) {
+    if (rtt < 1) {
+        rtt = 1;
+    }
+    flow->rtt = rtt;
+    if (flow->min_rtt == 0 || rtt < flow->min_rtt) {
+        flow->min_rtt = rtt;
+        flow->min_rtt_at = now;
+    }
+    if (flow->drain_started > 0 && (flow->drain_min_rtt == 0 || rtt < flow->drain_min_rtt)) {
+        flow->drain_min_rtt = rtt;
+    }
+}
+
+// 窓を絞って待ち行列を空にしている間はtrue。終わったら最小の遅延を置き換えて窓を戻す
+static int draining(flow_t *flow, long long now) {
+    if (flow->drain_started == 0) {
+        if (flow->min_rtt == 0 || now - flow->min_rtt_at < FLOW_MIN_RTT_PERIOD_US) {
+            return 0;
+        }
+        flow->drain_started = now;
+        flow->drain_min_rtt = 0;
+        flow->drained_window = flow->window;
+        if (flow->window > MIN_FLOW_WINDOW) {
+            flow->window = MIN_FLOW_WINDOW;
+        }
+        return 1;
+    }
+    long long interval = (flow->min_rtt > FLOW_SAMPLE_US) ? flow->min_rtt : FLOW_SAMPLE_US;
+    if (now - flow->drain_started < 2 * interval) {
+        return 1;
+    }
+    if (flow->drain_min_rtt > 0) {
+        flow->min_rtt = flow->drain_min_rtt;
+    }
+    flow->min_rtt_at = now;
+    flow->window = flow->drained_window;
+    flow->drain_started = 0;
+    flow->sample_started = 0;
+    return 0;
+}
+
+// 相手が受け取ったバイト数の累計がCREDITで届いた
+void flow_acked(flow_t *flow, unsigned long long acked, long long now) {
+    long long sent_at = -1;
+
+    if (acked > flow->sent) {
+        acked = flow->sent;
+    }
+    if (acked <= flow->acked) {
+        return;
+    }
+    flow->acked = acked;
+    while (flow->mark_count > 0 && flow->marks[flow->mark_head].end <= acked) {
+        sent_at = flow->marks[flow->mark_head].at;
+        flow->mark_head = (flow->mark_head + 1) % FLOW_MARKS;
+        flow->mark_count--;
+    }
+    if (sent_at >= 0) {
+        rtt_sampled(flow, now - sent_at, now);
+    }
+    if (!flow->automatic) {
+        return;
+    }
+
+    if (draining(flow, now)) {
+        return;
+    }
+    if (flow->sample_started == 0) {
+        flow->sample_started = now;
+        flow->sample_acked = acked;
+        return;
+    }
+    long long interval = (flow->min_rtt > FLOW_SAMPLE_US) ? flow->min_rtt : FLOW_SAMPLE_US;
+    if (now - flow->sample_started < interval) {
+        return;
+    }
+    if (flow->blocked && flow->min_rtt > 0) {
+        double window;
+        if (flow->rtt < flow->min_rtt + FLOW_TARGET_DELAY_US / 2) {
+            window = (double)flow->window * 2;
+        } else {
+            double rate = (double)(acked - flow->sample_acked) / (double)(now - flow->sample_started);
+            window = rate * (double)(flow->min_rtt + FLOW_TARGET_DELAY_US);
+        }
+        if (window < MIN_FLOW_WINDOW) {
+            window = MIN_FLOW_WINDOW;
+        } else if (window > FLOW_MAX_WINDOW) {
+            window = FLOW_MAX_WINDOW;
+        }
+        flow->window = (size_t)window;
+    }
+    flow->blocked = 0;
+    flow->sample_started = now;
+    flow->sample_acked = acked;
+}
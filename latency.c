@@ -0,0 +1,126 @@
+#include "trans.h"
+
+// flushした単位ごとの遅延の分布。方向ごとに、プロセス全体で1つずつ持つ。
+//
+//   queue: 最初のバイトを読んでからflushするまで
+//   codec: エンコード/デコード (圧縮、フレーム化を含む) にかかった時間
+//   write: 変換し終えてから、その最後のバイトを書き終えるまで
+//
+// HDR Histogramと同じく、2の冪ごとの区間をLATENCY_SUB_BUCKETSに等分して数える (誤差は1/16以内)。
+// --pipelineのワーカーからも記録するので、数はatomicに足す
+
+static latency_histogram_t histograms[2][LATENCY_KIND_COUNT];
+
+static const char *kind_names[LATENCY_KIND_COUNT] = { "queue", "codec", "write" };
+
+static int bucket_of(long long us) {
+    unsigned long long v = (us > 0) ? (unsigned long long)us : 0;
+
+    if (v < LATENCY_SUB_BUCKETS) {
+        return (int)v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    if (e > LATENCY_MAX_EXPONENT) {
+        return LATENCY_BUCKETS - 1;
+    }
+    return (e - 3) * LATENCY_SUB_BUCKETS + (int)((v >> (e - 4)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// その区間に入る最大の値
+static long long bucket_value(int index) {
+    if (index < LATENCY_SUB_BUCKETS) {
+        return index;
+    }
+    int e = index / LATENCY_SUB_BUCKETS + 3;
+    long long low = (long long)(LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS) << (e - 4);
+    return low + (1LL << (e - 4)) - 1;
+}
+
+void latency_histogram_add(latency_histogram_t *h, long long us) {
+    long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&h->counts[bucket_of(us)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->total, 1, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&h->max, &max, us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// 割合qの位置の値 (マイクロ秒)。記録がなければ0
+long long latency_histogram_percentile(const latency_histogram_t *h, double q) {
+    unsigned long long total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+    unsigned long long rank = (unsigned long long)(q * (double)total + 0.5);
+    unsigned long long seen = 0;
+    long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    if (total == 0) {
+        return 0;
+    }
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            // 最後の区間には上限がない
+            long long value = (i < LATENCY_BUCKETS - 1) ? bucket_value(i) : max;
+            return (value < max) ? value : max;
+        }
+    }
+    return max;
+}
+
+void latency_record(int encoding, latency_kind_t kind, long long us) {
+    latency_histogram_add(&histograms[encoding ? 1 : 0][kind], us);
+}
+
+void latency_dump(FILE *file) {
+    for (int encoding = 1; encoding >= 0; encoding--) {
+        for (int kind = 0; kind < LATENCY_KIND_COUNT; kind++) {
+            const latency_histogram_t *h = &histograms[encoding][kind];
+            unsigned long long total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+            if (total == 0) {
+                continue;
+            }
+            fprintf(file, "latency %d %s %s: chunks %llu p50 %lldus p99 %lldus p999 %lldus max %lldus\n",
+                    (int)getpid(), encoding ? "port->stdio" : "stdio->port", kind_names[kind], total,
+                    latency_histogram_percentile(h, 0.5), latency_histogram_percentile(h, 0.99),
+                    latency_histogram_percentile(h, 0.999), __atomic_load_n(&h->max, __ATOMIC_RELAXED));
+        }
+    }
+    fflush(file);
+}
+
+// flushまでの遅延の上限 (μs) を読む。不正か、FLUSH_MAX_LATENCY_USを超えれば-1を返す
+long parse_flush_latency(const char *spec) {
+    char *end;
+
+    errno = 0;
+    long us = strtol(spec, &end, 10);
+    if (*spec == '\0' || *end != '\0' || errno == ERANGE || us < 0 || us > FLUSH_MAX_LATENCY_US) {
+        return -1;
+    }
+    return us;
+}
+
+// "interactive", "bulk" またはマイクロ秒の数値を解釈する。
+// 数値は遅延の上限だけをその値にしたinteractiveで、前に指定した方針によらない
+int parse_flush_policy(const char *spec, flush_policy_t *policy) {
+    if (strcmp(spec, "interactive") == 0) {
+        policy->latency_us = FLUSH_INTERACTIVE_LATENCY_US;
+        policy->small_read = FLUSH_INTERACTIVE_SMALL_READ;
+        return 0;
+    }
+    if (strcmp(spec, "bulk") == 0) {
+        policy->latency_us = FLUSH_BULK_LATENCY_US;
+        policy->small_read = 0;
+        return 0;
+    }
+
+    long us = parse_flush_latency(spec);
+    if (us < 0) {
+        return -1;
+    }
+    policy->latency_us = us;
+    policy->small_read = FLUSH_INTERACTIVE_SMALL_READ;
+    return 0;
+}
@@ -0,0 +1,595 @@
+#include "trans.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LINK_X86_CRC 1
+#include <immintrin.h>
+#endif
+
+// --framed: 圧縮後・エンコード前のデータを、連番とCRC32Cの付いたフレームに分ける。
+// 受信側は壊れたフレームや抜けた連番を見つけるとNAKを返し、送信側は
+// 確認応答されるまで取っておいたフレームのうち、NAKされたものだけを送り直す。
+// ttyを閉じると再送の要求も届かなくなるので、EOFもフレームで送る。
+//
+// フレーム: 種別(1) 連番(4) 確認応答(4) データ CRC32C(4) (数値はbig endian)
+// これをCOBSで0x00を含まない形にして区切りの0x00を付け、まとめてエンコードする。
+// 途中のバイトが化けたり抜けたりしても、次の0x00から同期し直せる
+
+#define LINK_HEADER_SIZE 9
+#define LINK_CRC_SIZE 4
+#define LINK_MAX_PAYLOAD 4096
+// COBSの符号は254バイトごとに1バイト増える。区切りを含む
+#define LINK_MAX_WIRE_FRAME (LINK_HEADER_SIZE + LINK_MAX_PAYLOAD + LINK_CRC_SIZE + \
+                             (LINK_HEADER_SIZE + LINK_MAX_PAYLOAD + LINK_CRC_SIZE) / 254 + 2)
+#define LINK_REPLAY_LIMIT (1024 * 1024)     // 確認応答待ちのフレームがこれを超えたら入力を止める
+#define LINK_REORDER_LIMIT 512              // 抜けの後に届いたフレームを保持しておく数
+#define LINK_ACK_EVERY 16                   // これだけ受け取ったらすぐにACKを返す
+#define LINK_ACK_DELAY_US 20000             // 送るデータがなければ、この時間でACKを返す
+#define LINK_NAK_RETRY_US 500000            // 抜けが埋まらなければNAKし直す間隔
+#define LINK_PROBE_US 1000000               // 確認応答が進まなければ、最も古いフレームを送り直す
+#define LINK_MAX_PROBE_US 8000000
+#define LINK_MAX_NAKS 64                    // 1つのNAKに入れる連番の数
+
+typedef enum {
+    LINK_DATA = 1,
+    LINK_ACK,           // 確認応答だけ
+    LINK_NAK,           // 再送してほしい連番の列 (4バイトずつ)
+    LINK_EOF            // これ以上DATAを送らない。連番を持ち、DATAと同じく再送される
+} link_frame_type_t;
+
+typedef struct {
+    int type;
+    unsigned int seq;
+    size_t len;
+    unsigned char data[];       // 送信側はCOBS済みのフレーム、受信側はデータ
+} link_frame_t;
+
+struct link {
+    const config_t *config;
+    const escape_set_t *escapes;
+    stream_stats_t *tx_stats;
+    stream_stats_t *rx_stats;
+
+    // 送信側
+    unsigned int tx_next;       // 次に送るDATAの連番
+    unsigned int tx_base;       // 相手がまだ受け取っていない最初の連番
+    link_frame_t **replay;      // tx_baseからの確認応答待ちのフレーム (リング)
+    size_t replay_head;
+    size_t replay_count;
+    size_t replay_cap;          // 2のべき乗
+    size_t replay_bytes;
+    bytebuf_t control;          // 次のlink_serviceでエンコードする制御フレームと再送
+    bytebuf_t framed;           // link_sendで組み立てたフレーム
+    long long probe_at;
+    long probe_interval;
+    int acked;                  // 前回のlink_serviceから確認応答が進んだ
+
+    // 受信側
+    bytebuf_t rx;               // 区切りまで届いていないデータ
+    unsigned int rx_next;       // 次に渡すDATAの連番
+    unsigned int rx_highest;    // 受け取った最大の連番+1
+    link_frame_t *held[LINK_REORDER_LIMIT];  // 抜けの後に届いたフレーム (連番 % LIMIT)
+    unsigned int rx_unacked;    // 確認応答を返していないDATAの数
+    long long ack_at;           // 0なら返す必要がない
+    int nak_now;                // 抜けか壊れたフレームを見つけた
+    long long nak_retry_at;
+    int peer_eof;               // 相手のEOFまで順番どおりに受け取った
+    unsigned long long rx_frames;  // CRCが合ったフレームの数
+};
+
+// a < b (連番の一周を考慮する)
+static int seq_before(unsigned int a, unsigned int b) {
+    return (int)(a - b) < 0;
+}
+
+static void put_be32(unsigned char *p, unsigned int value) {
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static unsigned int get_be32(const unsigned char *p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+// CRC32C (Castagnoli)。SSE4.2があればcrc32命令を使う
+static unsigned int crc32c_table[256];
+static unsigned int (*crc32c_update)(unsigned int, const unsigned char *, size_t);
+
+static unsigned int crc32c_update_table(unsigned int crc, const unsigned char *p, size_t len) {
+    while (len--) {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef LINK_X86_CRC
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_update_sse42(unsigned int crc, const unsigned char *p, size_t len) {
+#ifdef __x86_64__
+    unsigned long long crc64 = crc;
+    while (len >= 8) {
+        unsigned long long v;
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (unsigned int)crc64;
+#endif
+    while (len >= 4) {
+        unsigned int v;
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+unsigned int crc32c(const void *data, size_t len) {
+    if (!crc32c_update) {
+        for (unsigned int i = 0; i < 256; i++) {
+            unsigned int c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+            }
+            crc32c_table[i] = c;
+        }
+        crc32c_update = crc32c_update_table;
+#ifdef LINK_X86_CRC
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2")) {
+            crc32c_update = crc32c_update_sse42;
+        }
+#endif
+    }
+    return ~crc32c_update(0xffffffff, data, len);
+}
+
+// COBS: 0x00を含まない形にする。outにはlen + len / 254 + 1バイト必要。
+// 0x00でない最大254バイトの並びごとに、その長さ+1を前に置く (0xffでなければ後ろに0x00があった)
+static size_t cobs_encode(const unsigned char *in, size_t len, unsigned char *out) {
+    size_t i = 0;
+    size_t j = 0;
+
+    while (1) {
+        size_t limit = (len - i < 254) ? len - i : 254;
+        const unsigned char *zero = memchr(in + i, 0, limit);
+        size_t run = zero ? (size_t)(zero - (in + i)) : limit;
+
+        out[j++] = (unsigned char)(run + 1);
+        memcpy(out + j, in + i, run);
+        j += run;
+        i += run;
+        if (zero) {
+            i++;
+        } else if (i == len) {
+            return j;
+        }
+    }
+}
+
+// その場で戻す。壊れていれば-1
+static long cobs_decode(unsigned char *buf, size_t len) {
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < len) {
+        unsigned char code = buf[i++];
+        if (code == 0 || i + code - 1 > len) {
+            return -1;
+        }
+        memmove(buf + j, buf + i, code - 1);
+        j += code - 1;
+        i += code - 1;
+        if (code < 0xff && i < len) {
+            buf[j++] = 0;
+        }
+    }
+    return (long)j;
+}
+
+// フレームを組み立て、COBSにして区切りを付けたものをoutに足す
+static size_t build_frame(link_t *link, bytebuf_t *out, int type, unsigned int seq,
+                          const unsigned char *payload, size_t len) {
+    unsigned char plain[LINK_HEADER_SIZE + LINK_MAX_PAYLOAD + LINK_CRC_SIZE];
+    size_t plain_len = LINK_HEADER_SIZE + len + LINK_CRC_SIZE;
+
+    plain[0] = (unsigned char)type;
+    put_be32(plain + 1, seq);
+    put_be32(plain + 5, link->rx_next);
+    if (len > 0) {
+        memcpy(plain + LINK_HEADER_SIZE, payload, len);
+    }
+    put_be32(plain + LINK_HEADER_SIZE + len, crc32c(plain, LINK_HEADER_SIZE + len));
+
+    unsigned char *p = bytebuf_reserve(out, plain_len + plain_len / 254 + 2);
+    size_t encoded = cobs_encode(plain, plain_len, p);
+    p[encoded++] = 0;
+    out->end += encoded;
+
+    // どのフレームにも確認応答が載る
+    link->rx_unacked = 0;
+    link->ack_at = 0;
+    return encoded;
+}
+
+// フレーム化したデータをエンコードしてwireに書く
+static void emit(link_t *link, const unsigned char *data, size_t len, bytebuf_t *wire) {
+    unsigned char *p = bytebuf_reserve(wire, encode_bound(link->config->method, len));
+    wire->end += encode_data_set(link->config->method, link->escapes, data, len, p);
+}
+
+static link_frame_t *replay_at(const link_t *link, size_t index) {
+    return link->replay[(link->replay_head + index) & (link->replay_cap - 1)];
+}
+
+static void replay_push(link_t *link, link_frame_t *frame) {
+    if (link->replay_count == link->replay_cap) {
+        size_t new_cap = link->replay_cap ? link->replay_cap * 2 : 64;
+        link_frame_t **replay = malloc(new_cap * sizeof(*replay));
+        if (!replay) {
+            perror("malloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < link->replay_count; i++) {
+            replay[i] = replay_at(link, i);
+        }
+        free(link->replay);
+        link->replay = replay;
+        link->replay_head = 0;
+        link->replay_cap = new_cap;
+    }
+    link->replay[(link->replay_head + link->replay_count) & (link->replay_cap - 1)] = frame;
+    link->replay_count++;
+    link->replay_bytes += frame->len;
+}
+
+// ackより前のフレームは相手に届いたので捨てる
+static void handle_ack(link_t *link, unsigned int ack) {
+    if (!seq_before(link->tx_base, ack) || seq_before(link->tx_next, ack)) {
+        return;
+    }
+    while (link->tx_base != ack) {
+        link_frame_t *frame = replay_at(link, 0);
+        link->replay_bytes -= frame->len;
+        free(frame);
+        link->replay_head = (link->replay_head + 1) & (link->replay_cap - 1);
+        link->replay_count--;
+        link->tx_base++;
+    }
+    link->acked = 1;
+}
+
+static void retransmit(link_t *link, unsigned int seq) {
+    if (seq_before(seq, link->tx_base) || !seq_before(seq, link->tx_next)) {
+        return; // 届いているか、まだ送っていない
+    }
+    link_frame_t *frame = replay_at(link, seq - link->tx_base);
+    bytebuf_append(&link->control, frame->data, frame->len);
+    link->tx_stats->retransmits++;
+}
+
+static void deliver_one(link_t *link, int type, const unsigned char *payload, size_t len, bytebuf_t *out) {
+    if (type == LINK_EOF) {
+        link->peer_eof = 1;
+        link->rx_unacked = LINK_ACK_EVERY;  // 相手はこのACKを待って閉じる
+    } else {
+        bytebuf_append(out, payload, len);
+    }
+    link->rx_next++;
+}
+
+static void deliver(link_t *link, int type, const unsigned char *payload, size_t len, bytebuf_t *out) {
+    deliver_one(link, type, payload, len, out);
+    if (seq_before(link->rx_highest, link->rx_next)) {
+        link->rx_highest = link->rx_next;
+    }
+
+    // 保持していた続きのフレームを渡す
+    link_frame_t *next;
+    while ((next = link->held[link->rx_next % LINK_REORDER_LIMIT]) && next->seq == link->rx_next) {
+        link->held[link->rx_next % LINK_REORDER_LIMIT] = NULL;
+        deliver_one(link, next->type, next->data, next->len, out);
+        free(next);
+    }
+}
+
+// 連番を持つフレーム (DATAとEOF) を受け取る
+static void receive_data(link_t *link, int type, unsigned int seq, const unsigned char *payload, size_t len,
+                         bytebuf_t *out) {
+    unsigned int ahead = seq - link->rx_next;
+
+    if (ahead == 0) {
+        deliver(link, type, payload, len, out);
+    } else if (seq_before(seq, link->rx_next)) {
+        // 再送で重複した。こちらの確認応答が届いていないので、すぐに返す
+        link->rx_unacked = LINK_ACK_EVERY;
+    } else if (ahead < LINK_REORDER_LIMIT) {
+        link_frame_t **slot = &link->held[seq % LINK_REORDER_LIMIT];
+        if (!*slot) {
+            *slot = malloc(sizeof(**slot) + len);
+            if (!*slot) {
+                perror("malloc");
+                exit(1);
+            }
+            (*slot)->type = type;
+            (*slot)->seq = seq;
+            (*slot)->len = len;
+            memcpy((*slot)->data, payload, len);
+        }
+        if (seq_before(link->rx_highest, seq + 1)) {
+            link->rx_highest = seq + 1;
+            link->nak_now = 1;  // 新しい抜けが見つかった
+        }
+    } else {
+        link->nak_now = 1;      // 保持しきれないので捨てる。抜けを埋めてから送り直してもらう
+    }
+    link->rx_unacked++;
+}
+
+static void receive_frame(link_t *link, unsigned char *frame, size_t wire_len, bytebuf_t *out) {
+    long len = cobs_decode(frame, wire_len);
+
+    if (len < LINK_HEADER_SIZE + LINK_CRC_SIZE || len > LINK_HEADER_SIZE + LINK_MAX_PAYLOAD + LINK_CRC_SIZE ||
+        crc32c(frame, (size_t)len - LINK_CRC_SIZE) != get_be32(frame + len - LINK_CRC_SIZE)) {
+        link->rx_stats->bad_frames++;
+        link->nak_now = 1;
+        return;
+    }
+
+    link->rx_frames++;
+    int type = frame[0];
+    unsigned int seq = get_be32(frame + 1);
+    const unsigned char *payload = frame + LINK_HEADER_SIZE;
+    size_t payload_len = (size_t)len - LINK_HEADER_SIZE - LINK_CRC_SIZE;
+
+    handle_ack(link, get_be32(frame + 5));
+    switch (type) {
+        case LINK_DATA:
+        case LINK_EOF:
+            receive_data(link, type, seq, payload, payload_len, out);
+            break;
+        case LINK_NAK:
+            for (size_t i = 0; i + 4 <= payload_len; i += 4) {
+                retransmit(link, get_be32(payload + i));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// 抜けている連番を要求する。抜けが分からなければ、壊れたフレームの代わりに次の連番を要求する
+static void send_nak(link_t *link) {
+    unsigned char payload[LINK_MAX_NAKS * 4];
+    size_t count = 0;
+
+    for (unsigned int seq = link->rx_next; seq_before(seq, link->rx_highest) && count < LINK_MAX_NAKS; seq++) {
+        link_frame_t *held = link->held[seq % LINK_REORDER_LIMIT];
+        if (!held || held->seq != seq) {
+            put_be32(payload + 4 * count++, seq);
+        }
+    }
+    if (count == 0) {
+        put_be32(payload, link->rx_next);
+        count = 1;
+    }
+    build_frame(link, &link->control, LINK_NAK, 0, payload, count * 4);
+}
+
+link_t *link_new(const config_t *config, stream_stats_t *tx_stats, stream_stats_t *rx_stats) {
+    link_t *link = calloc(1, sizeof(*link));
+    if (!link) {
+        perror("calloc");
+        return NULL;
+    }
+    link->config = config;
+    link->tx_stats = tx_stats;
+    link->rx_stats = rx_stats;
+    link->probe_interval = LINK_PROBE_US;
+    return link;
+}
+
+void link_free(link_t *link) {
+    if (!link) return;
+
+    for (size_t i = 0; i < link->replay_count; i++) {
+        free(replay_at(link, i));
+    }
+    for (size_t i = 0; i < LINK_REORDER_LIMIT; i++) {
+        free(link->held[i]);
+    }
+    free(link->replay);
+    bytebuf_free(&link->control);
+    bytebuf_free(&link->framed);
+    bytebuf_free(&link->rx);
+    free(link);
+}
+
+// 連番を付けたフレームをframedに足し、再送用に取っておく
+static size_t send_sequenced(link_t *link, int type, const unsigned char *payload, size_t len) {
+    bytebuf_t *framed = &link->framed;
+    size_t start = bytebuf_len(framed);
+    size_t frame_len = build_frame(link, framed, type, link->tx_next, payload, len);
+    link_frame_t *frame = malloc(sizeof(*frame) + frame_len);
+
+    if (!frame) {
+        perror("malloc");
+        exit(1);
+    }
+    frame->type = type;
+    frame->seq = link->tx_next++;
+    frame->len = frame_len;
+    memcpy(frame->data, framed->data + framed->start + start, frame_len);
+    replay_push(link, frame);
+    return frame_len;
+}
+
+// dataをDATAフレームに分けて再送用に取っておき、エンコードしてwireに書く。
+// フレーム化した後の(エンコード前の)バイト数を返す
+size_t link_send(link_t *link, const unsigned char *data, size_t len, bytebuf_t *wire) {
+    bytebuf_t *framed = &link->framed;
+    size_t total = 0;
+
+    for (size_t offset = 0; offset < len; offset += LINK_MAX_PAYLOAD) {
+        size_t chunk = (len - offset < LINK_MAX_PAYLOAD) ? len - offset : LINK_MAX_PAYLOAD;
+        total += send_sequenced(link, LINK_DATA, data + offset, chunk);
+    }
+    if (total > 0) {
+        emit(link, framed->data + framed->start, total, wire);
+        bytebuf_consume(framed, total);
+    }
+    return total;
+}
+
+// EOFを送る。相手はそれまでのデータをすべて受け取った後にlink_peer_eofが真になる
+void link_send_eof(link_t *link, bytebuf_t *wire) {
+    size_t len = send_sequenced(link, LINK_EOF, NULL, 0);
+
+    emit(link, link->framed.data + link->framed.start, len, wire);
+    bytebuf_consume(&link->framed, len);
+}
+
+// 受け取ったデータ (デコード後) からフレームを取り出し、順番どおりになったデータをoutに足す。
+// dataはその場で書き換える。区切りまで届いていない末尾だけを取っておく
+void link_receive(link_t *link, unsigned char *data, size_t len, bytebuf_t *out) {
+    size_t i = 0;
+
+    if (bytebuf_len(&link->rx) > 0) {
+        // 前回の続き
+        unsigned char *delim = memchr(data, 0, len);
+        size_t head = delim ? (size_t)(delim - data) : len;
+        bytebuf_append(&link->rx, data, head);
+        if (delim) {
+            receive_frame(link, link->rx.data + link->rx.start, bytebuf_len(&link->rx), out);
+            bytebuf_consume(&link->rx, bytebuf_len(&link->rx));
+            i = head + 1;
+        } else {
+            i = len;
+        }
+    }
+    while (i < len) {
+        unsigned char *delim = memchr(data + i, 0, len - i);
+        if (!delim) {
+            bytebuf_append(&link->rx, data + i, len - i);
+            break;
+        }
+        size_t frame_len = (size_t)(delim - (data + i));
+        if (frame_len > 0) {
+            receive_frame(link, data + i, frame_len, out);
+        }
+        i += frame_len + 1;
+    }
+    if (bytebuf_len(&link->rx) > LINK_MAX_WIRE_FRAME) {
+        // 区切りが壊れている。次の区切りまで捨てる
+        link->rx_stats->bad_frames++;
+        link->nak_now = 1;
+        bytebuf_consume(&link->rx, bytebuf_len(&link->rx));
+    }
+}
+
+// 期限が来たACK、NAK、再送をwireに書く (wireがNULLなら、送れないので捨てる)。
+// 次の期限までのμs (なければ-1) を返す
+long link_service(link_t *link, bytebuf_t *wire, long long now) {
+    long long next = 0;
+
+    if (link->rx_unacked >= LINK_ACK_EVERY || (link->ack_at != 0 && now >= link->ack_at)) {
+        build_frame(link, &link->control, LINK_ACK, 0, NULL, 0);
+    } else if (link->rx_unacked > 0 && link->ack_at == 0) {
+        link->ack_at = now + LINK_ACK_DELAY_US;
+    }
+
+    int gap = (link->rx_next != link->rx_highest);
+    if (link->nak_now || (gap && now >= link->nak_retry_at)) {
+        send_nak(link);
+        link->nak_now = 0;
+        link->nak_retry_at = now + LINK_NAK_RETRY_US;
+    }
+
+    // 確認応答が進まなければ最も古いフレームを送り直す。届いていれば重複したACKが返る
+    if (link->replay_count == 0) {
+        link->probe_at = 0;
+        link->probe_interval = LINK_PROBE_US;
+    } else if (link->probe_at == 0 || link->acked) {
+        if (link->acked) {
+            link->probe_interval = LINK_PROBE_US;
+        }
+        link->probe_at = now + link->probe_interval;
+    } else if (now >= link->probe_at) {
+        retransmit(link, link->tx_base);
+        link->probe_interval = (link->probe_interval * 2 < LINK_MAX_PROBE_US) ? link->probe_interval * 2
+                                                                               : LINK_MAX_PROBE_US;
+        link->probe_at = now + link->probe_interval;
+    }
+    link->acked = 0;
+
+    if (!wire) {
+        bytebuf_consume(&link->control, bytebuf_len(&link->control));
+        return -1;
+    }
+    if (bytebuf_len(&link->control) > 0) {
+        emit(link, link->control.data + link->control.start, bytebuf_len(&link->control), wire);
+        bytebuf_consume(&link->control, bytebuf_len(&link->control));
+    }
+
+    long long deadlines[3] = {
+        link->ack_at,
+        gap ? link->nak_retry_at : 0,
+        link->probe_at
+    };
+    for (int i = 0; i < 3; i++) {
+        if (deadlines[i] != 0 && (next == 0 || deadlines[i] < next)) {
+            next = deadlines[i];
+        }
+    }
+    if (next == 0) {
+        return -1;
+    }
+    return (next > now) ? (long)(next - now) : 0;
+}
+
+// ttyがつながり直した。途中まで届いたフレームを捨て、確認応答待ちのフレームをすべて
+// 送り直す。次のlink_serviceで、こちらが受け取った位置もすぐに知らせる
+void link_rewind(link_t *link) {
+    bytebuf_consume(&link->rx, bytebuf_len(&link->rx));
+    bytebuf_consume(&link->control, bytebuf_len(&link->control));
+    for (size_t i = 0; i < link->replay_count; i++) {
+        retransmit(link, link->tx_base + (unsigned int)i);
+    }
+    link->rx_unacked = LINK_ACK_EVERY;
+    link->probe_at = 0;
+    link->probe_interval = LINK_PROBE_US;
+}
+
+void link_set_escapes(link_t *link, const escape_set_t *escapes) {
+    link->escapes = escapes;
+}
+
+// 再送用に取っておけるなら、さらに入力を読んでよい
+int link_can_send(const link_t *link) {
+    return link->replay_bytes < LINK_REPLAY_LIMIT;
+}
+
+int link_peer_eof(const link_t *link) {
+    return link->peer_eof;
+}
+
+// 送ったフレームがすべて確認応答された
+int link_idle(const link_t *link) {
+    return link->replay_count == 0;
+}
+
+unsigned long long link_frames_received(const link_t *link) {
+    return link->rx_frames;
+}
+
+size_t link_memory(const link_t *link) {
+    return sizeof(*link) + link->replay_bytes + link->replay_cap * sizeof(*link->replay) +
+           link->control.cap + link->framed.cap + link->rx.cap;
+}
@@ -1,4 +1,5 @@
 #include "trans.h"
+#include <limits.h>
 
 volatile int running = 1;
 
@@ -8,40 +9,38 @@ void cleanup_and_exit(int sig) {
     exit(0);
 }
 
-void log_message(FILE *file, const config_t *config, const char *message) {
-    if (!file || !message) return;
-    
-    struct timeval tv;
-    struct tm *tm_info;
-    gettimeofday(&tv, NULL);
-    tm_info = localtime(&tv.tv_sec);
-    
-    fprintf(file, "%02d:%02d:%02d.%06d ", 
-            tm_info->tm_hour, tm_info->tm_min, tm_info->tm_sec, (int)tv.tv_usec);
-    
-    if (config && config->log_prefix) {
-        fprintf(file, "%s:", config->log_prefix);
+void request_stats_dump(int sig) {
+    (void)sig;
+    stats_requested = 1;
+}
+
+static pid_t main_pid;
+
+// --latency: 終了時に出力する。exec前の子プロセスが終わるときは出さない
+static void report_latency(void) {
+    if (getpid() == main_pid) {
+        latency_dump(stderr);
     }
-    
-    fprintf(file, "%s", message);
-    fflush(file);
 }
 
-void hex_dump_to_file(FILE *file, const char *prefix, const unsigned char *data, size_t len, const config_t *config) {
-    if (!file || !data || len == 0) return;
-    
-    log_message(file, config, "");
-    
-    fprintf(file, "%s", prefix);
-    
-    for (size_t i = 0; i < len; i++) {
-        fprintf(file, "%02x", data[i]);
-        if (i < len - 1) {
-            fprintf(file, " ");
-        }
+// k/m接尾辞つきの大きさを読む。不正か、longに収まらなければ-1を返す
+static long parse_size(const char *spec) {
+    char *end;
+    long multiplier = 1;
+
+    errno = 0;
+    long size = strtol(spec, &end, 10);
+    if (*end == 'k' || *end == 'K') {
+        multiplier = 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        multiplier = 1024 * 1024;
+        end++;
     }
-    fprintf(file, "\n");
-    fflush(file);
+    if (*spec == '\0' || *end != '\0' || size < 0 || errno == ERANGE || size > LONG_MAX / multiplier) {
+        return -1;
+    }
+    return size * multiplier;
 }
 
 void print_usage(const char *program_name) {
@@ -50,17 +49,63 @@ void print_usage(const char *program_name) {
     fprintf(stderr, "  -m, --mode             Mode: send/to (connector) or recv/from (listener)\n");
     fprintf(stderr, "  -p, --port             TCP port number\n");
     fprintf(stderr, "  -h, --host             Host (for sender mode, default: 127.0.0.1)\n");
-    fprintf(stderr, "  -e, --encode           Encoding method: uuencode or escape (default: escape)\n");
+    fprintf(stderr, "  -e, --encode           Encoding method: uuencode, escape or dense (default: escape)\n");
+    fprintf(stderr, "                         dense needs a channel that passes 8-bit bytes\n");
+    fprintf(stderr, "  -z, --compress <0-9>   Compress the stream with zlib before encoding.\n");
+    fprintf(stderr, "                         Both ends must enable it; each end compresses at its own level\n");
+    fprintf(stderr, "      --dedup <size>     Send chunks the peer has already received as short references,\n");
+    fprintf(stderr, "                         keeping a cache of this size per connection and direction,\n");
+    fprintf(stderr, "                         k/m suffix allowed (min: 1m). Both ends must enable it;\n");
+    fprintf(stderr, "                         the receiving end refuses a larger cache than its own\n");
     fprintf(stderr, "  -s, --system           Connect to command instead of stdio\n");
+    fprintf(stderr, "      --mux              Carry all connections over one command/stdio session.\n");
+    fprintf(stderr, "                         Both ends must use it\n");
+    fprintf(stderr, "      --window <auto|size>  Limit unacknowledged data on the --mux session,\n");
+    fprintf(stderr, "                         k/m suffix allowed (min: 64k). auto sizes it from the\n");
+    fprintf(stderr, "                         measured bandwidth and RTT. Only the sending end needs it\n");
+    fprintf(stderr, "      --framed           Add sequence numbers and CRC32C to the encoded stream and\n");
+    fprintf(stderr, "                         retransmit only corrupted frames. Both ends must use it\n");
+    fprintf(stderr, "      --probe            Send every byte value through the channel first and escape\n");
+    fprintf(stderr, "                         only those that do not arrive intact (escape only).\n");
+    fprintf(stderr, "                         Both ends must use it\n");
+    fprintf(stderr, "      --resume           Keep connections open when the command dies, re-run it and\n");
+    fprintf(stderr, "                         continue where it left off (implies --framed). Use with\n");
+    fprintf(stderr, "                         recv -s on one end and send on stdio on the other\n");
+    fprintf(stderr, "      --pipeline         Encode and decode on a thread per direction, so that slow\n");
+    fprintf(stderr, "                         tty writes overlap with reading and encoding. Reads and\n");
+    fprintf(stderr, "                         writes stay on the main thread. In recv mode only as many\n");
+    fprintf(stderr, "                         directions as CPUs get a thread. Cannot be used with --mux\n");
+    fprintf(stderr, "                         or --framed\n");
+    fprintf(stderr, "      --sync             Start once the stdio end has made its tty raw, instead of\n");
+    fprintf(stderr, "                         guessing with --delay. Both ends must use it\n");
     fprintf(stderr, "  -d, --delay            Delay in seconds before start communication\n");
+    fprintf(stderr, "      --latency          Print per-direction latency histograms (queue, codec and\n");
+    fprintf(stderr, "                         write time of each flush) to stderr at exit\n");
     fprintf(stderr, "  -q, --quiet            Suppress stderr output\n");
-    fprintf(stderr, "      --lps, --log-port-stdio  Log port->stdio/command traffic (hex dump)\n");
-    fprintf(stderr, "      --lsp, --log-stdio-port  Log stdio/command->port traffic (hex dump)\n");
+    fprintf(stderr, "  -b, --buffer-size      Maximum I/O buffer size, k/m suffix allowed (default: 64k)\n");
+    fprintf(stderr, "      --backlog <n>      Listen backlog for recv/from (default: SOMAXCONN)\n");
+    fprintf(stderr, "      --pool <n>         Keep n -s commands started ahead of connections (recv only).\n");
+    fprintf(stderr, "                         With --sync, commands whose peer is ready are used first\n");
+    fprintf(stderr, "      --max-memory <size>  Stop accepting while connections hold more buffer\n");
+    fprintf(stderr, "                         memory than this, k/m suffix allowed (default: unlimited)\n");
+    fprintf(stderr, "      --flush <policy>   Flush policy for both directions: interactive, bulk\n");
+    fprintf(stderr, "                         or latency in microseconds up to 5000000 (default: interactive).\n");
+    fprintf(stderr, "                         A latency flushes small reads at once like interactive\n");
+    fprintf(stderr, "      --flush-ps <policy>  Flush policy for port->stdio/command\n");
+    fprintf(stderr, "      --flush-sp <policy>  Flush policy for stdio/command->port\n");
+    fprintf(stderr, "      --flush-latency-us <us>  Latency budget for both directions, keeping the rest\n");
+    fprintf(stderr, "                         of the policies given before it\n");
+    fprintf(stderr, "      --lps, --log-port-stdio  Capture port->stdio/command traffic (binary)\n");
+    fprintf(stderr, "      --lsp, --log-stdio-port  Capture stdio/command->port traffic (binary)\n");
     fprintf(stderr, "      --log-prefix       Custom prefix for log entries (default: none)\n");
     fprintf(stderr, "      --ll               Alias for --log-prefix l --lps log_lps.log --lsp log_lsp.log\n");
     fprintf(stderr, "      --lr               Alias for --log-prefix r --lps log_rps.log --lsp log_rsp.log\n");
+    fprintf(stderr, "      --convert-capture <file>  Print a capture as a text log\n");
+    fprintf(stderr, "      --check-dump <file>...  Check that the paired streams in --ll/--lr captures\n");
+    fprintf(stderr, "                         or text logs match, and show the mismatching bytes\n");
     fprintf(stderr, "      --version          Show version information\n");
     fprintf(stderr, "      --help             Show this help message\n");
+    fprintf(stderr, "Send SIGUSR1 to print per-direction statistics and latency histograms to stderr.\n");
 }
 
 void parse_arguments(int argc, char *argv[], config_t *config) {
@@ -70,8 +115,14 @@ void parse_arguments(int argc, char *argv[], config_t *config) {
         {"host", required_argument, 0, 'h'},
         {"encode", required_argument, 0, 'e'},
         {"system", required_argument, 0, 's'},
+        {"compress", required_argument, 0, 'z'},
+        {"mux", no_argument, 0, 1010},
         {"delay", required_argument, 0, 'd'},
         {"quiet", no_argument, 0, 'q'},
+        {"buffer-size", required_argument, 0, 'b'},
+        {"backlog", required_argument, 0, 1011},
+        {"max-memory", required_argument, 0, 1012},
+        {"pool", required_argument, 0, 1018},
         {"log-port-stdio", required_argument, 0, 1000},
         {"lps", required_argument, 0, 1000},
         {"log-stdio-port", required_argument, 0, 1001},
@@ -79,6 +130,20 @@ void parse_arguments(int argc, char *argv[], config_t *config) {
         {"log-prefix", required_argument, 0, 1002},
         {"ll", no_argument, 0, 1004},
         {"lr", no_argument, 0, 1005},
+        {"flush", required_argument, 0, 1006},
+        {"flush-ps", required_argument, 0, 1007},
+        {"flush-sp", required_argument, 0, 1008},
+        {"flush-latency-us", required_argument, 0, 1009},
+        {"convert-capture", required_argument, 0, 1013},
+        {"check-dump", no_argument, 0, 1023},
+        {"window", required_argument, 0, 1014},
+        {"framed", no_argument, 0, 1015},
+        {"resume", no_argument, 0, 1016},
+        {"probe", no_argument, 0, 1017},
+        {"sync", no_argument, 0, 1019},
+        {"pipeline", no_argument, 0, 1020},
+        {"dedup", required_argument, 0, 1021},
+        {"latency", no_argument, 0, 1022},
         {"version", no_argument, 0, 1003},
         {"help", no_argument, 0, 0},
         {0, 0, 0, 0}
@@ -89,16 +154,34 @@ void parse_arguments(int argc, char *argv[], config_t *config) {
     config->method = METHOD_ESCAPE;
     config->host = "127.0.0.1";
     config->system_command = NULL;
+    config->mux = 0;
+    config->flow_window = 0;
+    config->flow_auto = 0;
+    config->framed = 0;
+    config->resume = 0;
+    config->probe = 0;
+    config->sync = 0;
+    config->pipeline = 0;
+    config->latency_report = 0;
     config->delay_seconds = 0;
     config->quiet = 0;
+    config->buffer_size = DEFAULT_BUFFER_SIZE;
+    config->backlog = SOMAXCONN;
+    config->max_memory = 0;
+    config->pool_size = 0;
+    config->compress_level = -1;
+    config->dedup_cache = 0;
     config->log_port_stdio_file = NULL;
     config->log_stdio_port_file = NULL;
     config->log_prefix = "x";
+    parse_flush_policy("interactive", &config->flush_ps);
+    parse_flush_policy("interactive", &config->flush_sp);
 
     int c;
     int option_index = 0;
+    int check_dump = 0;
 
-    while ((c = getopt_long(argc, argv, "m:p:h:e:s:d:q", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "m:p:h:e:s:d:qb:z:", long_options, &option_index)) != -1) {
         switch (c) {
             case 'm':
                 if (strcmp(optarg, "send") == 0 || strcmp(optarg, "to") == 0) {
@@ -125,6 +208,8 @@ void parse_arguments(int argc, char *argv[], config_t *config) {
                     config->method = METHOD_UUENCODE;
                 } else if (strcmp(optarg, "escape") == 0) {
                     config->method = METHOD_ESCAPE;
+                } else if (strcmp(optarg, "dense") == 0) {
+                    config->method = METHOD_DENSE;
                 } else {
                     fprintf(stderr, "Error: Invalid encoding method '%s'\n", optarg);
                     exit(1);
@@ -133,6 +218,16 @@ void parse_arguments(int argc, char *argv[], config_t *config) {
             case 's':
                 config->system_command = optarg;
                 break;
+            case 'z': {
+                char *end;
+                long level = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || level < 0 || level > 9) {
+                    fprintf(stderr, "Error: Invalid compression level '%s'\n", optarg);
+                    exit(1);
+                }
+                config->compress_level = (int)level;
+                break;
+            }
             case 'd':
                 config->delay_seconds = atoi(optarg);
                 if (config->delay_seconds < 0) {
@@ -143,6 +238,15 @@ void parse_arguments(int argc, char *argv[], config_t *config) {
             case 'q':
                 config->quiet = 1;
                 break;
+            case 'b': {
+                long size = parse_size(optarg);
+                if (size < MIN_BUFFER_SIZE || size > MAX_BUFFER_SIZE) {
+                    fprintf(stderr, "Error: Invalid buffer size '%s'\n", optarg);
+                    exit(1);
+                }
+                config->buffer_size = (size_t)size;
+                break;
+            }
             case 1000:
                 config->log_port_stdio_file = optarg;
                 break;
@@ -162,6 +266,100 @@ void parse_arguments(int argc, char *argv[], config_t *config) {
                 config->log_port_stdio_file = "log_rps.log";
                 config->log_stdio_port_file = "log_rsp.log";
                 break;
+            case 1006: // --flush
+            case 1007: // --flush-ps
+            case 1008: // --flush-sp
+                if ((c != 1008 && parse_flush_policy(optarg, &config->flush_ps) < 0) ||
+                    (c != 1007 && parse_flush_policy(optarg, &config->flush_sp) < 0)) {
+                    fprintf(stderr, "Error: Invalid flush policy '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 1009: { // --flush-latency-us
+                long us = parse_flush_latency(optarg);
+                if (us < 0) {
+                    fprintf(stderr, "Error: Invalid flush latency '%s' (0 to %ld us)\n", optarg,
+                            (long)FLUSH_MAX_LATENCY_US);
+                    exit(1);
+                }
+                config->flush_ps.latency_us = us;
+                config->flush_sp.latency_us = us;
+                break;
+            }
+            case 1010: // --mux
+                config->mux = 1;
+                break;
+            case 1011: // --backlog
+                config->backlog = atoi(optarg);
+                if (config->backlog <= 0) {
+                    fprintf(stderr, "Error: Invalid backlog '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 1018: // --pool
+                config->pool_size = atoi(optarg);
+                if (config->pool_size <= 0) {
+                    fprintf(stderr, "Error: Invalid pool size '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 1012: { // --max-memory
+                long size = parse_size(optarg);
+                if (size < 0) {
+                    fprintf(stderr, "Error: Invalid memory limit '%s'\n", optarg);
+                    exit(1);
+                }
+                config->max_memory = (size_t)size;
+                break;
+            }
+            case 1014: { // --window
+                if (strcmp(optarg, "auto") == 0) {
+                    config->flow_window = MIN_FLOW_WINDOW;
+                    config->flow_auto = 1;
+                    break;
+                }
+                long size = parse_size(optarg);
+                if (size < MIN_FLOW_WINDOW) {
+                    fprintf(stderr, "Error: Invalid window '%s'\n", optarg);
+                    exit(1);
+                }
+                config->flow_window = (size_t)size;
+                config->flow_auto = 0;
+                break;
+            }
+            case 1015: // --framed
+                config->framed = 1;
+                break;
+            case 1017: // --probe
+                config->probe = 1;
+                break;
+            case 1019: // --sync
+                config->sync = 1;
+                break;
+            case 1020: // --pipeline
+                config->pipeline = 1;
+                break;
+            case 1021: { // --dedup
+                long size = parse_size(optarg);
+                if (size < 1024 * 1024) {
+                    fprintf(stderr, "Error: Invalid dedup cache size '%s'\n", optarg);
+                    exit(1);
+                }
+                config->dedup_cache = (size_t)size & ~(size_t)1023; // 相手にはKB単位で知らせる
+                break;
+            }
+            case 1022: // --latency
+                config->latency_report = 1;
+                break;
+            case 1016: // --resume
+                config->resume = 1;
+                config->framed = 1;
+                break;
+            case 1013: // --convert-capture
+                exit(capture_convert(optarg, stdout) < 0 ? 1 : 0);
+            case 1023: // --check-dump (ファイルは残りの引数)
+                check_dump = 1;
+                break;
             case 1003:
                 printf("trans version %s\n", TRANS_VERSION);
                 exit(0);
@@ -176,12 +374,41 @@ void parse_arguments(int argc, char *argv[], config_t *config) {
         }
     }
 
+    if (check_dump) {
+        if (optind >= argc) {
+            fprintf(stderr, "Error: --check-dump requires log files\n");
+            exit(1);
+        }
+        exit(dump_check(argc - optind, argv + optind, stdout) == 0 ? 0 : 1);
+    }
 
     if (config->mode == (trans_mode_t)-1 || config->port == -1) {
         fprintf(stderr, "Error: Mode and port are required\n");
         print_usage(argv[0]);
         exit(1);
     }
+    if (config->flow_window > 0 && !config->mux) {
+        fprintf(stderr, "Error: --window requires --mux\n");
+        exit(1);
+    }
+    if (config->pool_size > 0 && (config->mode != MODE_RECEIVER || !config->system_command || config->mux)) {
+        fprintf(stderr, "Error: --pool requires recv -s without --mux\n");
+        exit(1);
+    }
+    // --framedではlinkを両方向と再送の処理が共有するので、変換だけを別スレッドに移せない
+    if (config->pipeline && (config->mux || config->framed)) {
+        fprintf(stderr, "Error: --pipeline cannot be used with --mux, --framed or --resume\n");
+        exit(1);
+    }
+    if (config->probe && config->method != METHOD_ESCAPE) {
+        fprintf(stderr, "Error: --probe requires -e escape\n");
+        exit(1);
+    }
+    // ttyが切れたとき、-s側はコマンドを起動し直し、標準入出力側は次のttyを待つ
+    if (config->resume && (config->mux || (config->mode == MODE_RECEIVER) != (config->system_command != NULL))) {
+        fprintf(stderr, "Error: --resume works with recv -s and send on stdio, without --mux\n");
+        exit(1);
+    }
 }
 
 int main(int argc, char *argv[]) {
@@ -190,11 +417,23 @@ int main(int argc, char *argv[]) {
     signal(SIGINT, cleanup_and_exit);
     signal(SIGTERM, cleanup_and_exit);
     signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, request_stats_dump);
 
     parse_arguments(argc, argv, &config);
     config.argv0 = argv[0];
+    if (config.latency_report) {
+        main_pid = getpid();
+        atexit(report_latency);
+    }
+
+    // 標準入出力側は、ttyをrawにしたことを最初に知らせる
+    if (config.sync && !config.system_command && sync_announce() < 0) {
+        return 1;
+    }
 
-    if (config.mode == MODE_SENDER) {
+    if (config.mux) {
+        return mux_mode(&config);
+    } else if (config.mode == MODE_SENDER) {
         return sender_mode(&config);
     } else {
         return receiver_mode(&config);
@@ -0,0 +1,705 @@
+#include "trans.h"
+
+// フレーム: 種別(1) チャネルID(4, big endian) 長さ(2, big endian) データ
+#define MUX_HEADER_SIZE 7
+#define MUX_MAX_PAYLOAD 16384
+// ttyへの書き込み待ちがこれを超えたら、接続からの読み込みを止める
+#define MUX_HIGH_WATER (1024 * 1024)
+// 接続ごとのフロー制御: 相手がその接続のソケットに書いたバイト数をSTREAM_CREDITで返してもらい、
+// 送ったのにまだ書かれていないデータを接続ごとに窓の大きさまでに抑える。
+// 読まない接続があっても、相手はttyからの読み込みを止めずに済むので、他の接続は詰まらない
+#define MUX_STREAM_WINDOW (1024 * 1024)
+#define MUX_STREAM_CREDIT_BATCH (64 * 1024)
+// 窓を守らない相手から書き込み待ちがこれを超えたら、その接続を切る
+#define MUX_STREAM_LIMIT (2 * MUX_STREAM_WINDOW)
+
+// フロー制御 (--window): 相手がttyから読んだフレームのバイト数をCREDITで返してもらい、
+// 送ったのにまだ読まれていないバイト数を窓の大きさまでに抑える。
+// 溢れた分はpty/sshのバッファではなく各接続のソケットに留まるので、
+// 大量の転送があっても他の接続の遅延が伸びない。窓の大きさはflow.cで決める
+#define FLOW_CREDIT_BATCH (8 * 1024)        // これだけ受け取るごとにCREDITを返す
+#define FLOW_QUEUE_LIMIT (64 * 1024)        // 窓が閉じている間に溜めておくフレームの上限
+
+typedef enum {
+    MUX_OPEN = 1,   // 新しい接続 (listen側から送る)
+    MUX_DATA,
+    MUX_EOF,        // これ以上データを送らない (half-close)
+    MUX_CLOSE,      // 接続を破棄する
+    MUX_CREDIT,     // 受け取ったフレームのバイト数の累計 (8, big endian)。窓には数えない
+    MUX_STREAM_CREDIT // その接続のソケットに書いたバイト数の累計 (8, big endian)。窓には数えない
+} mux_frame_type_t;
+
+typedef struct {
+    unsigned int id;
+    int fd;
+    int connecting;     // 非同期connectの完了待ち
+    int read_eof;       // ソケットのEOFを相手に送った
+    int peer_eof;       // 相手からEOFを受け取った
+    int closed;         // 次のsweepで破棄する
+    bytebuf_t outbuf;   // ソケットへの書き込み待ち
+    unsigned long long sent;        // 送ったDATAのバイト数
+    unsigned long long acked;       // 相手がソケットに書いたと返してきたバイト数
+    unsigned long long written;     // ソケットに書いたバイト数
+    unsigned long long credited;    // STREAM_CREDITで返したバイト数
+} mux_stream_t;
+
+typedef struct {
+    const config_t *config;
+    int tty_in;
+    int tty_out;
+    int listen_fd;              // to側では-1
+    unsigned int next_id;
+    mux_stream_t **streams;     // IDの昇順
+    size_t stream_count;
+    size_t stream_cap;
+    bytebuf_t frames;           // エンコード待ちのフレーム
+    bytebuf_t wire_out;         // ttyへの書き込み待ち
+    bytebuf_t wire_in;          // デコード待ち
+    bytebuf_t plain_in;         // 解釈待ちのフレーム
+    long long flush_deadline;
+    int flush_now;
+    codec_stream_t encoder;
+    codec_stream_t decoder;
+    bytebuf_t control;              // 窓に関係なく先に送るフレーム (CREDIT)
+    flow_t flow;                    // 窓の大きさが0ならフロー制御しない
+    int window_blocked;             // 窓が閉じていて溜まったフレームを送れない
+    unsigned long long received;    // 受け取ったフレームのバイト数 (CREDITを除く)
+    unsigned long long credited;    // CREDITで返したバイト数
+    link_t *link;                   // --framed
+    escape_set_t escapes;           // --probe
+} mux_t;
+
+static void put_frame_header(unsigned char *p, int type, unsigned int id, size_t len) {
+    p[0] = (unsigned char)type;
+    p[1] = (unsigned char)(id >> 24);
+    p[2] = (unsigned char)(id >> 16);
+    p[3] = (unsigned char)(id >> 8);
+    p[4] = (unsigned char)id;
+    p[5] = (unsigned char)(len >> 8);
+    p[6] = (unsigned char)len;
+}
+
+// フレームが空のバッファに入ったときからflushの期限を数える
+static void frames_added(mux_t *mux, size_t was_len) {
+    if (was_len == 0) {
+        mux->flush_deadline = monotonic_us() + mux->config->flush_ps.latency_us;
+    }
+}
+
+static void queue_frame(mux_t *mux, int type, unsigned int id, const unsigned char *data, size_t len) {
+    size_t was_len = bytebuf_len(&mux->frames);
+    unsigned char *p = bytebuf_reserve(&mux->frames, MUX_HEADER_SIZE + len);
+
+    put_frame_header(p, type, id, len);
+    if (len > 0) {
+        memcpy(p + MUX_HEADER_SIZE, data, len);
+    }
+    mux->frames.end += MUX_HEADER_SIZE + len;
+    frames_added(mux, was_len);
+
+    // 制御フレームは待たせない
+    if (type != MUX_DATA) {
+        mux->flush_now = 1;
+    }
+}
+
+// 窓に収まる先頭のフレームの合計。フレームの途中では区切らない
+static size_t frames_within_window(const mux_t *mux) {
+    size_t room = flow_room(&mux->flow);
+    const unsigned char *p = mux->frames.data + mux->frames.start;
+    size_t len = bytebuf_len(&mux->frames);
+    size_t total = 0;
+
+    while (total + MUX_HEADER_SIZE <= len) {
+        size_t frame = MUX_HEADER_SIZE + (((size_t)p[total + 5] << 8) | p[total + 6]);
+        if (total + frame > room) {
+            break;
+        }
+        total += frame;
+    }
+    return total;
+}
+
+static void flush_frames(mux_t *mux, flush_reason_t reason) {
+    size_t control_len = bytebuf_len(&mux->control);
+    size_t len = bytebuf_len(&mux->frames);
+
+    if (control_len > 0) {
+        codec_stream_encode(&mux->encoder, mux->control.data + mux->control.start, control_len, &mux->wire_out);
+        bytebuf_consume(&mux->control, control_len);
+    }
+    if (mux->flow.window > 0) {
+        len = frames_within_window(mux);
+        mux->window_blocked = (len < bytebuf_len(&mux->frames));
+        if (mux->window_blocked) {
+            flow_blocked(&mux->flow);
+        }
+    }
+    mux->flush_now = 0;
+    if (len == 0) return;
+
+    stats_add(&mux->encoder.stats.flushes[reason], 1);
+    codec_stream_encode(&mux->encoder, mux->frames.data + mux->frames.start, len, &mux->wire_out);
+    bytebuf_consume(&mux->frames, len);
+    flow_sent(&mux->flow, len, monotonic_us());
+}
+
+static void queue_counter(mux_t *mux, int type, unsigned int id, unsigned long long value) {
+    unsigned char *p = bytebuf_reserve(&mux->control, MUX_HEADER_SIZE + 8);
+
+    put_frame_header(p, type, id, 8);
+    for (int i = 0; i < 8; i++) {
+        p[MUX_HEADER_SIZE + i] = (unsigned char)(value >> (56 - 8 * i));
+    }
+    mux->control.end += MUX_HEADER_SIZE + 8;
+    mux->flush_now = 1;
+}
+
+// 受け取ったバイト数を返す
+static void send_credit(mux_t *mux) {
+    queue_counter(mux, MUX_CREDIT, 0, mux->received);
+    mux->credited = mux->received;
+}
+
+// その接続のソケットに書いたバイト数を返す
+static void send_stream_credit(mux_t *mux, mux_stream_t *s) {
+    queue_counter(mux, MUX_STREAM_CREDIT, s->id, s->written);
+    s->credited = s->written;
+}
+
+static unsigned long long get_counter(const unsigned char *payload) {
+    unsigned long long value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | payload[i];
+    }
+    return value;
+}
+
+// 相手が受け取ったバイト数から窓を開け、autoなら窓の大きさを決め直す
+static void credit_received(mux_t *mux, unsigned long long acked) {
+    flow_acked(&mux->flow, acked, monotonic_us());
+    mux->window_blocked = 0;
+}
+
+static mux_stream_t *find_stream(mux_t *mux, unsigned int id) {
+    size_t lo = 0, hi = mux->stream_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (mux->streams[mid]->id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < mux->stream_count && mux->streams[lo]->id == id) {
+        return mux->streams[lo];
+    }
+    return NULL;
+}
+
+// IDは単調に増えるので、末尾に追加すれば昇順が保たれる
+static mux_stream_t *add_stream(mux_t *mux, unsigned int id, int fd) {
+    if (mux->stream_count > 0 && mux->streams[mux->stream_count - 1]->id >= id) {
+        return NULL;
+    }
+    if (mux->stream_count == mux->stream_cap) {
+        size_t new_cap = mux->stream_cap ? mux->stream_cap * 2 : 16;
+        mux_stream_t **new_streams = realloc(mux->streams, new_cap * sizeof(*new_streams));
+        if (!new_streams) {
+            perror("realloc");
+            exit(1);
+        }
+        mux->streams = new_streams;
+        mux->stream_cap = new_cap;
+    }
+
+    mux_stream_t *s = calloc(1, sizeof(*s));
+    if (!s) {
+        perror("calloc");
+        exit(1);
+    }
+    s->id = id;
+    s->fd = fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    mux->streams[mux->stream_count++] = s;
+    return s;
+}
+
+static void close_stream(mux_t *mux, mux_stream_t *s, int notify) {
+    if (s->closed) return;
+    if (notify) {
+        queue_frame(mux, MUX_CLOSE, s->id, NULL, 0);
+    }
+    s->closed = 1;
+}
+
+// 両方向のEOFを交換し、書き込みも終わったストリームを閉じる
+static void finish_stream_if_done(mux_t *mux, mux_stream_t *s) {
+    if (s->connecting || bytebuf_len(&s->outbuf) > 0 || !s->peer_eof) {
+        return;
+    }
+    shutdown(s->fd, SHUT_WR);
+    if (s->read_eof) {
+        close_stream(mux, s, 0);
+    }
+}
+
+static void sweep_streams(mux_t *mux) {
+    size_t kept = 0;
+    for (size_t i = 0; i < mux->stream_count; i++) {
+        mux_stream_t *s = mux->streams[i];
+        if (s->closed) {
+            close(s->fd);
+            bytebuf_free(&s->outbuf);
+            free(s);
+            if (mux->listen_fd >= 0 && !mux->config->quiet) {
+                fprintf(stderr, "Client disconnected\n");
+            }
+        } else {
+            mux->streams[kept++] = s;
+        }
+    }
+    mux->stream_count = kept;
+}
+
+static void read_stream(mux_t *mux, mux_stream_t *s) {
+    size_t was_len = bytebuf_len(&mux->frames);
+    unsigned char *p = bytebuf_reserve(&mux->frames, MUX_HEADER_SIZE + MUX_MAX_PAYLOAD);
+    ssize_t n = read(s->fd, p + MUX_HEADER_SIZE, MUX_MAX_PAYLOAD);
+
+    if (n > 0) {
+        s->sent += (size_t)n;
+        put_frame_header(p, MUX_DATA, s->id, (size_t)n);
+        mux->frames.end += MUX_HEADER_SIZE + (size_t)n;
+        frames_added(mux, was_len);
+        if (was_len == 0 && (size_t)n <= mux->config->flush_ps.small_read) {
+            mux->flush_now = 1;
+        }
+    } else if (n == 0) {
+        s->read_eof = 1;
+        queue_frame(mux, MUX_EOF, s->id, NULL, 0);
+        finish_stream_if_done(mux, s);
+    } else if (errno != EAGAIN && errno != EINTR) {
+        close_stream(mux, s, 1);
+    }
+}
+
+static void write_stream(mux_t *mux, mux_stream_t *s) {
+    if (s->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            if (!mux->config->quiet) {
+                fprintf(stderr, "connect: %s\n", strerror(err));
+            }
+            close_stream(mux, s, 1);
+            return;
+        }
+        s->connecting = 0;
+    }
+
+    size_t len = bytebuf_len(&s->outbuf);
+    if (len > 0) {
+        ssize_t n = write(s->fd, s->outbuf.data + s->outbuf.start, len);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                close_stream(mux, s, 1);
+            }
+            return;
+        }
+        bytebuf_consume(&s->outbuf, (size_t)n);
+        s->written += (size_t)n;
+        if (s->written - s->credited >= MUX_STREAM_CREDIT_BATCH) {
+            send_stream_credit(mux, s);
+        }
+    }
+    finish_stream_if_done(mux, s);
+}
+
+// to側: 新しいチャネルのためにconfigの宛先へ非同期にconnectする
+static int connect_target(const config_t *config, int *connecting) {
+    struct sockaddr_in server_addr;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config->port);
+    if (inet_pton(AF_INET, config->host, &server_addr.sin_addr) <= 0) {
+        if (!config->quiet) {
+            fprintf(stderr, "Invalid address: %s\n", config->host);
+        }
+        close(sock);
+        return -1;
+    }
+
+    *connecting = 0;
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        if (errno != EINPROGRESS) {
+            if (!config->quiet) {
+                perror("connect");
+            }
+            close(sock);
+            return -1;
+        }
+        *connecting = 1;
+    }
+    return sock;
+}
+
+static void handle_frame(mux_t *mux, int type, unsigned int id, const unsigned char *payload, size_t len) {
+    mux_stream_t *s = find_stream(mux, id);
+
+    switch (type) {
+        case MUX_OPEN: {
+            if (mux->listen_fd >= 0 || s) {
+                break; // listen側はOPENを受け付けない
+            }
+            int connecting;
+            int fd = connect_target(mux->config, &connecting);
+            if (fd < 0) {
+                queue_frame(mux, MUX_CLOSE, id, NULL, 0);
+                break;
+            }
+            s = add_stream(mux, id, fd);
+            if (!s) {
+                close(fd);
+                queue_frame(mux, MUX_CLOSE, id, NULL, 0);
+                break;
+            }
+            s->connecting = connecting;
+            break;
+        }
+        case MUX_DATA:
+            if (s && !s->closed) {
+                bytebuf_append(&s->outbuf, payload, len);
+                if (bytebuf_len(&s->outbuf) > MUX_STREAM_LIMIT) {
+                    if (!mux->config->quiet) {
+                        fprintf(stderr, "Channel %u exceeded its window, closing\n", s->id);
+                    }
+                    close_stream(mux, s, 1);
+                }
+            }
+            break;
+        case MUX_EOF:
+            if (s && !s->closed) {
+                s->peer_eof = 1;
+                finish_stream_if_done(mux, s);
+            }
+            break;
+        case MUX_CLOSE:
+            if (s) {
+                close_stream(mux, s, 0);
+            }
+            break;
+        case MUX_CREDIT:
+            if (len == 8 && mux->flow.window > 0) {
+                credit_received(mux, get_counter(payload));
+            }
+            break;
+        case MUX_STREAM_CREDIT:
+            if (len == 8 && s) {
+                s->acked = get_counter(payload);
+            }
+            break;
+        default:
+            if (!mux->config->quiet) {
+                fprintf(stderr, "Unknown mux frame type %d\n", type);
+            }
+            break;
+    }
+}
+
+// 溜まったデータをデコードし、揃ったフレームを処理する
+static void decode_tty(mux_t *mux) {
+    codec_stream_decode(&mux->decoder, &mux->wire_in, &mux->plain_in);
+
+    while (bytebuf_len(&mux->plain_in) >= MUX_HEADER_SIZE) {
+        const unsigned char *f = mux->plain_in.data + mux->plain_in.start;
+        unsigned int id = ((unsigned int)f[1] << 24) | ((unsigned int)f[2] << 16) |
+                          ((unsigned int)f[3] << 8) | f[4];
+        size_t len = ((size_t)f[5] << 8) | f[6];
+
+        if (bytebuf_len(&mux->plain_in) < MUX_HEADER_SIZE + len) {
+            break;
+        }
+        if (f[0] != MUX_CREDIT && f[0] != MUX_STREAM_CREDIT) {
+            mux->received += MUX_HEADER_SIZE + len;
+        }
+        handle_frame(mux, f[0], id, f + MUX_HEADER_SIZE, len);
+        bytebuf_consume(&mux->plain_in, MUX_HEADER_SIZE + len);
+    }
+    // 相手だけが--windowを付けていても止まらないよう、こちらの窓に関係なく返す
+    if (mux->received - mux->credited >= FLOW_CREDIT_BATCH) {
+        send_credit(mux);
+    }
+}
+
+// ttyから読んで処理する。EOFなら0を返す
+static int read_tty(mux_t *mux) {
+    unsigned char *p = bytebuf_reserve(&mux->wire_in, mux->config->buffer_size);
+    ssize_t n = read(mux->tty_in, p, mux->config->buffer_size);
+
+    if (n == 0) {
+        return 0;
+    }
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 1 : 0;
+    }
+    mux->wire_in.end += (size_t)n;
+    decode_tty(mux);
+    return 1;
+}
+
+static int write_tty(mux_t *mux) {
+    size_t len = bytebuf_len(&mux->wire_out);
+    ssize_t n = write(mux->tty_out, mux->wire_out.data + mux->wire_out.start, len);
+    if (n < 0) {
+        if (errno == EAGAIN) {
+            stats_write_stalled(&mux->encoder.stats);
+        }
+        return (errno == EAGAIN || errno == EINTR) ? 1 : 0;
+    }
+    stats_write_progress(&mux->encoder.stats);
+    bytebuf_consume(&mux->wire_out, (size_t)n);
+    return 1;
+}
+
+static void accept_stream(mux_t *mux) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    int fd = accept_nonblocking(mux->listen_fd, (struct sockaddr *)&client_addr, &client_len);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("accept");
+        }
+        return;
+    }
+
+    if (!mux->config->quiet) {
+        fprintf(stderr, "Client connected from %s:%d\n",
+                inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    }
+    mux_stream_t *s = add_stream(mux, mux->next_id++, fd);
+    if (!s) {
+        // IDを使い切った (一周して、まだ開いている接続より小さくなった)
+        if (!mux->config->quiet) {
+            fprintf(stderr, "No channel id left, closing the connection\n");
+        }
+        close(fd);
+        return;
+    }
+    queue_frame(mux, MUX_OPEN, s->id, NULL, 0);
+}
+
+static void run_mux_loop(mux_t *mux) {
+    struct pollfd *pfds = NULL;
+    size_t pfd_cap = 0;
+
+    while (running) {
+        // 期限が来たか、制御フレームや小さな読み込みがあればフレームをエンコードする
+        stats_dump_if_requested();
+        if (bytebuf_len(&mux->frames) > 0 || mux->flush_now) {
+            if (mux->flush_now) {
+                flush_frames(mux, FLUSH_SMALL_READ);
+            } else if (bytebuf_len(&mux->frames) >= mux->config->buffer_size) {
+                flush_frames(mux, FLUSH_FULL);
+            } else if (monotonic_us() >= mux->flush_deadline) {
+                flush_frames(mux, FLUSH_TIMEOUT);
+            }
+        }
+        sweep_streams(mux);
+        long link_timeout = mux->link ? link_service(mux->link, &mux->wire_out, monotonic_us()) : -1;
+
+        if (pfd_cap < mux->stream_count + 3) {
+            pfd_cap = (mux->stream_count + 3) * 2;
+            pfds = realloc(pfds, pfd_cap * sizeof(*pfds));
+            if (!pfds) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+
+        int wire_full = bytebuf_len(&mux->frames) + bytebuf_len(&mux->wire_out) >= MUX_HIGH_WATER;
+        if (mux->flow.window > 0 && bytebuf_len(&mux->frames) >= FLOW_QUEUE_LIMIT) {
+            // 窓が閉じている間は各接続のソケットに留めておく
+            wire_full = 1;
+        }
+        if (mux->link && !link_can_send(mux->link)) {
+            wire_full = 1;
+        }
+
+        pfds[0].fd = mux->tty_in;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = bytebuf_len(&mux->wire_out) > 0 ? mux->tty_out : -1;
+        pfds[1].events = POLLOUT;
+        pfds[2].fd = mux->listen_fd;
+        pfds[2].events = POLLIN;
+        size_t stream_count = mux->stream_count;
+        for (size_t i = 0; i < stream_count; i++) {
+            mux_stream_t *s = mux->streams[i];
+            short events = 0;
+            // 相手がまだソケットに書いていないデータが窓を超えたら、この接続からは読まない
+            if (!s->connecting && !s->read_eof && !wire_full && s->sent - s->acked < MUX_STREAM_WINDOW) {
+                events |= POLLIN;
+            }
+            if (s->connecting || bytebuf_len(&s->outbuf) > 0) {
+                events |= POLLOUT;
+            }
+            pfds[3 + i].fd = events ? s->fd : -1;
+            pfds[3 + i].events = events;
+            pfds[3 + i].revents = 0;
+        }
+
+        long timeout_us = -1;
+        if (bytebuf_len(&mux->frames) > 0 && !mux->window_blocked) {
+            long long wait_us = mux->flush_deadline - monotonic_us();
+            timeout_us = (wait_us > 0) ? (long)wait_us : 0;
+        }
+        if (link_timeout >= 0 && (timeout_us < 0 || link_timeout < timeout_us)) {
+            timeout_us = link_timeout;
+        }
+        if (poll_with_timeout_us(pfds, 3 + stream_count, timeout_us) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        for (size_t i = 0; i < stream_count; i++) {
+            mux_stream_t *s = mux->streams[i];
+            short revents = pfds[3 + i].revents;
+            if (s->closed || revents == 0) continue;
+            if ((revents & (POLLOUT | POLLERR | POLLHUP)) && (s->connecting || bytebuf_len(&s->outbuf) > 0)) {
+                write_stream(mux, s);
+            }
+            if (!s->closed && (revents & (POLLIN | POLLHUP | POLLERR)) && !s->connecting && !s->read_eof) {
+                read_stream(mux, s);
+            }
+        }
+        if (pfds[2].revents & POLLIN) {
+            accept_stream(mux);
+        }
+        if ((pfds[1].revents & (POLLOUT | POLLERR | POLLHUP)) && !write_tty(mux)) {
+            break;
+        }
+        if ((pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) && !read_tty(mux)) {
+            break; // 相手がいなくなった
+        }
+    }
+
+    free(pfds);
+}
+
+int mux_mode(const config_t *config) {
+    mux_t mux;
+    pid_t cmd_pid = -1;
+
+    memset(&mux, 0, sizeof(mux));
+    mux.config = config;
+    mux.listen_fd = -1;
+    mux.next_id = 1;
+    if (config->flow_window > 0) {
+        flow_init(&mux.flow, config->flow_window, config->flow_auto);
+    }
+
+    if (config->mode == MODE_RECEIVER) {
+        mux.listen_fd = open_listener(config);
+        if (mux.listen_fd < 0) {
+            return 1;
+        }
+    }
+
+    if (config->system_command) {
+        cmd_pid = spawn_command(config->system_command, &mux.tty_in, &mux.tty_out);
+        if (cmd_pid < 0) {
+            return 1;
+        }
+    } else {
+        mux.tty_in = STDIN_FILENO;
+        mux.tty_out = STDOUT_FILENO;
+    }
+
+    // delayが設定されている場合は待機
+    if (config->delay_seconds > 0) {
+        sleep(config->delay_seconds);
+    }
+
+    fcntl(mux.tty_in, F_SETFL, fcntl(mux.tty_in, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(mux.tty_out, F_SETFL, fcntl(mux.tty_out, F_GETFL, 0) | O_NONBLOCK);
+
+    capture_t *encode_log = config->log_port_stdio_file ? capture_open(config->log_port_stdio_file, config) : NULL;
+    capture_t *decode_log = config->log_stdio_port_file ? capture_open(config->log_stdio_port_file, config) : NULL;
+    if (codec_stream_init(&mux.encoder, config, 1, encode_log) < 0 ||
+        codec_stream_init(&mux.decoder, config, 0, decode_log) < 0) {
+        fprintf(stderr, "Failed to initialize compression\n");
+        return 1;
+    }
+    if (config->framed) {
+        mux.link = link_new(config, &mux.encoder.stats, &mux.decoder.stats);
+        if (!mux.link) {
+            return 1;
+        }
+        mux.encoder.link = mux.link;
+        mux.decoder.link = mux.link;
+    }
+    if (config->sync && config->system_command && sync_channel(mux.tty_in, &mux.wire_in) < 0) {
+        return 1;
+    }
+    if (config->probe) {
+        // 検査の後に届いたデータはwire_inに残る
+        int count = probe_channel(mux.tty_in, mux.tty_out, &mux.escapes, &mux.wire_in);
+        if (count < 0) {
+            return 1;
+        }
+        if (!config->quiet) {
+            fprintf(stderr, "Channel probed: escaping %d byte values\n", count);
+        }
+        mux.encoder.escapes = &mux.escapes;
+        if (mux.link) {
+            link_set_escapes(mux.link, &mux.escapes);
+        }
+    }
+
+    if (!config->quiet && mux.listen_fd >= 0) {
+        fprintf(stderr, "Waiting for connections on port %d (multiplexed)...\n", config->port);
+    }
+    sprintf(config->argv0, "@:%cmx", config->log_prefix[0]);
+
+    if (bytebuf_len(&mux.wire_in) > 0) {
+        decode_tty(&mux);
+    }
+    run_mux_loop(&mux);
+
+    for (size_t i = 0; i < mux.stream_count; i++) {
+        mux.streams[i]->closed = 1;
+    }
+    sweep_streams(&mux);
+    free(mux.streams);
+    bytebuf_free(&mux.frames);
+    bytebuf_free(&mux.control);
+    bytebuf_free(&mux.wire_out);
+    bytebuf_free(&mux.wire_in);
+    bytebuf_free(&mux.plain_in);
+    codec_stream_close(&mux.encoder);
+    codec_stream_close(&mux.decoder);
+    link_free(mux.link);
+    if (mux.listen_fd >= 0) {
+        close(mux.listen_fd);
+    }
+
+    if (cmd_pid > 0) {
+        if (!config->quiet) {
+            fprintf(stderr, "shell exited.\n");
+        }
+        close(mux.tty_in);
+        close(mux.tty_out);
+        kill(cmd_pid, SIGTERM);
+        waitpid(cmd_pid, NULL, 0);
+    }
+    return 0;
+}
@@ -1,304 +1,140 @@
 #include "trans.h"
 
-typedef enum {
-    ENCODE_MODE,
-    DECODE_MODE
-} process_mode_t;
-
-static void process_and_output_buffer(process_mode_t mode, FILE *log_file, const char *log_prefix, 
-                                     const config_t *config, unsigned char *input_buffer, 
-                                     size_t *buffer_pos, unsigned char *output_buffer, 
-                                     size_t *bytes_processed, size_t *remaining_bytes, 
-                                     int output_fd) {
-    size_t bytes_written;
-    
-    if (mode == ENCODE_MODE) {
-        if (log_file) {
-            hex_dump_to_file(log_file, log_prefix, input_buffer, *buffer_pos, config);
-        }
-        if (config->method == METHOD_UUENCODE) {
-            *bytes_processed = uuencode_data(input_buffer, *buffer_pos, output_buffer);
-        } else {
-            *bytes_processed = escape_encode_data(input_buffer, *buffer_pos, output_buffer);
-        }
-    } else {
-        if (config->method == METHOD_UUENCODE) {
-            *bytes_processed = uudecode_data(input_buffer, *buffer_pos, output_buffer, remaining_bytes);
-        } else {
-            *bytes_processed = escape_decode_data(input_buffer, *buffer_pos, output_buffer, remaining_bytes);
-        }
-        if (log_file) {
-            hex_dump_to_file(log_file, log_prefix, input_buffer, *buffer_pos - *remaining_bytes, config);
-        }
-    }
-
-    if (log_file) {
-        const char *proc_prefix = (mode == ENCODE_MODE) ? "enc-d:" : "dec-d:";
-        hex_dump_to_file(log_file, proc_prefix, output_buffer, *bytes_processed, config);
+// マイクロ秒単位のタイムアウトでpollする (負の値は無期限)
+int poll_with_timeout_us(struct pollfd *fds, nfds_t nfds, long timeout_us) {
+#ifdef __linux__
+    struct timespec ts;
+    if (timeout_us < 0) {
+        return ppoll(fds, nfds, NULL, NULL);
     }
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+    return ppoll(fds, nfds, &ts, NULL);
+#else
+    // ppollのない環境ではミリ秒に切り上げる
+    return poll(fds, nfds, timeout_us < 0 ? -1 : (int)((timeout_us + 999) / 1000));
+#endif
+}
 
-    bytes_written = 0;
-    while (bytes_written < *bytes_processed) {
-        if (log_file) {
-            char mes[BUFSIZ];
-            sprintf(mes, "enc-d:write %ld bytes\n", *bytes_processed - bytes_written);
-            log_message(log_file, config, mes);
-        }
-
-        ssize_t written = write(output_fd, output_buffer + bytes_written,
-                              *bytes_processed - bytes_written);
-        if (written < 0 && errno == EAGAIN) {
-            if (log_file) {
-                char mes[BUFSIZ];
-                sprintf(mes, "write would block: %d\n", errno);
-                log_message(log_file, config, mes);
-            }
-
-            struct pollfd pfd;
-    
-            // pollで書き込み可能になるまで待機
-            pfd.fd = output_fd;
-            pfd.events = POLLOUT;
-            pfd.revents = 0;
-    
-            poll(&pfd, 1, 1000); // 1s
+// sockfdとinput_fd/output_fdの間を、1つのプロセスで双方向に中継する。
+// input_fdとoutput_fdは中継が終わると閉じられる
+// session_fdが0以上なら、--resumeの標準入出力側としてttyが切れても続ける
+static void serve_connection(int sockfd, int input_fd, int output_fd, int session_fd, const char *token,
+                             const config_t *config) {
+    event_t events[16];
 
-            continue;
-        }
-        if (written <= 0) {
-            if (log_file) {
-                char mes[BUFSIZ];
-                sprintf(mes, "write failed: %s (%d)\n", strerror(errno), errno);
-                log_message(log_file, config, mes);
-            }
-            exit(1);
-        }
-        bytes_written += (size_t)written;
-    }
-    if (log_file) {
-        char mes[BUFSIZ];
-        sprintf(mes, "enc-d:write finished\n");
-        log_message(log_file, config, mes);
+    // delayが設定されている場合は待機
+    if (config->delay_seconds > 0) {
+        sleep(config->delay_seconds);
     }
 
-    if (*remaining_bytes > 0) {
-        memmove(input_buffer, input_buffer + *buffer_pos - *remaining_bytes, *remaining_bytes);
-        *buffer_pos = *remaining_bytes;
-    } else {
-        *buffer_pos = 0;
+    event_loop_t *loop = event_loop_new();
+    if (!loop) {
+        exit(1);
     }
-}
-
-ssize_t read_with_timeout(int fd, void *buffer, size_t count, int timeout_ms) {
-    struct pollfd pfd;
-    int poll_result;
-    ssize_t result;
-    
-    // pollで読み取り可能になるまで待機
-    pfd.fd = fd;
-    pfd.events = POLLIN;
-    pfd.revents = 0;
-    
-    poll_result = poll(&pfd, 1, timeout_ms);
-    
-    if (poll_result < 0) {
-        // pollエラー
-        return -2;
-    } else if (poll_result == 0) {
-        // タイムアウト
-        return -1;
+    relay_t *relay = relay_new(config, loop, sockfd, input_fd, output_fd);
+    if (!relay) {
+        exit(1);
     }
-    
-    // データが読み取り可能
-    if (pfd.revents & POLLIN) {
-        result = read(fd, buffer, count);
-        return result;
+    if (session_fd >= 0) {
+        relay_resume_holder(relay, session_fd, token);
     }
-    
-    // その他のイベント
-    return -2;
-}
+    sprintf(config->argv0, "@:%crl", config->log_prefix[0]);
 
-void process_data_stream(int input_fd, int output_fd, process_mode_t mode, 
-                        const config_t *config, FILE *log_file, const char *log_prefix,
-                        const char *eof_message) {
-    unsigned char input_buffer[BUFFER_SIZE];
-    unsigned char output_buffer[MAX_ENCODED_SIZE];
-    size_t buffer_pos = 0;
-    ssize_t bytes_read;
-    size_t bytes_processed;
-    size_t remaining_bytes = 0;
-    
-    // ファイルディスクリプタをノンブロッキングモードに設定（一度だけ）
-    int original_flags = fcntl(input_fd, F_GETFL, 0);
-    if (original_flags != -1) {
-        fcntl(input_fd, F_SETFL, original_flags | O_NONBLOCK);
-    }
-    
-    while (1) {
-        bytes_read = read_with_timeout(input_fd, input_buffer + buffer_pos, 
-                                     BUFFER_SIZE - buffer_pos, 200);
-        
-        if (bytes_read <= -2) { // エラー
+    while (running && !relay_finished(relay)) {
+        stats_dump_if_requested();
+        long timeout_us = relay_service(relay);
+        if (relay_finished(relay)) {
             break;
-        } else if (bytes_read == -1 || bytes_read == 0) { // タイムアウトまたはEOF
-            if (buffer_pos > 0) {
-                if (log_file) {
-                    log_message(log_file, config, "read timeout\n");
-                }
-
-                process_and_output_buffer(mode, log_file, log_prefix, config, input_buffer, &buffer_pos, 
-                                        output_buffer, &bytes_processed, &remaining_bytes, output_fd);
-            }
-            if (bytes_read == 0)
-                break; //EOF
-        } else {
-            buffer_pos += (size_t)bytes_read;
-            
-            if (buffer_pos >= BUFFER_SIZE) {
-                if (log_file) {
-                    log_message(log_file, config, "buffer full\n");
-                }
-
-                process_and_output_buffer(mode, log_file, log_prefix, config, input_buffer, &buffer_pos, 
-                                        output_buffer, &bytes_processed, &remaining_bytes, output_fd);
-            }
+        }
+        int n = event_loop_wait(loop, events, 16, timeout_us);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("event_loop_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            relay_handle_event(relay, &events[i]);
         }
     }
-    
-    if (log_file) {
-        log_message(log_file, config, eof_message);
-        fclose(log_file);
-    }
+
+    relay_free(relay);
+    event_loop_free(loop);
 }
 
 void handle_connection_common(int sockfd, int input_fd, int output_fd, const config_t *config) {
-    pid_t pid1, pid2;
+    serve_connection(sockfd, input_fd, output_fd, -1, NULL, config);
+}
 
-    // delayが設定されている場合は待機
-    if (config->delay_seconds > 0) {
-        sleep(config->delay_seconds);
-    }
+// /bin/sh -c commandを起動し、その標準出力を*input_fdに、標準入力を*output_fdにつなぐ
+pid_t spawn_command(const char *command, int *input_fd, int *output_fd) {
+    int to_child_pipe[2];
+    int from_child_pipe[2];
 
-    pid1 = fork();
-    if (pid1 == 0) {
-        // input_fd -> decode -> sockfd
-        sprintf(config->argv0, "@:%csp", config->log_prefix[0]);
+    if (pipe(to_child_pipe) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    if (pipe(from_child_pipe) == -1) {
+        perror("pipe");
+        close(to_child_pipe[0]);
+        close(to_child_pipe[1]);
+        return -1;
+    }
+    // 1つのプロセスで複数の接続を扱うので、他の接続のコマンドにpipeを継承させない。
+    // 継承されるとpipeが閉じられず、コマンドがEOFを受け取れなくなる
+    for (int i = 0; i < 2; i++) {
+        fcntl(to_child_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(from_child_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
 
-        FILE *log_file = NULL;
-        if (config->log_stdio_port_file) {
-            log_file = fopen(config->log_stdio_port_file, "w");
-        }
+    pid_t cmd_pid = fork();
 
-        // close unnecessary fds
-        close(output_fd);
+    if (cmd_pid < 0) {
+        perror("fork for command");
+        close(to_child_pipe[0]);
+        close(to_child_pipe[1]);
+        close(from_child_pipe[0]);
+        close(from_child_pipe[1]);
+        return -1;
+    }
 
-        process_data_stream(input_fd, sockfd, DECODE_MODE, config, log_file, 
-                          "todec:", "from input: EOF detected");
-        close(input_fd);
-        close(sockfd);
-        exit(0);
-    } else if (pid1 > 0) {
-        pid2 = fork();
-        if (pid2 == 0) {
-            // sock_fd -> encode -> output_fd
-            sprintf(config->argv0, "@:%cps", config->log_prefix[0]);
+    if (cmd_pid == 0) { // Child process for the command
+        close(to_child_pipe[1]);
+        dup2(to_child_pipe[0], STDIN_FILENO);
+        close(to_child_pipe[0]);
 
-            FILE *log_file = NULL;
-            if (config->log_port_stdio_file) {
-                log_file = fopen(config->log_port_stdio_file, "w");
-            }
-            
-            // close unnecessary fds
-            close(input_fd);
-
-            process_data_stream(sockfd, output_fd, ENCODE_MODE, config, log_file,
-                              "toenc:", "from socket: EOF detected");
-            close(sockfd);
-            close(output_fd);
-            exit(0);
-        } else if (pid2 > 0) {
-            // parent
-            sprintf(config->argv0, "@:%c:w", config->log_prefix[0]);
+        close(from_child_pipe[0]);
+        dup2(from_child_pipe[1], STDOUT_FILENO);
+        close(from_child_pipe[1]);
 
-            int status;
-            close(input_fd);
-            close(output_fd);
-            close(sockfd);
-            
-            pid_t wpid;
-            int remaining = 2;
-
-            while (remaining > 0) {
-                wpid = waitpid(-1, &status, 0);  // 終了した子1つを待つ
-                if (wpid == -1) {
-                    break;
-                }
-                remaining--;
-            }
-        } else {
-            // 2度目のforkに失敗した。ひとつめを終了させる
-            perror("fork");
-            kill(pid1, SIGTERM);
-            waitpid(pid1, NULL, 0);
-            exit(1);
-        }
-    } else {
-        perror("fork");
+        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        perror("execl");
         exit(1);
     }
+
+    // Parent process
+    close(to_child_pipe[0]);
+    close(from_child_pipe[1]);
+    *output_fd = to_child_pipe[1];
+    *input_fd = from_child_pipe[0];
+    return cmd_pid;
 }
 
 void handle_connection(int sockfd, const config_t *config) {
     if (config->system_command) {
-        int to_child_pipe[2];
-        int from_child_pipe[2];
-
-        if (pipe(to_child_pipe) == -1 || pipe(from_child_pipe) == -1) {
-            perror("pipe");
-            return;
-        }
-
-        pid_t cmd_pid = fork();
-
+        int to_cmd_fd, from_cmd_fd;
+        pid_t cmd_pid = spawn_command(config->system_command, &from_cmd_fd, &to_cmd_fd);
         if (cmd_pid < 0) {
-            perror("fork for command");
-            close(to_child_pipe[0]);
-            close(to_child_pipe[1]);
-            close(from_child_pipe[0]);
-            close(from_child_pipe[1]);
             return;
         }
 
-        if (cmd_pid == 0) { // Child process for the command
-            close(to_child_pipe[1]);
-            dup2(to_child_pipe[0], STDIN_FILENO);
-            close(to_child_pipe[0]);
-
-            close(from_child_pipe[0]);
-            dup2(from_child_pipe[1], STDOUT_FILENO);
-            close(from_child_pipe[1]);
-
-            execl("/bin/sh", "sh", "-c", config->system_command, (char *)NULL);
-            perror("execl");
-            exit(1);
-        }
-
-        // Parent process
-        close(to_child_pipe[0]);
-        close(from_child_pipe[1]);
-        int to_cmd_fd = to_child_pipe[1];
-        int from_cmd_fd = from_child_pipe[0];
-
         handle_connection_common(sockfd, from_cmd_fd, to_cmd_fd, config);
 
         if (!config->quiet) {
             fprintf(stderr, "shell exited.\n");
         }
 
-        close(to_cmd_fd);
-        close(from_cmd_fd);
-
         if (cmd_pid > 0) {
             int status;
             kill(cmd_pid, SIGTERM);
@@ -314,6 +150,28 @@ void handle_connection(int sockfd, const config_t *config) {
 int sender_mode(const config_t *config) {
     int client_sock;
     struct sockaddr_in server_addr;
+    char token[SESSION_TOKEN_SIZE + 1];
+
+    if (config->resume) {
+        // -s側が最初に書くtokenを読む。そのセッションが続いていれば、このttyを渡して任せる
+        int again;
+        if (session_read_hello(STDIN_FILENO, token, &again) < 0) {
+            fprintf(stderr, "No session token on stdin\n");
+            return 1;
+        }
+        if (session_handover(token, STDIN_FILENO, STDOUT_FILENO) == 0) {
+            return 0;
+        }
+        if (again) {
+            // 終わったセッションのために新しく接続しない
+            if (!config->quiet) {
+                fprintf(stderr, "Session %s has ended\n", token);
+            }
+            return 1;
+        }
+        // sshが切れてもセッションは残る
+        signal(SIGHUP, SIG_IGN);
+    }
     
     // ソケット作成
     client_sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -350,7 +208,16 @@ int sender_mode(const config_t *config) {
     }
 
     // 接続処理
-    handle_connection(client_sock, config);
+    if (config->resume) {
+        int session_fd = session_listen(token);
+        if (session_fd < 0) {
+            close(client_sock);
+            return 1;
+        }
+        serve_connection(client_sock, STDIN_FILENO, STDOUT_FILENO, session_fd, token, config);
+    } else {
+        handle_connection(client_sock, config);
+    }
     
     close(client_sock);
     if (!config->quiet) {
@@ -359,86 +226,587 @@ int sender_mode(const config_t *config) {
     return 0;
 }
 
-int receiver_mode(const config_t *config) {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
+// listenするソケットを作る。acceptはノンブロッキングで行う
+int open_listener(const config_t *config) {
+    struct sockaddr_in server_addr;
     int opt = 1;
-    
-    // ソケット作成
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
         perror("socket");
-        return 1;
+        return -1;
     }
-    
-    // ソケットオプション設定
-    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         perror("setsockopt");
-        close(server_sock);
-        return 1;
+        close(sock);
+        return -1;
     }
-    
-    // サーバーアドレス設定
+
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(config->port);
-    
-    // バインド
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+
+    if (bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("bind");
-        close(server_sock);
-        return 1;
+        close(sock);
+        return -1;
     }
-    
-    // リッスン
-    if (listen(server_sock, 1) < 0) {
+    if (listen(sock, config->backlog) < 0) {
         perror("listen");
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    return sock;
+}
+
+// ノンブロッキングかつclose-on-execのソケットとしてacceptする
+int accept_nonblocking(int listen_fd, struct sockaddr *addr, socklen_t *addr_len) {
+#ifdef __linux__
+    return accept4(listen_fd, addr, addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int fd = accept(listen_fd, addr, addr_len);
+    if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+    return fd;
+#endif
+}
+
+// 受信側の1接続
+typedef struct {
+    int sockfd;
+    pid_t cmd_pid;
+    int input_fd;               // 中継を始めるまで持っておくコマンドのpipe
+    int output_fd;
+    relay_t *relay;             // delayが明けるまではNULL
+    long long start_at;         // 中継を始める時刻
+    bytebuf_t preread;          // --pool --sync: コマンドを待つ間に読んでおいたttyの出力
+    int synced;                 // --pool --sync: 印はもう受け取っている
+    size_t peak_memory;
+    size_t memory;              // 合計に数えている中継のバッファ
+    long long due;              // 次に動かす時刻
+    size_t heap_index;          // 期限のヒープでの位置。NOT_IN_HEAPなら期限はない
+    size_t index;               // 接続の配列での位置
+    int touched;                // 次のループで動かす
+} connection_t;
+
+#define NOT_IN_HEAP ((size_t)-1)
+
+// 受信側の全接続。期限はヒープで、バッファの合計は動かした接続の分だけ更新して、
+// 1回の待機で接続の数に比例する処理をしないようにする
+typedef struct {
+    const config_t *config;
+    event_loop_t *loop;
+    connection_t **conns;
+    size_t conn_count;
+    size_t conn_cap;
+    connection_t **heap;        // 期限の早い順の二分ヒープ
+    size_t heap_count;
+    connection_t **touched;     // イベントがあったか期限が来た接続
+    size_t touched_count;
+    size_t total_memory;
+} receiver_t;
+
+// 1回の待機で処理するイベントの数
+#define RECEIVER_MAX_EVENTS 256
+
+// --pool: 起動しておいたコマンドが終わってしまったら、これだけ待ってから補充する
+#define POOL_RETRY_US 1000000
+// 使われないまま準備できてからこれだけ経ったコマンドは、sshのタイムアウトなどを避けるため起動し直す
+#define POOL_IDLE_US (600LL * 1000000)
+
+// 接続より先に起動したコマンド。ssh接続などの準備を接続を待つ間に済ませておく。
+// --syncでは標準入出力側の印を受け取ったら準備ができたとみなし、それ以外ではdelayが明けたらとみなす
+typedef struct {
+    pid_t pid;
+    int input_fd;
+    int output_fd;
+    long long ready_at;         // delayが明ける時刻
+    int synced;                 // --sync: 印を受け取った
+    bytebuf_t preread;          // --sync: 読んでおいたttyの出力 (印を受け取った後はその後のデータ)
+    long long expire_at;        // これまでに使われなければ起動し直す
+} pooled_command_t;
+
+typedef struct {
+    pooled_command_t *entries;  // 起動した順
+    size_t count;
+    long long refill_at;
+} command_pool_t;
+
+// i番目のコマンドを捨てる。killなら終わらせる (回収はループの中でまとめて行う)
+static void pool_drop(command_pool_t *pool, size_t i, event_loop_t *loop, int kill_command) {
+    pooled_command_t *entry = &pool->entries[i];
+
+    if (kill_command) {
+        kill(entry->pid, SIGTERM);
+    }
+    event_loop_remove(loop, entry->input_fd);
+    close(entry->input_fd);
+    close(entry->output_fd);
+    bytebuf_free(&entry->preread);
+    memmove(entry, entry + 1, (pool->count - i - 1) * sizeof(*pool->entries));
+    pool->count--;
+}
+
+static void pool_fill(command_pool_t *pool, const config_t *config, event_loop_t *loop, long long now) {
+    if (now < pool->refill_at) {
+        return;
+    }
+    if (!pool->entries && config->pool_size > 0) {
+        pool->entries = calloc((size_t)config->pool_size, sizeof(*pool->entries));
+        if (!pool->entries) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    while (pool->count < (size_t)config->pool_size) {
+        pooled_command_t *entry = &pool->entries[pool->count];
+        memset(entry, 0, sizeof(*entry));
+        entry->pid = spawn_command(config->system_command, &entry->input_fd, &entry->output_fd);
+        if (entry->pid < 0) {
+            pool->refill_at = now + POOL_RETRY_US;
+            return;
+        }
+        entry->ready_at = now + (long long)config->delay_seconds * 1000000;
+        if (config->sync) {
+            // 印が届くまでの出力を読み捨てる。pipeが詰まるとコマンドが止まってしまう
+            fcntl(entry->input_fd, F_SETFL, fcntl(entry->input_fd, F_GETFL, 0) | O_NONBLOCK);
+            event_loop_set(loop, entry->input_fd, EVENT_READ, pool);
+            entry->expire_at = now + SYNC_TIMEOUT_US;
+        } else {
+            entry->expire_at = entry->ready_at + POOL_IDLE_US;
+        }
+        pool->count++;
+    }
+}
+
+// --sync: 待っているコマンドの出力を読み、印が届いたら準備ができたとする
+static void pool_input(command_pool_t *pool, int fd, const config_t *config, event_loop_t *loop, long long now) {
+    for (size_t i = 0; i < pool->count; i++) {
+        pooled_command_t *entry = &pool->entries[i];
+        if (entry->input_fd != fd) continue;
+
+        unsigned char *p = bytebuf_reserve(&entry->preread, 4096);
+        ssize_t n = read(fd, p, 4096);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            if (!config->quiet) {
+                fprintf(stderr, "Pooled command closed its output before the peer was ready.\n");
+            }
+            pool_drop(pool, i, loop, 1);
+            pool->refill_at = now + POOL_RETRY_US;
+            return;
+        }
+        entry->preread.end += (size_t)n;
+        if (sync_receive(&entry->preread)) {
+            // ここからの出力は接続の中継が読む
+            entry->synced = 1;
+            entry->expire_at = now + POOL_IDLE_US;
+            event_loop_set(loop, fd, 0, pool);
+        }
+        return;
+    }
+}
+
+// 準備できないままのコマンドや、長く使われなかったコマンドを捨てる
+static void pool_expire(command_pool_t *pool, const config_t *config, event_loop_t *loop, long long now) {
+    for (size_t i = 0; i < pool->count; ) {
+        pooled_command_t *entry = &pool->entries[i];
+        if (now < entry->expire_at) {
+            i++;
+            continue;
+        }
+        if (!config->quiet) {
+            fprintf(stderr, (config->sync && !entry->synced) ? "Pooled command timed out waiting for the peer.\n"
+                                                              : "Pooled command idle too long, restarting.\n");
+        }
+        pool_drop(pool, i, loop, 1);
+    }
+}
+
+// 次に補充するか、コマンドを捨てる時刻。なければ-1
+static long long pool_next_due(const command_pool_t *pool, const config_t *config) {
+    long long due = (pool->count < (size_t)config->pool_size) ? pool->refill_at : -1;
+
+    for (size_t i = 0; i < pool->count; i++) {
+        if (due < 0 || pool->entries[i].expire_at < due) {
+            due = pool->entries[i].expire_at;
+        }
+    }
+    return due;
+}
+
+// 待っている間に終わったコマンドを捨てる。すぐ終わるコマンドを起動し続けないよう、補充を遅らせる
+static void pool_reaped(command_pool_t *pool, pid_t pid, const config_t *config, event_loop_t *loop, long long now) {
+    for (size_t i = 0; i < pool->count; i++) {
+        if (pool->entries[i].pid != pid) continue;
+        pool_drop(pool, i, loop, 0);
+        pool->refill_at = now + POOL_RETRY_US;
+        if (!config->quiet) {
+            fprintf(stderr, "Pooled command exited.\n");
+        }
+        return;
+    }
+}
+
+// 準備できたコマンドのうち最も早く起動したものを接続に渡す。--syncでまだ印が届いたものがなければ、
+// 最も早く起動したものを渡し、印は中継が待つ。なければ-1を返す
+static int pool_take(command_pool_t *pool, connection_t *conn, event_loop_t *loop, long long now) {
+    size_t i = 0;
+
+    if (pool->count == 0) {
+        return -1;
+    }
+    while (i < pool->count && !pool->entries[i].synced) {
+        i++;
+    }
+    if (i == pool->count) {
+        i = 0;
+    }
+    pooled_command_t *entry = &pool->entries[i];
+    event_loop_remove(loop, entry->input_fd);
+    conn->cmd_pid = entry->pid;
+    conn->input_fd = entry->input_fd;
+    conn->output_fd = entry->output_fd;
+    conn->start_at = (!entry->synced && entry->ready_at > now) ? entry->ready_at : now;
+    conn->preread = entry->preread;
+    conn->synced = entry->synced;
+    memmove(entry, entry + 1, (pool->count - i - 1) * sizeof(*pool->entries));
+    pool->count--;
+    return 0;
+}
+
+static void pool_close(command_pool_t *pool, event_loop_t *loop) {
+    while (pool->count > 0) {
+        pool_drop(pool, pool->count - 1, loop, 1);
+    }
+    free(pool->entries);
+}
+
+static void close_connection(connection_t *conn, const config_t *config) {
+    // --resumeでは中継がコマンドを起動し直している
+    pid_t cmd_pid = (conn->cmd_pid < 0 && conn->relay) ? relay_command_pid(conn->relay) : conn->cmd_pid;
+
+    if (conn->relay) {
+        relay_free(conn->relay);
+    }
+    if (conn->input_fd >= 0) {
+        close(conn->input_fd);
+        close(conn->output_fd);
+    }
+    close(conn->sockfd);
+    bytebuf_free(&conn->preread);
+    if (cmd_pid > 0) {
+        // 終了はループの中でまとめて回収する
+        kill(cmd_pid, SIGTERM);
+        if (!config->quiet) {
+            fprintf(stderr, "shell exited.\n");
+        }
+    }
+    if (!config->quiet) {
+        fprintf(stderr, "Client disconnected (peak buffer %lu bytes)\n", (unsigned long)conn->peak_memory);
+    }
+}
+
+static int start_connection(connection_t *conn, const config_t *config, event_loop_t *loop) {
+    int input_fd, output_fd;
+
+    if (config->system_command) {
+        if (conn->cmd_pid < 0) {
+            conn->cmd_pid = spawn_command(config->system_command, &conn->input_fd, &conn->output_fd);
+            if (conn->cmd_pid < 0) {
+                return -1;
+            }
+        }
+        // ここからは中継が閉じる
+        input_fd = conn->input_fd;
+        output_fd = conn->output_fd;
+        conn->input_fd = -1;
+        conn->output_fd = -1;
+    } else {
+        // 中継が終わると閉じられるので、標準入出力そのものは渡さない
+        input_fd = dup(STDIN_FILENO);
+        output_fd = dup(STDOUT_FILENO);
+    }
+    conn->relay = relay_new(config, loop, conn->sockfd, input_fd, output_fd);
+    if (conn->relay && config->sync && config->system_command) {
+        relay_preread(conn->relay, &conn->preread, conn->synced);
+    }
+    bytebuf_free(&conn->preread);
+    if (conn->relay && config->resume) {
+        relay_resume_spawner(conn->relay, conn->cmd_pid);
+        conn->cmd_pid = -1;
+    }
+    return conn->relay ? 0 : -1;
+}
+
+static void heap_place(receiver_t *r, size_t i, connection_t *conn) {
+    r->heap[i] = conn;
+    conn->heap_index = i;
+}
+
+static void heap_sift_up(receiver_t *r, size_t i) {
+    connection_t *conn = r->heap[i];
+    while (i > 0 && r->heap[(i - 1) / 2]->due > conn->due) {
+        heap_place(r, i, r->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_place(r, i, conn);
+}
+
+static void heap_sift_down(receiver_t *r, size_t i) {
+    connection_t *conn = r->heap[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= r->heap_count) break;
+        if (child + 1 < r->heap_count && r->heap[child + 1]->due < r->heap[child]->due) {
+            child++;
+        }
+        if (r->heap[child]->due >= conn->due) break;
+        heap_place(r, i, r->heap[child]);
+        i = child;
+    }
+    heap_place(r, i, conn);
+}
+
+// 接続の期限を変える。dueが負なら期限をなくす
+static void set_due(receiver_t *r, connection_t *conn, long long due) {
+    size_t i = conn->heap_index;
+
+    if (due < 0) {
+        if (i == NOT_IN_HEAP) return;
+        conn->heap_index = NOT_IN_HEAP;
+        if (i < --r->heap_count) {
+            // 末尾の要素で穴を埋める
+            connection_t *moved = r->heap[r->heap_count];
+            heap_place(r, i, moved);
+            heap_sift_up(r, i);
+            heap_sift_down(r, moved->heap_index);
+        }
+        return;
+    }
+    conn->due = due;
+    if (i == NOT_IN_HEAP) {
+        i = r->heap_count++;
+        r->heap[i] = conn;
+    }
+    heap_sift_up(r, i);
+    heap_sift_down(r, conn->heap_index);
+}
+
+static void touch_connection(receiver_t *r, connection_t *conn) {
+    if (!conn->touched) {
+        conn->touched = 1;
+        r->touched[r->touched_count++] = conn;
+    }
+}
+
+static connection_t *add_connection(receiver_t *r, int sockfd) {
+    if (r->conn_count == r->conn_cap) {
+        r->conn_cap = r->conn_cap ? r->conn_cap * 2 : 16;
+        connection_t **conns = realloc(r->conns, r->conn_cap * sizeof(*conns));
+        connection_t **heap = realloc(r->heap, r->conn_cap * sizeof(*heap));
+        connection_t **touched = realloc(r->touched, r->conn_cap * sizeof(*touched));
+        if (!conns || !heap || !touched) {
+            perror("realloc");
+            exit(1);
+        }
+        r->conns = conns;
+        r->heap = heap;
+        r->touched = touched;
+    }
+    connection_t *conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        perror("calloc");
+        exit(1);
+    }
+    conn->sockfd = sockfd;
+    conn->cmd_pid = -1;
+    conn->input_fd = -1;
+    conn->output_fd = -1;
+    conn->heap_index = NOT_IN_HEAP;
+    conn->index = r->conn_count;
+    r->conns[r->conn_count++] = conn;
+    return conn;
+}
+
+static void remove_connection(receiver_t *r, connection_t *conn) {
+    set_due(r, conn, -1);
+    r->total_memory -= conn->memory;
+    close_connection(conn, r->config);
+    r->conns[conn->index] = r->conns[--r->conn_count];
+    r->conns[conn->index]->index = conn->index;
+    free(conn);
+}
+
+// 中継を始めるか動かし、期限とバッファの合計を更新する
+static void service_connection(receiver_t *r, connection_t *conn, long long now) {
+    conn->touched = 0;
+    if (!conn->relay) {
+        if (now < conn->start_at) {
+            set_due(r, conn, conn->start_at);
+            return;
+        }
+        if (start_connection(conn, r->config, r->loop) < 0) {
+            remove_connection(r, conn);
+            return;
+        }
+        relay_set_owner(conn->relay, conn);
+    }
+    long timeout_us = relay_service(conn->relay);
+    if (relay_finished(conn->relay)) {
+        remove_connection(r, conn);
+        return;
+    }
+    size_t memory = relay_memory(conn->relay);
+    r->total_memory = r->total_memory - conn->memory + memory;
+    conn->memory = memory;
+    if (memory > conn->peak_memory) {
+        conn->peak_memory = memory;
+    }
+    set_due(r, conn, timeout_us >= 0 ? now + timeout_us : -1);
+}
+
+// ファイルディスクリプタの上限を引き上げる。接続ごとにソケットとpipe 2本を使う
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// 1つのプロセスで、すべての接続とそのコマンドのpipeをイベントループで扱う
+int receiver_mode(const config_t *config) {
+    receiver_t r = {0};
+    event_t events[RECEIVER_MAX_EVENTS];
+    command_pool_t pool = {0};
+
+    raise_fd_limit();
+    int server_sock = open_listener(config);
+    if (server_sock < 0) {
+        return 1;
+    }
+    event_loop_t *loop = event_loop_new();
+    if (!loop) {
         close(server_sock);
         return 1;
     }
-    
+    r.config = config;
+    r.loop = loop;
+
     if (!config->quiet) {
         fprintf(stderr, "Waiting for connection on port %d...\n", config->port);
     }
-    
+    sprintf(config->argv0, "@:%crv", config->log_prefix[0]);
+
     while (running) {
-        // 接続待ち
-        client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &client_len);
-        if (client_sock < 0) {
-            if (running) {
-                perror("accept");
+        long long now = monotonic_us();
+        long timeout_us = -1;
+
+        stats_dump_if_requested();
+
+        // イベントがあった接続と期限が来た接続だけを動かす
+        while (r.heap_count > 0 && r.heap[0]->due <= now) {
+            connection_t *conn = r.heap[0];
+            set_due(&r, conn, -1);
+            touch_connection(&r, conn);
+        }
+        for (size_t i = 0; i < r.touched_count; i++) {
+            service_connection(&r, r.touched[i], now);
+        }
+        r.touched_count = 0;
+        if (r.heap_count > 0) {
+            timeout_us = (r.heap[0]->due > now) ? (long)(r.heap[0]->due - now) : 0;
+        }
+
+        // 終了したコマンドを回収し、起動しておくコマンドを補充する
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            pool_reaped(&pool, pid, config, loop, now);
+        }
+        if (config->pool_size > 0) {
+            pool_expire(&pool, config, loop, now);
+            pool_fill(&pool, config, loop, now);
+            long long pool_due = pool_next_due(&pool, config);
+            if (pool_due >= 0) {
+                long pool_timeout = (pool_due > now) ? (long)(pool_due - now) : 0;
+                if (timeout_us < 0 || pool_timeout < timeout_us) {
+                    timeout_us = pool_timeout;
+                }
             }
+        }
+
+        // 標準入出力は同時に1つの接続にしかつなげない。
+        // バッファが上限を超えている間も新しい接続を受け付けない
+        int accepting = (config->system_command || r.conn_count == 0) &&
+                        (config->max_memory == 0 || r.total_memory < config->max_memory);
+        event_loop_set(loop, server_sock, accepting ? EVENT_READ : 0, NULL);
+
+        int n = event_loop_wait(loop, events, RECEIVER_MAX_EVENTS, timeout_us);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("event_loop_wait");
             break;
         }
-        
-        if (!config->quiet) {
-            fprintf(stderr, "Client connected from %s:%d\n", 
-                    inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-        }
-        
-        // 新しいプロセスを作成して接続を処理
-        pid_t connection_pid = fork();
-        if (connection_pid == 0) {
-            // 子プロセス: この接続を処理
-            close(server_sock); // 子プロセスではサーバーソケットは不要
-            
-            handle_connection(client_sock, config);
-            close(client_sock);
-            if (!config->quiet) {
-                fprintf(stderr, "Client disconnected\n");
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data == &pool) {
+                pool_input(&pool, events[i].fd, config, loop, monotonic_us());
+                continue;
+            }
+            if (events[i].data) {
+                relay_handle_event(events[i].data, &events[i]);
+                touch_connection(&r, relay_owner(events[i].data));
+                continue;
+            }
+
+            // 溜まっている接続をまとめて受け付ける
+            while (accepting) {
+                struct sockaddr_in client_addr;
+                socklen_t client_len = sizeof(client_addr);
+                int client_sock = accept_nonblocking(server_sock, (struct sockaddr *)&client_addr, &client_len);
+                if (client_sock < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                        perror("accept");
+                    }
+                    break;
+                }
+                if (!config->quiet) {
+                    fprintf(stderr, "Client connected from %s:%d\n",
+                            inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+                }
+
+                connection_t *conn = add_connection(&r, client_sock);
+                touch_connection(&r, conn);
+                if (!config->system_command) {
+                    conn->start_at = monotonic_us() + (long long)config->delay_seconds * 1000000;
+                    break;
+                }
+                // コマンドはすぐに起動し、delayの間に準備させる
+                long long accepted_at = monotonic_us();
+                if (pool_take(&pool, conn, loop, accepted_at) < 0) {
+                    conn->cmd_pid = spawn_command(config->system_command, &conn->input_fd, &conn->output_fd);
+                    conn->start_at = accepted_at + (long long)config->delay_seconds * 1000000;
+                }
             }
-            exit(0);
-        } else if (connection_pid > 0) {
-            // 親プロセス: 子プロセスは独立して動作するので、ソケットを閉じて次の接続を待つ
-            close(client_sock);
-        } else {
-            perror("fork");
-            close(client_sock);
         }
     }
-    
+
+    while (r.conn_count > 0) {
+        remove_connection(&r, r.conns[r.conn_count - 1]);
+    }
+    pool_close(&pool, loop);
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+    free(r.conns);
+    free(r.heap);
+    free(r.touched);
+    event_loop_free(loop);
     close(server_sock);
     return 0;
 }
@@ -0,0 +1,315 @@
+#include "trans.h"
+#include <pthread.h>
+
+// --pipeline: 1方向のエンコード/デコードを別スレッドで行う。
+// 中継のスレッドが読み込みと書き込みを、ワーカーが変換を受け持ち、間を2本のリングでつなぐ。
+//
+//   in:  中継 -> ワーカー  flushした単位のまま 長さ(4) データ を並べる
+//   out: ワーカー -> 中継  変換済みのバイト列
+//
+// どちらのリングも書き手と読み手が1つずつなので、位置の読み書きだけで受け渡す (ロックしない)。
+// 相手が待っているときだけpipeに1バイト書いて起こす
+
+#define PIPELINE_OUT_RING_SIZE (1024 * 1024)
+#define PIPELINE_RECORD_HEADER_SIZE 4
+
+typedef struct {
+    unsigned char *data;
+    size_t size;                // 2の冪
+    size_t head;                // 書き手だけが進める (累積)
+    size_t tail;                // 読み手だけが進める (累積)
+} spsc_ring_t;
+
+struct pipeline {
+    codec_stream_t *codec;      // 動いている間はワーカーが変換に使う (中継のスレッドは統計を読むだけ)
+    int encoding;
+    spsc_ring_t in;
+    spsc_ring_t out;
+    unsigned long long pushed;  // 中継が積んだ単位の数
+    unsigned long long done;    // ワーカーが変換して出力まで積んだ単位の数
+    size_t codec_memory;        // ワーカーが変換の後に知らせる、codecのバッファの大きさ
+    int worker_waiting;         // ワーカーがwake_worker[0]で眠っている
+    int relay_waiting;          // 中継がwake_relay[0]を待っている
+    int stop;
+    int wake_worker[2];
+    int wake_relay[2];
+    pthread_t worker;
+};
+
+static size_t ring_size_for(size_t needed) {
+    size_t size = 4096;
+    while (size < needed) {
+        size *= 2;
+    }
+    return size;
+}
+
+static int ring_init(spsc_ring_t *ring, size_t size) {
+    ring->data = malloc(size);
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+    return ring->data ? 0 : -1;
+}
+
+// 読み手から見た、積まれているバイト数
+static size_t ring_used(const spsc_ring_t *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+}
+
+// 書き手から見た、空いているバイト数
+static size_t ring_space(const spsc_ring_t *ring) {
+    return ring->size - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
+
+// 空きを確かめてから呼ぶ。publishするまで読み手には見えない
+static void ring_put(spsc_ring_t *ring, size_t at, const void *data, size_t len) {
+    size_t offset = at & (ring->size - 1);
+    size_t first = (len < ring->size - offset) ? len : ring->size - offset;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, (const unsigned char *)data + first, len - first);
+}
+
+static void ring_get(const spsc_ring_t *ring, size_t at, void *data, size_t len) {
+    size_t offset = at & (ring->size - 1);
+    size_t first = (len < ring->size - offset) ? len : ring->size - offset;
+    memcpy(data, ring->data + offset, first);
+    memcpy((unsigned char *)data + first, ring->data, len - first);
+}
+
+static void ring_publish(spsc_ring_t *ring, size_t head) {
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+static void ring_release(spsc_ring_t *ring, size_t tail) {
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+// 積んだか取り出した後に呼ぶ。相手が眠ろうとしていれば起こす
+static void wake(int *waiting, int fd) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) {
+        ssize_t n;
+        while ((n = write(fd, "", 1)) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+static int stopping(pipeline_t *p) {
+    return __atomic_load_n(&p->stop, __ATOMIC_ACQUIRE);
+}
+
+// ワーカー: 入力が届くか、出力に空きができるまで眠る
+static void worker_sleep(pipeline_t *p, size_t in_needed, size_t out_needed) {
+    __atomic_store_n(&p->worker_waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ((in_needed && ring_used(&p->in) >= in_needed) || (out_needed && ring_space(&p->out) >= out_needed) ||
+        stopping(p)) {
+        __atomic_store_n(&p->worker_waiting, 0, __ATOMIC_SEQ_CST);
+        return;
+    }
+    char buf[64];
+    while (read(p->wake_worker[0], buf, sizeof(buf)) < 0 && errno == EINTR) {
+    }
+}
+
+// 変換した結果を出力のリングに積む。空きがなければ中継が取り出すのを待つ
+static void worker_emit(pipeline_t *p, bytebuf_t *result) {
+    while (bytebuf_len(result) > 0 && !stopping(p)) {
+        size_t space = ring_space(&p->out);
+        if (space == 0) {
+            worker_sleep(p, 0, 1);
+            continue;
+        }
+        size_t len = (bytebuf_len(result) < space) ? bytebuf_len(result) : space;
+        ring_put(&p->out, p->out.head, result->data + result->start, len);
+        ring_publish(&p->out, p->out.head + len);
+        bytebuf_consume(result, len);
+        wake(&p->relay_waiting, p->wake_relay[1]);
+    }
+}
+
+static void *pipeline_worker(void *arg) {
+    pipeline_t *p = arg;
+    bytebuf_t input = {0};
+    bytebuf_t result = {0};
+
+    while (!stopping(p)) {
+        if (ring_used(&p->in) < PIPELINE_RECORD_HEADER_SIZE) {
+            worker_sleep(p, PIPELINE_RECORD_HEADER_SIZE, 0);
+            continue;
+        }
+        unsigned char header[PIPELINE_RECORD_HEADER_SIZE];
+        ring_get(&p->in, p->in.tail, header, sizeof(header));
+        size_t len = (size_t)header[0] | ((size_t)header[1] << 8) | ((size_t)header[2] << 16) |
+                     ((size_t)header[3] << 24);
+        ring_get(&p->in, p->in.tail + sizeof(header), bytebuf_reserve(&input, len), len);
+        input.end += len;
+        ring_release(&p->in, p->in.tail + sizeof(header) + len);
+        wake(&p->relay_waiting, p->wake_relay[1]); // 入力に空きができた
+
+        if (p->encoding) {
+            codec_stream_encode(p->codec, input.data + input.start, len, &result);
+        } else {
+            codec_stream_decode_data(p->codec, input.data + input.start, len, &result);
+        }
+        bytebuf_consume(&input, len);
+        __atomic_store_n(&p->codec_memory, codec_stream_memory(p->codec), __ATOMIC_RELAXED);
+        worker_emit(p, &result);
+        __atomic_add_fetch(&p->done, 1, __ATOMIC_RELEASE);
+        wake(&p->relay_waiting, p->wake_relay[1]);
+    }
+    bytebuf_free(&input);
+    bytebuf_free(&result);
+    return NULL;
+}
+
+static void close_pipe(int *fds) {
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
+
+// 動いているワーカーの数。作るのも止めるのも中継のスレッドだけ
+static long worker_count;
+
+// もう1つワーカーを作ってよいか。recvでは接続ごとにスレッドが増えるので、CPUの数までにする。
+// 超えた分の接続は中継のスレッドで変換する
+int pipeline_available(void) {
+    static long limit;
+
+    if (limit == 0) {
+        limit = sysconf(_SC_NPROCESSORS_ONLN);
+        if (limit < 2) {
+            limit = 2;
+        }
+    }
+    return worker_count < limit;
+}
+
+// codecはpipeline_freeまでワーカーが使う。max_chunkはpushする単位の最大の大きさ
+pipeline_t *pipeline_new(codec_stream_t *codec, int encoding, size_t max_chunk) {
+    pipeline_t *p = calloc(1, sizeof(*p));
+    if (!p) {
+        perror("calloc");
+        return NULL;
+    }
+    p->codec = codec;
+    p->encoding = encoding;
+    // 実装の選択は最初に使ったときに行うので、ワーカーどうしで競わないよう先に済ませておく
+    codec_simd_level();
+    crc32c(NULL, 0);
+    p->codec_memory = codec_stream_memory(codec);
+    p->wake_worker[0] = p->wake_worker[1] = p->wake_relay[0] = p->wake_relay[1] = -1;
+    // 中継が読み込む間に、ワーカーがもう1つ変換できるようにする
+    if (ring_init(&p->in, ring_size_for(2 * (max_chunk + PIPELINE_RECORD_HEADER_SIZE))) < 0 ||
+        ring_init(&p->out, PIPELINE_OUT_RING_SIZE) < 0) {
+        perror("malloc");
+        free(p->in.data);
+        free(p->out.data);
+        free(p);
+        return NULL;
+    }
+    if (pipe(p->wake_worker) < 0 || pipe(p->wake_relay) < 0) {
+        perror("pipe");
+        close_pipe(p->wake_worker);
+        free(p->in.data);
+        free(p->out.data);
+        free(p);
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(p->wake_worker[i], F_SETFD, FD_CLOEXEC);
+        fcntl(p->wake_relay[i], F_SETFD, FD_CLOEXEC);
+    }
+    // 書き込みは詰まっても捨ててよい (起こす必要があることは伝わっている)
+    fcntl(p->wake_worker[1], F_SETFL, O_NONBLOCK);
+    fcntl(p->wake_relay[0], F_SETFL, O_NONBLOCK);
+    fcntl(p->wake_relay[1], F_SETFL, O_NONBLOCK);
+    if (pthread_create(&p->worker, NULL, pipeline_worker, p) != 0) {
+        perror("pthread_create");
+        close_pipe(p->wake_worker);
+        close_pipe(p->wake_relay);
+        free(p->in.data);
+        free(p->out.data);
+        free(p);
+        return NULL;
+    }
+    worker_count++;
+    return p;
+}
+
+void pipeline_free(pipeline_t *p) {
+    if (!p) return;
+
+    __atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&p->worker_waiting, 1, __ATOMIC_SEQ_CST);
+    wake(&p->worker_waiting, p->wake_worker[1]);
+    pthread_join(p->worker, NULL);
+    worker_count--;
+    close_pipe(p->wake_worker);
+    close_pipe(p->wake_relay);
+    free(p->in.data);
+    free(p->out.data);
+    free(p);
+}
+
+// 出力が積まれたか入力に空きができると読めるようになる。中身は読み捨てる
+int pipeline_fd(const pipeline_t *p) {
+    return p->wake_relay[0];
+}
+
+// 一度にpushできる大きさ
+size_t pipeline_space(const pipeline_t *p) {
+    size_t space = ring_space(&p->in);
+    return (space > PIPELINE_RECORD_HEADER_SIZE) ? space - PIPELINE_RECORD_HEADER_SIZE : 0;
+}
+
+// flushした単位を積む。lenはpipeline_spaceを超えない
+void pipeline_push(pipeline_t *p, const unsigned char *data, size_t len) {
+    unsigned char header[PIPELINE_RECORD_HEADER_SIZE] = {
+        (unsigned char)len, (unsigned char)(len >> 8), (unsigned char)(len >> 16), (unsigned char)(len >> 24)
+    };
+    ring_put(&p->in, p->in.head, header, sizeof(header));
+    ring_put(&p->in, p->in.head + sizeof(header), data, len);
+    p->pushed++;
+    ring_publish(&p->in, p->in.head + sizeof(header) + len);
+    wake(&p->worker_waiting, p->wake_worker[1]);
+}
+
+// 変換済みのデータをlimitまでoutに移し、移した大きさを返す
+size_t pipeline_pull(pipeline_t *p, bytebuf_t *out, size_t limit) {
+    size_t len = ring_used(&p->out);
+
+    if (len > limit) {
+        len = limit;
+    }
+    if (len > 0) {
+        ring_get(&p->out, p->out.tail, bytebuf_reserve(out, len), len);
+        out->end += len;
+        ring_release(&p->out, p->out.tail + len);
+        wake(&p->worker_waiting, p->wake_worker[1]);
+    }
+    return len;
+}
+
+// これから待つ。以後に出力が積まれるか入力に空きができたら、pipeline_fdが読めるようになる
+void pipeline_arm(pipeline_t *p) {
+    char buf[64];
+    while (read(p->wake_relay[0], buf, sizeof(buf)) > 0) {
+    }
+    __atomic_store_n(&p->relay_waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// 積んだものをすべて変換し、出力も取り出し終えた
+int pipeline_idle(const pipeline_t *p) {
+    return __atomic_load_n(&p->done, __ATOMIC_ACQUIRE) == p->pushed && ring_used(&p->out) == 0;
+}
+
+// ワーカーが使うcodecのバッファを含む
+size_t pipeline_memory(const pipeline_t *p) {
+    return sizeof(*p) + p->in.size + p->out.size + __atomic_load_n(&p->codec_memory, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,235 @@
+#include "trans.h"
+#include <stdint.h>
+
+// --probe: 通信を始める前に、両端が全バイト値を通信路に流し、化けたり消えたりしたバイトを
+// 相手に教える。相手はそのバイトだけをエスケープする (0x5cは常にエスケープする)。
+//
+//   検査:  "@trans-probe" に続けて、0x00から0xffまでそれぞれ "@" 16進2桁 そのバイト、最後に "@end"
+//   結果:  "@trans-escape " 256ビットのビットマップを16進64桁 "@end"
+//
+// どちらも先に検査を送り、相手の検査を読んだら結果を返す。同じ向きでは検査が結果より先に届く
+
+#define PROBE_START "@trans-probe"
+#define PROBE_RESULT "@trans-escape "
+#define PROBE_END "@end"
+#define PROBE_BITMAP_DIGITS 64
+#define PROBE_MAX_MESSAGE 8192      // 終わりが見つからないまま、これ以上は溜めない
+
+typedef enum {
+    PROBE_WAIT_PROBE,
+    PROBE_WAIT_RESULT,
+    PROBE_DONE
+} probe_state_t;
+
+struct probe {
+    probe_state_t state;
+    unsigned char peer_bad[256];    // 相手に届かないバイト (相手の結果)
+};
+
+// 化けにくい既定の対象。相手の結果が読めなかったときに使う
+static const unsigned char default_bad[256] = {
+    [0x0a] = 1, [0x0d] = 1, [0x1c] = 1, [0x7f] = 1
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(unsigned char c) {
+    const char *p = (c != '\0') ? strchr(hex_digits, c) : NULL;
+    return p ? (int)(p - hex_digits) : -1;
+}
+
+probe_t *probe_new(void) {
+    probe_t *probe = calloc(1, sizeof(*probe));
+    if (!probe) {
+        perror("calloc");
+    }
+    return probe;
+}
+
+void probe_free(probe_t *probe) {
+    free(probe);
+}
+
+void probe_start(probe_t *probe, bytebuf_t *wire) {
+    (void)probe;
+    bytebuf_append(wire, PROBE_START, strlen(PROBE_START));
+    for (int c = 0; c < 256; c++) {
+        unsigned char entry[4] = { '@', hex_digits[c >> 4], hex_digits[c & 0x0f], (unsigned char)c };
+        bytebuf_append(wire, entry, sizeof(entry));
+    }
+    bytebuf_append(wire, PROBE_END, strlen(PROBE_END));
+}
+
+// 検査の中身 (開始と終わりの印の間) から、無事に届かなかったバイトを求める。
+// 各バイトは、自分の印から次の印までがちょうどそのバイト1つなら届いている
+static void parse_probe(const unsigned char *p, size_t len, unsigned char *bad) {
+    size_t at[257];
+    size_t pos = 0;
+
+    for (int c = 0; c < 256; c++) {
+        char token[3] = { '@', hex_digits[c >> 4], hex_digits[c & 0x0f] };
+        const unsigned char *found = memmem(p + pos, len - pos, token, sizeof(token));
+        if (found) {
+            at[c] = (size_t)(found - p);
+            pos = at[c] + sizeof(token);
+        } else {
+            at[c] = SIZE_MAX;
+        }
+    }
+    at[256] = len;
+
+    for (int c = 0; c < 256; c++) {
+        bad[c] = !(at[c] != SIZE_MAX && at[c + 1] != SIZE_MAX && at[c + 1] == at[c] + 4 && p[at[c] + 3] == c);
+    }
+}
+
+static void send_result(bytebuf_t *wire, const unsigned char *bad) {
+    char digits[PROBE_BITMAP_DIGITS];
+
+    for (int i = 0; i < PROBE_BITMAP_DIGITS; i++) {
+        int nibble = 0;
+        for (int b = 0; b < 4; b++) {
+            nibble |= bad[i * 4 + b] << b;
+        }
+        digits[i] = hex_digits[nibble];
+    }
+    bytebuf_append(wire, PROBE_RESULT, strlen(PROBE_RESULT));
+    bytebuf_append(wire, digits, sizeof(digits));
+    bytebuf_append(wire, PROBE_END, strlen(PROBE_END));
+}
+
+static void parse_result(probe_t *probe, const unsigned char *p) {
+    for (int i = 0; i < PROBE_BITMAP_DIGITS; i++) {
+        int nibble = hex_value(p[i]);
+        if (nibble < 0) {
+            memcpy(probe->peer_bad, default_bad, sizeof(default_bad));
+            return;
+        }
+        for (int b = 0; b < 4; b++) {
+            probe->peer_bad[i * 4 + b] = (nibble >> b) & 1;
+        }
+    }
+}
+
+// inputの先頭からmarkerを探す。見つからなければ、印の途中かもしれない末尾だけを残して捨てる
+static const unsigned char *find_marker(bytebuf_t *input, const char *marker) {
+    size_t len = bytebuf_len(input);
+    size_t marker_len = strlen(marker);
+    const unsigned char *found = memmem(input->data + input->start, len, marker, marker_len);
+
+    if (!found) {
+        if (len >= marker_len) {
+            bytebuf_consume(input, len - (marker_len - 1));
+        }
+        return NULL;
+    }
+    bytebuf_consume(input, (size_t)(found - (input->data + input->start)));
+    return input->data + input->start;
+}
+
+// ttyから読んだデータを渡す。使った分をinputから取り除き、返す結果をwireに書く。
+// 相手の結果まで受け取ったら1を返す。inputにはその後に届いたデータが残る
+int probe_receive(probe_t *probe, bytebuf_t *input, bytebuf_t *wire) {
+    if (probe->state == PROBE_WAIT_PROBE) {
+        const unsigned char *start = find_marker(input, PROBE_START);
+        if (!start) {
+            return 0;
+        }
+        size_t len = bytebuf_len(input) - strlen(PROBE_START);
+        const unsigned char *body = start + strlen(PROBE_START);
+        const unsigned char *end = memmem(body, len, PROBE_END, strlen(PROBE_END));
+        if (!end) {
+            if (len > PROBE_MAX_MESSAGE) {
+                bytebuf_consume(input, strlen(PROBE_START)); // 壊れている。次の検査を待つ
+            }
+            return 0;
+        }
+
+        unsigned char bad[256];
+        parse_probe(body, (size_t)(end - body), bad);
+        send_result(wire, bad);
+        bytebuf_consume(input, (size_t)(end - start) + strlen(PROBE_END));
+        probe->state = PROBE_WAIT_RESULT;
+    }
+
+    if (probe->state == PROBE_WAIT_RESULT) {
+        const unsigned char *start = find_marker(input, PROBE_RESULT);
+        size_t message_len = strlen(PROBE_RESULT) + PROBE_BITMAP_DIGITS + strlen(PROBE_END);
+        if (!start || bytebuf_len(input) < message_len) {
+            return 0;
+        }
+        if (memcmp(start + message_len - strlen(PROBE_END), PROBE_END, strlen(PROBE_END)) != 0) {
+            memcpy(probe->peer_bad, default_bad, sizeof(default_bad));
+        } else {
+            parse_result(probe, start + strlen(PROBE_RESULT));
+        }
+        bytebuf_consume(input, message_len);
+        probe->state = PROBE_DONE;
+    }
+    return probe->state == PROBE_DONE;
+}
+
+// 相手の結果からエスケープ対象を作り、その数を返す
+int probe_escape_set(const probe_t *probe, escape_set_t *set) {
+    int count = 0;
+
+    escape_set_init(set, probe->peer_bad);
+    for (int c = 0; c < 256; c++) {
+        count += set->needed[c];
+    }
+    return count;
+}
+
+// 1本のttyを検査し終えるまで待つ (--mux用)。検査の後に届いたデータはleftoverに残す
+int probe_channel(int input_fd, int output_fd, escape_set_t *set, bytebuf_t *leftover) {
+    probe_t *probe = probe_new();
+    bytebuf_t wire = {0};
+    long long deadline = monotonic_us() + PROBE_TIMEOUT_US;
+    int done = 0;
+
+    if (!probe) {
+        return -1;
+    }
+    probe_start(probe, &wire);
+    if (bytebuf_len(leftover) > 0) {
+        done = probe_receive(probe, leftover, &wire); // --syncの印と一緒に届いていた
+    }
+    while (!done || bytebuf_len(&wire) > 0) {
+        struct pollfd pfds[2] = {
+            { done ? -1 : input_fd, POLLIN, 0 },
+            { bytebuf_len(&wire) > 0 ? output_fd : -1, POLLOUT, 0 }
+        };
+        long long now = monotonic_us();
+        if (now >= deadline || (poll(pfds, 2, (int)((deadline - now + 999) / 1000)) < 0 && errno != EINTR)) {
+            fprintf(stderr, "Channel probe timed out\n");
+            break;
+        }
+        if (pfds[1].revents) {
+            ssize_t n = write(output_fd, wire.data + wire.start, bytebuf_len(&wire));
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("write");
+                break;
+            }
+            if (n > 0) {
+                bytebuf_consume(&wire, (size_t)n);
+            }
+        }
+        if (pfds[0].revents) {
+            unsigned char *p = bytebuf_reserve(leftover, 4096);
+            ssize_t n = read(input_fd, p, 4096);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                fprintf(stderr, "Channel closed during probe\n");
+                break;
+            }
+            if (n > 0) {
+                leftover->end += (size_t)n;
+                done = probe_receive(probe, leftover, &wire);
+            }
+        }
+    }
+
+    int count = (done && bytebuf_len(&wire) == 0) ? probe_escape_set(probe, set) : -1;
+    bytebuf_free(&wire);
+    probe_free(probe);
+    return count;
+}
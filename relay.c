@@ -0,0 +1,818 @@
+#include "trans.h"
+
+// 書き込み待ちがこれを超えたら、その元になる読み込みを止める
+#define RELAY_HIGH_WATER (1024 * 1024)
+
+// 書き終えるのを待っているflushの単位をこれだけ覚えておく。溢れたら最後のものにまとめる
+#define RELAY_CHUNK_MARKS 32
+
+// --resume: コマンドがすぐに終わり続けるときは、起動し直す間隔をこれまで延ばす
+#define RESPAWN_MIN_US 1000000
+#define RESPAWN_MAX_US 30000000
+
+typedef enum {
+    RESUME_NONE,
+    RESUME_SPAWNER,             // -s側: ttyが切れたらコマンドを起動し直す
+    RESUME_HOLDER               // 標準入出力側: ttyが切れたら次のプロセスから受け取る
+} resume_role_t;
+
+// 変換し終えたflushの単位。書いたバイト数がendに達したら書き終えている
+typedef struct {
+    unsigned long long end;
+    long long converted_at;
+} chunk_mark_t;
+
+// 一方向の中継: from_fdから読み、エンコードまたはデコードしてto_fdに書く
+typedef struct {
+    int encoding;
+    const flush_policy_t *policy;
+    const char *eof_message;
+    codec_stream_t codec;
+    bytebuf_t pending;          // flush待ちの入力
+    bytebuf_t out;              // to_fdへの書き込み待ち
+    size_t capacity;            // 一度にflushする最大の大きさ
+    int small_flushes;          // 連続してcapacityの1/4未満でflushした回数
+    long long deadline;         // 溜まっているデータをflushすべき時刻
+    long long read_at;          // 溜まっているデータの最初のバイトを読んだ時刻
+    unsigned long long written; // to_fdに書いたバイト数
+    chunk_mark_t marks[RELAY_CHUNK_MARKS];  // 書き終えていない単位 (古い順のリング)
+    size_t mark_head;
+    size_t mark_count;
+    pipeline_t *stage;          // --pipeline: codecはこのスレッドが使う
+    int read_eof;
+    int done;
+} relay_dir_t;
+
+struct relay {
+    const config_t *config;
+    event_loop_t *loop;
+    int sockfd;
+    int input_fd;               // コマンドまたは標準入力から読む
+    int output_fd;              // コマンドまたは標準出力へ書く
+    relay_dir_t encode;         // sockfd -> encode -> output_fd
+    relay_dir_t decode;         // input_fd -> decode -> sockfd
+    link_t *link;               // --framed: encodeで送り、decodeで受け取る
+    int sock_shut;              // --framed: 相手のEOFを受け取ってソケットをhalf-closeした
+    int syncing;                // --sync: 標準入出力側の印が届くまでttyには書かない
+    long long sync_deadline;
+    probe_t *probe;             // --probe: 通信路を調べ終えるまで中継しない
+    long long probe_deadline;
+    escape_set_t escapes;       // --probe: エンコード側が使うエスケープ対象
+
+    // --resume
+    resume_role_t resume;
+    char token[SESSION_TOKEN_SIZE + 1];
+    pid_t cmd_pid;              // -s側: いま動いているコマンド
+    int session_fd;             // 標準入出力側: 次のttyを受け取るunixソケット
+    int session_conn;           // 標準入出力側: ttyを渡してきたプロセスとの接続 (閉じると終わる)
+    int detached;               // ttyがつながっていない
+    long long lost_at;          // ttyが切れた時刻。つながり直してフレームが届いたら0に戻す
+    long long respawn_at;
+    long respawn_delay;
+    unsigned long long attached_frames;  // つながり直したときに受け取っていたフレームの数
+
+    void *owner;                // 受信側の接続 (イベントから引くため)
+};
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags != -1) {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+}
+
+static void log_dir(relay_dir_t *dir, const char *message) {
+    capture_message(dir->codec.capture, message);
+}
+
+// flushした大きさを見てバッファ容量を決め直す。
+// 埋まったら倍に、1/4未満のflushが続いたら半分にする
+static size_t next_capacity(size_t capacity, size_t flushed, size_t limit, int *small_flushes) {
+    if (flushed >= capacity) {
+        *small_flushes = 0;
+        return (capacity * 2 < limit) ? capacity * 2 : limit;
+    }
+    if (flushed < capacity / 4 && ++*small_flushes >= 64) {
+        *small_flushes = 0;
+        return (capacity / 2 > MIN_BUFFER_SIZE) ? capacity / 2 : MIN_BUFFER_SIZE;
+    }
+    if (flushed >= capacity / 4) {
+        *small_flushes = 0;
+    }
+    return capacity;
+}
+
+// ログに書くflushの理由 (EOFは従来どおりread timeoutとして書く)
+static const char *flush_reason_messages[FLUSH_REASON_COUNT] = {
+    [FLUSH_TIMEOUT] = "read timeout\n",
+    [FLUSH_FULL] = "buffer full\n",
+    [FLUSH_SMALL_READ] = "small read\n",
+    [FLUSH_EOF] = "read timeout\n"
+};
+
+static int dir_wants_read(const relay_t *relay, const relay_dir_t *dir) {
+    if (dir == &relay->encode && (relay->syncing || relay->probe)) {
+        return 0; // ttyの準備ができてエスケープ対象が決まるまでソケットから読まない
+    }
+    if (dir == &relay->encode && relay->link && !link_can_send(relay->link)) {
+        return 0; // 再送用に取っておけるだけ送った
+    }
+    if (dir->stage && pipeline_space(dir->stage) < dir->capacity) {
+        return 0; // 変換を待っている分でリングが埋まっている
+    }
+    return !dir->done && !dir->read_eof && bytebuf_len(&dir->out) < RELAY_HIGH_WATER;
+}
+
+// 読み終えて書き終えたら方向を終えてよい。--framedでは、出力を閉じると相手から
+// 再送の要求が届かなくなるので、EOFを送り合ってどちらも確認応答されるまで閉じない
+// (ttyの入力がEOFになったら、もう確認応答は届かない)
+static int dir_may_end(const relay_t *relay, const relay_dir_t *dir) {
+    if (dir->done || !dir->read_eof || bytebuf_len(&dir->out) > 0 || (dir->stage && !pipeline_idle(dir->stage))) {
+        return 0;
+    }
+    if (dir != &relay->encode || !relay->link || relay->decode.done) {
+        return 1;
+    }
+    return link_idle(relay->link) && link_peer_eof(relay->link);
+}
+
+// 方向を終える。エンコード側は出力を閉じ、デコード側はソケットをhalf-closeする
+static void end_dir(relay_t *relay, relay_dir_t *dir) {
+    dir->done = 1;
+    bytebuf_free(&dir->pending);
+    bytebuf_free(&dir->out);
+    dir->mark_count = 0;
+
+    int *fd = (dir == &relay->encode) ? &relay->output_fd : &relay->input_fd;
+    if (*fd >= 0) {
+        event_loop_remove(relay->loop, *fd);
+        close(*fd);
+        *fd = -1;
+    }
+    if (dir == &relay->decode) {
+        shutdown(relay->sockfd, SHUT_WR);
+    } else if (relay->link && !relay->decode.done) {
+        // EOFを送り合った後なので、ttyから読むものはもうない
+        end_dir(relay, &relay->decode);
+    }
+}
+
+// 通信を始められなかった。両方向を終える
+static void end_relay(relay_t *relay) {
+    end_dir(relay, &relay->encode);
+    if (!relay->decode.done) {
+        end_dir(relay, &relay->decode);
+    }
+}
+
+// --resumeでttyが切れたら、接続を保ったままつながり直すのを待つ。
+// EOFを送り合った後なら、相手が先に終えて閉じたので、そのまま終える
+static int may_resume(const relay_t *relay) {
+    return relay->resume != RESUME_NONE && !relay->encode.done &&
+           !(relay->encode.read_eof && link_peer_eof(relay->link));
+}
+
+static void lose_tty(relay_t *relay) {
+    long long now = monotonic_us();
+
+    log_dir(&relay->decode, "tty lost\n");
+    if (relay->input_fd >= 0) {
+        event_loop_remove(relay->loop, relay->input_fd);
+        close(relay->input_fd);
+        relay->input_fd = -1;
+    }
+    if (relay->output_fd >= 0) {
+        event_loop_remove(relay->loop, relay->output_fd);
+        close(relay->output_fd);
+        relay->output_fd = -1;
+    }
+    if (relay->session_conn >= 0) {
+        close(relay->session_conn);
+        relay->session_conn = -1;
+    }
+    // 書きかけのフレームと読みかけのデータは捨てる。確認応答待ちのフレームはlinkが送り直す
+    bytebuf_consume(&relay->encode.out, bytebuf_len(&relay->encode.out));
+    relay->encode.mark_count = 0;
+    bytebuf_consume(&relay->decode.pending, bytebuf_len(&relay->decode.pending));
+    decoder_init(&relay->decode.codec.decoder, relay->config->method);
+    relay->detached = 1;
+    relay->syncing = 0;
+
+    if (relay->lost_at == 0) {
+        relay->lost_at = now;
+        relay->respawn_delay = 0;
+    } else {
+        // つながり直しても何も届かなかった
+        relay->respawn_delay = (relay->respawn_delay == 0) ? RESPAWN_MIN_US
+                             : (relay->respawn_delay * 2 < RESPAWN_MAX_US) ? relay->respawn_delay * 2
+                                                                            : RESPAWN_MAX_US;
+    }
+    if (relay->resume == RESUME_SPAWNER) {
+        if (relay->cmd_pid > 0) {
+            kill(relay->cmd_pid, SIGTERM);
+            relay->cmd_pid = -1;
+        }
+        relay->respawn_at = now + relay->respawn_delay;
+    }
+    if (!relay->config->quiet) {
+        fprintf(stderr, "tty lost, waiting to resume.\n");
+    }
+}
+
+static void attach_tty(relay_t *relay, int input_fd, int output_fd) {
+    relay->input_fd = input_fd;
+    relay->output_fd = output_fd;
+    relay->detached = 0;
+    set_nonblocking(input_fd);
+    set_nonblocking(output_fd);
+
+    if (relay->resume == RESUME_SPAWNER && relay->config->sync) {
+        // 起動し直したコマンドも、印が届くまでは下の再送を書かずに溜めておく
+        relay->syncing = 1;
+        relay->sync_deadline = monotonic_us() + SYNC_TIMEOUT_US;
+    }
+    if (relay->resume == RESUME_SPAWNER) {
+        char hello[64];
+        int len = session_hello(hello, sizeof(hello), relay->token, 1);
+        bytebuf_append(&relay->encode.out, hello, (size_t)len);
+    }
+    // 相手が受け取っていないフレームをすべて送り直す。重複したものは相手が捨てる
+    link_rewind(relay->link);
+    link_service(relay->link, &relay->encode.out, monotonic_us());
+    relay->attached_frames = link_frames_received(relay->link);
+    log_dir(&relay->decode, "tty resumed\n");
+}
+
+// 変換し終えた単位を覚える。いまの書き込み待ちの末尾がその単位の終わり
+static void mark_converted(relay_dir_t *dir, long long now) {
+    unsigned long long end = dir->written + bytebuf_len(&dir->out);
+
+    if (dir->mark_count == RELAY_CHUNK_MARKS) {
+        // 覚えきれない。最後の単位の時刻から数える (長めに出る)
+        dir->marks[(dir->mark_head + dir->mark_count - 1) % RELAY_CHUNK_MARKS].end = end;
+        return;
+    }
+    chunk_mark_t *mark = &dir->marks[(dir->mark_head + dir->mark_count) % RELAY_CHUNK_MARKS];
+    mark->end = end;
+    mark->converted_at = now;
+    dir->mark_count++;
+}
+
+// 書き終えた単位の、変換してからの待ち時間を記録する
+static void complete_marks(relay_dir_t *dir) {
+    long long now = 0;
+
+    while (dir->mark_count > 0 && dir->marks[dir->mark_head].end <= dir->written) {
+        if (now == 0) {
+            now = monotonic_us();
+        }
+        latency_record(dir->encoding, LATENCY_WRITE, now - dir->marks[dir->mark_head].converted_at);
+        dir->mark_head = (dir->mark_head + 1) % RELAY_CHUNK_MARKS;
+        dir->mark_count--;
+    }
+}
+
+static void write_dir(relay_t *relay, relay_dir_t *dir) {
+    int fd = dir->encoding ? relay->output_fd : relay->sockfd;
+
+    if (dir->encoding && (relay->detached || relay->syncing)) {
+        return;
+    }
+    while (!dir->done && bytebuf_len(&dir->out) > 0) {
+        ssize_t written = write(fd, dir->out.data + dir->out.start, bytebuf_len(&dir->out));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && errno == EAGAIN) {
+            stats_write_stalled(&dir->codec.stats);
+            return;
+        }
+        if (written <= 0) {
+            char mes[BUFSIZ];
+            sprintf(mes, "write failed: %s (%d)\n", strerror(errno), errno);
+            log_dir(dir, mes);
+            if (dir->encoding && may_resume(relay)) {
+                lose_tty(relay);
+                return;
+            }
+            end_dir(relay, dir);
+            return;
+        }
+        stats_write_progress(&dir->codec.stats);
+        bytebuf_consume(&dir->out, (size_t)written);
+        dir->written += (size_t)written;
+        complete_marks(dir);
+    }
+    if (bytebuf_len(&dir->out) == 0 && dir->out.cap > RELAY_HIGH_WATER) {
+        // 一時的に大きくなったバッファは、空になったら手放す
+        bytebuf_free(&dir->out);
+    }
+    if (dir == &relay->decode && relay->link && link_peer_eof(relay->link) && !relay->sock_shut &&
+        !dir->done && bytebuf_len(&dir->out) == 0) {
+        // 相手のソケットのEOFまで書き終えた。ttyは確認応答のために読み続ける
+        log_dir(dir, "from peer: EOF detected");
+        shutdown(relay->sockfd, SHUT_WR);
+        relay->sock_shut = 1;
+    }
+    if (dir_may_end(relay, dir)) {
+        end_dir(relay, dir);
+    }
+}
+
+static void flush_dir(relay_t *relay, relay_dir_t *dir, flush_reason_t reason) {
+    size_t flushed = bytebuf_len(&dir->pending);
+
+    if (flushed > 0) {
+        latency_record(dir->encoding, LATENCY_QUEUE, monotonic_us() - dir->read_at);
+    }
+    log_dir(dir, flush_reason_messages[reason]);
+    stats_add(&dir->codec.stats.flushes[reason], 1);
+    if (dir->stage) {
+        // 変換はワーカーが行い、結果はrelay_serviceで取り出す
+        pipeline_push(dir->stage, dir->pending.data + dir->pending.start, flushed);
+    } else if (dir->encoding) {
+        codec_stream_encode(&dir->codec, dir->pending.data + dir->pending.start, flushed, &dir->out);
+    } else {
+        // 途中で切れたエスケープや行はデコーダが持ち越す
+        codec_stream_decode_data(&dir->codec, dir->pending.data + dir->pending.start, flushed, &dir->out);
+    }
+    if (!dir->stage) {
+        mark_converted(dir, monotonic_us());
+    }
+    bytebuf_consume(&dir->pending, flushed);
+    dir->capacity = next_capacity(dir->capacity, flushed, relay->config->buffer_size, &dir->small_flushes);
+    if (dir->pending.cap > dir->capacity * 2) {
+        // 容量を縮めたら、入力バッファも次のreadで確保し直す
+        bytebuf_free(&dir->pending);
+    }
+
+    write_dir(relay, dir);
+}
+
+static void receive_probe(relay_t *relay);
+
+// 印が届いた。溜めておいた出力を書き始める
+static void peer_ready(relay_t *relay) {
+    relay_dir_t *dir = &relay->decode;
+
+    relay->syncing = 0;
+    log_dir(dir, "peer ready\n");
+    if (relay->probe) {
+        relay->probe_deadline = monotonic_us() + PROBE_TIMEOUT_US;
+    }
+    write_dir(relay, &relay->encode);
+    if (relay->probe) {
+        receive_probe(relay);
+        return;
+    }
+    // 印の後に届いていたデータはすぐにデコードする
+    dir->read_at = dir->deadline = monotonic_us();
+}
+
+// 印より前に届いたttyの出力を捨てる
+static void receive_sync(relay_t *relay) {
+    if (sync_receive(&relay->decode.pending)) {
+        peer_ready(relay);
+    }
+}
+
+// ttyから読んだデータを検査に渡す。相手の結果が揃ったらエスケープ対象を決めて中継を始める
+static void receive_probe(relay_t *relay) {
+    relay_dir_t *dir = &relay->decode;
+    int done = probe_receive(relay->probe, &dir->pending, &relay->encode.out);
+
+    write_dir(relay, &relay->encode);
+    if (!done) {
+        return;
+    }
+    int count = probe_escape_set(relay->probe, &relay->escapes);
+    probe_free(relay->probe);
+    relay->probe = NULL;
+    relay->encode.codec.escapes = &relay->escapes;
+    if (relay->link) {
+        link_set_escapes(relay->link, &relay->escapes);
+    }
+    log_dir(dir, "channel probed\n");
+    if (!relay->config->quiet) {
+        fprintf(stderr, "Channel probed: escaping %d byte values\n", count);
+    }
+    // 結果の後に届いていたデータはすぐにデコードする
+    dir->read_at = dir->deadline = monotonic_us();
+}
+
+static void read_dir(relay_t *relay, relay_dir_t *dir) {
+    int fd = dir->encoding ? relay->sockfd : relay->input_fd;
+    size_t len = bytebuf_len(&dir->pending);
+
+    if (len >= dir->capacity) {
+        flush_dir(relay, dir, FLUSH_FULL);
+        return;
+    }
+
+    unsigned char *p = bytebuf_reserve(&dir->pending, dir->capacity - len);
+    ssize_t bytes_read = read(fd, p, dir->capacity - len);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (bytes_read <= 0) {
+        if (!dir->encoding && relay->probe) {
+            log_dir(dir, "from input: EOF during probe\n");
+            end_relay(relay);
+            return;
+        }
+        if (!dir->encoding && may_resume(relay)) {
+            lose_tty(relay);
+            return;
+        }
+        if (!dir->encoding && relay->syncing) {
+            log_dir(dir, "from input: EOF before ready\n");
+            end_relay(relay);
+            return;
+        }
+        dir->read_eof = 1;
+        if (len > 0) {
+            flush_dir(relay, dir, FLUSH_EOF);
+        }
+        if (dir == &relay->encode && relay->link && !dir->done) {
+            link_send_eof(relay->link, &dir->out);
+        }
+        log_dir(dir, dir->eof_message);
+        write_dir(relay, dir);
+        return;
+    }
+
+    int was_empty = (len == 0);
+    dir->pending.end += (size_t)bytes_read;
+    if (!dir->encoding && relay->syncing) {
+        receive_sync(relay);
+        return;
+    }
+    if (!dir->encoding && relay->probe) {
+        receive_probe(relay);
+        return;
+    }
+    if (was_empty) {
+        dir->read_at = monotonic_us();
+        dir->deadline = dir->read_at + dir->policy->latency_us;
+    }
+
+    if (bytebuf_len(&dir->pending) >= dir->capacity) {
+        flush_dir(relay, dir, FLUSH_FULL);
+    } else if (was_empty && (size_t)bytes_read <= dir->policy->small_read) {
+        // キー入力のような単発の小さなreadは待たずに送る
+        flush_dir(relay, dir, FLUSH_SMALL_READ);
+    }
+}
+
+static int init_dir(relay_t *relay, relay_dir_t *dir, int encoding) {
+    const config_t *config = relay->config;
+    const char *log_path = encoding ? config->log_port_stdio_file : config->log_stdio_port_file;
+    capture_t *capture = log_path ? capture_open(log_path, config) : NULL;
+
+    dir->encoding = encoding;
+    dir->policy = encoding ? &config->flush_ps : &config->flush_sp;
+    dir->eof_message = encoding ? "from socket: EOF detected" : "from input: EOF detected";
+    dir->capacity = (config->buffer_size < INITIAL_BUFFER_SIZE) ? config->buffer_size : INITIAL_BUFFER_SIZE;
+    // 書き込みが詰まっている間も、書き残しを詰め直さずに変換結果を後ろに積む
+    bytebuf_map(&dir->out);
+    if (codec_stream_init(&dir->codec, config, encoding, capture) < 0) {
+        codec_stream_close(&dir->codec);
+        return -1;
+    }
+    dir->codec.stats.conn_id = relay->sockfd;
+    if (config->pipeline && pipeline_available()) {
+        dir->stage = pipeline_new(&dir->codec, encoding, config->buffer_size);
+        if (!dir->stage) {
+            codec_stream_close(&dir->codec);
+            return -1;
+        }
+        event_loop_set(relay->loop, pipeline_fd(dir->stage), EVENT_READ, relay);
+    }
+    return 0;
+}
+
+static void close_dir(relay_t *relay, relay_dir_t *dir) {
+    if (dir->stage) {
+        event_loop_remove(relay->loop, pipeline_fd(dir->stage));
+        pipeline_free(dir->stage); // ワーカーが止まってからcodecを閉じる
+    }
+    codec_stream_close(&dir->codec);
+}
+
+// ワーカーが変換し終えた分を書き込み待ちに移す
+static void pull_dir(relay_t *relay, relay_dir_t *dir) {
+    pipeline_arm(dir->stage);
+    if (dir->done) {
+        return;
+    }
+    size_t out_len = bytebuf_len(&dir->out);
+    if (out_len < RELAY_HIGH_WATER && pipeline_pull(dir->stage, &dir->out, RELAY_HIGH_WATER - out_len) > 0) {
+        // ワーカーの単位は分からないので、取り出した分を1つの単位として数える
+        mark_converted(dir, monotonic_us());
+        write_dir(relay, dir);
+    } else if (dir_may_end(relay, dir)) {
+        end_dir(relay, dir);
+    }
+}
+
+relay_t *relay_new(const config_t *config, event_loop_t *loop, int sockfd, int input_fd, int output_fd) {
+    relay_t *relay = calloc(1, sizeof(*relay));
+    if (!relay) {
+        perror("calloc");
+        return NULL;
+    }
+    relay->config = config;
+    relay->loop = loop;
+    relay->sockfd = sockfd;
+    relay->input_fd = input_fd;
+    relay->output_fd = output_fd;
+    relay->cmd_pid = -1;
+    relay->session_fd = -1;
+    relay->session_conn = -1;
+
+    if (init_dir(relay, &relay->encode, 1) < 0) {
+        fprintf(stderr, "Failed to initialize compression\n");
+        free(relay);
+        return NULL;
+    }
+    if (init_dir(relay, &relay->decode, 0) < 0) {
+        fprintf(stderr, "Failed to initialize compression\n");
+        close_dir(relay, &relay->encode);
+        free(relay);
+        return NULL;
+    }
+    if (config->framed) {
+        relay->link = link_new(config, &relay->encode.codec.stats, &relay->decode.codec.stats);
+        if (!relay->link) {
+            close_dir(relay, &relay->encode);
+            close_dir(relay, &relay->decode);
+            free(relay);
+            return NULL;
+        }
+        relay->encode.codec.link = relay->link;
+        relay->decode.codec.link = relay->link;
+    }
+
+    if (config->sync && config->system_command) {
+        relay->syncing = 1;
+        relay->sync_deadline = monotonic_us() + SYNC_TIMEOUT_US;
+    }
+    if (config->probe) {
+        relay->probe = probe_new();
+        if (!relay->probe) {
+            relay_free(relay);
+            return NULL;
+        }
+        probe_start(relay->probe, &relay->encode.out);
+        relay->probe_deadline = monotonic_us() + PROBE_TIMEOUT_US;
+    }
+
+    set_nonblocking(sockfd);
+    set_nonblocking(input_fd);
+    set_nonblocking(output_fd);
+    relay_service(relay);
+    return relay;
+}
+
+void relay_free(relay_t *relay) {
+    if (!relay) return;
+
+    event_loop_remove(relay->loop, relay->sockfd);
+    if (relay->input_fd >= 0) {
+        event_loop_remove(relay->loop, relay->input_fd);
+        close(relay->input_fd);
+    }
+    if (relay->output_fd >= 0) {
+        event_loop_remove(relay->loop, relay->output_fd);
+        close(relay->output_fd);
+    }
+    if (relay->session_fd >= 0) {
+        event_loop_remove(relay->loop, relay->session_fd);
+        close(relay->session_fd);
+        session_remove(relay->token);
+    }
+    if (relay->session_conn >= 0) {
+        close(relay->session_conn);
+    }
+    bytebuf_free(&relay->encode.pending);
+    bytebuf_free(&relay->encode.out);
+    bytebuf_free(&relay->decode.pending);
+    bytebuf_free(&relay->decode.out);
+    close_dir(relay, &relay->encode);
+    close_dir(relay, &relay->decode);
+    link_free(relay->link);
+    probe_free(relay->probe);
+    free(relay);
+}
+
+// 中継が確保しているバッファの合計 (zlibの内部状態は含まない)
+size_t relay_memory(const relay_t *relay) {
+    const relay_dir_t *dirs[2] = { &relay->encode, &relay->decode };
+    size_t total = sizeof(*relay);
+
+    for (int i = 0; i < 2; i++) {
+        total += dirs[i]->pending.cap + dirs[i]->out.cap;
+        // --pipelineではcodecをワーカーが使っているので、ワーカーが知らせた大きさを使う
+        if (dirs[i]->stage) {
+            total += pipeline_memory(dirs[i]->stage);
+        } else {
+            total += codec_stream_memory(&dirs[i]->codec);
+        }
+    }
+    if (relay->link) {
+        total += link_memory(relay->link);
+    }
+    return total;
+}
+
+int relay_finished(const relay_t *relay) {
+    return relay->encode.done && relay->decode.done;
+}
+
+// -s側として、コマンドが終わったら起動し直す。コマンドには最初にtokenを書く
+void relay_resume_spawner(relay_t *relay, pid_t cmd_pid) {
+    char hello[64];
+    bytebuf_t out = {0};
+
+    bytebuf_map(&out);
+    relay->resume = RESUME_SPAWNER;
+    relay->cmd_pid = cmd_pid;
+    session_new_token(relay->token);
+    // --probeの検査より前に書く
+    int len = session_hello(hello, sizeof(hello), relay->token, 0);
+    bytebuf_append(&out, hello, (size_t)len);
+    bytebuf_append(&out, relay->encode.out.data + relay->encode.out.start, bytebuf_len(&relay->encode.out));
+    bytebuf_free(&relay->encode.out);
+    relay->encode.out = out;
+    relay_service(relay);
+}
+
+// 標準入出力側として、ttyが切れたらsession_fdで次のプロセスから受け取る。
+// session_fdは中継が閉じる
+void relay_resume_holder(relay_t *relay, int session_fd, const char *token) {
+    relay->resume = RESUME_HOLDER;
+    relay->session_fd = session_fd;
+    strcpy(relay->token, token);
+}
+
+// --pool: 中継を始める前にttyから読んでおいたデータを渡す。syncedなら印はもう受け取っている
+void relay_preread(relay_t *relay, const bytebuf_t *input, int synced) {
+    if (bytebuf_len(input) > 0) {
+        bytebuf_append(&relay->decode.pending, input->data + input->start, bytebuf_len(input));
+    }
+    if (relay->syncing && synced) {
+        peer_ready(relay);
+    }
+}
+
+void relay_set_owner(relay_t *relay, void *owner) {
+    relay->owner = owner;
+}
+
+void *relay_owner(const relay_t *relay) {
+    return relay->owner;
+}
+
+pid_t relay_command_pid(const relay_t *relay) {
+    return relay->cmd_pid;
+}
+
+// ttyが切れている間: コマンドを起動し直すか、諦める時刻までの時間を返す
+static long resume_service(relay_t *relay, long long now) {
+    if (now - relay->lost_at >= SESSION_TIMEOUT_US) {
+        if (!relay->config->quiet) {
+            fprintf(stderr, "Gave up resuming the session.\n");
+        }
+        log_dir(&relay->decode, "resume timeout\n");
+        end_relay(relay);
+        return -1;
+    }
+    long long next = relay->lost_at + SESSION_TIMEOUT_US;
+
+    if (relay->resume == RESUME_SPAWNER) {
+        if (now >= relay->respawn_at) {
+            int input_fd, output_fd;
+            relay->cmd_pid = spawn_command(relay->config->system_command, &input_fd, &output_fd);
+            if (relay->cmd_pid > 0) {
+                attach_tty(relay, input_fd, output_fd);
+                return 0;
+            }
+            relay->respawn_at = now + RESPAWN_MIN_US;
+        }
+        if (relay->respawn_at < next) {
+            next = relay->respawn_at;
+        }
+    }
+    return (long)(next - now);
+}
+
+long relay_service(relay_t *relay) {
+    relay_dir_t *dirs[2] = { &relay->encode, &relay->decode };
+    long timeout_us = -1;
+    long long now = monotonic_us();
+
+    for (int i = 0; i < 2; i++) {
+        if (dirs[i]->stage) {
+            pull_dir(relay, dirs[i]);
+        }
+    }
+
+    // 期限が来たデータをflushし、次の期限までの時間を求める
+    for (int i = 0; i < 2; i++) {
+        relay_dir_t *dir = dirs[i];
+        if (dir->done || bytebuf_len(&dir->pending) == 0 ||
+            (!dir->encoding && (relay->syncing || relay->probe))) continue;
+        if (now >= dir->deadline) {
+            flush_dir(relay, dir, FLUSH_TIMEOUT);
+        } else if (timeout_us < 0 || dir->deadline - now < timeout_us) {
+            timeout_us = (long)(dir->deadline - now);
+        }
+    }
+
+    if (relay->syncing && now >= relay->sync_deadline) {
+        fprintf(stderr, "Timed out waiting for the peer to be ready\n");
+        log_dir(&relay->decode, "ready timeout\n");
+        if (may_resume(relay)) {
+            lose_tty(relay);
+        } else {
+            end_relay(relay);
+            return -1;
+        }
+    } else if (relay->syncing && (timeout_us < 0 || relay->sync_deadline - now < timeout_us)) {
+        timeout_us = (long)(relay->sync_deadline - now);
+    } else if (relay->probe && now >= relay->probe_deadline) {
+        fprintf(stderr, "Channel probe timed out\n");
+        log_dir(&relay->decode, "probe timeout\n");
+        end_relay(relay);
+        return -1;
+    } else if (relay->probe && (timeout_us < 0 || relay->probe_deadline - now < timeout_us)) {
+        timeout_us = (long)(relay->probe_deadline - now);
+    }
+
+    if (relay->resume != RESUME_NONE && !relay->encode.done) {
+        if (relay->detached) {
+            long resume_timeout = resume_service(relay, now);
+            if (resume_timeout >= 0 && (timeout_us < 0 || resume_timeout < timeout_us)) {
+                timeout_us = resume_timeout;
+            }
+        } else if (relay->lost_at != 0 && link_frames_received(relay->link) != relay->attached_frames) {
+            relay->lost_at = 0; // 相手までつながった
+        }
+        if (relay->session_fd >= 0) {
+            event_loop_set(relay->loop, relay->session_fd, relay->detached ? EVENT_READ : 0, relay);
+        }
+    }
+
+    // 確認応答やNAK、再送を出力に書く。出力を閉じた後やttyが切れている間は捨てる
+    if (relay->link) {
+        long link_timeout = link_service(relay->link,
+                                         (relay->encode.done || relay->detached) ? NULL : &relay->encode.out, now);
+        if (link_timeout >= 0 && (timeout_us < 0 || link_timeout < timeout_us)) {
+            timeout_us = link_timeout;
+        }
+        if (dir_may_end(relay, &relay->encode)) {
+            end_dir(relay, &relay->encode);
+        }
+    }
+
+    // 書き込みが詰まっている方向は読み込みを止める
+    int sock_events = (dir_wants_read(relay, &relay->encode) ? EVENT_READ : 0) |
+                      ((!relay->decode.done && bytebuf_len(&relay->decode.out) > 0) ? EVENT_WRITE : 0);
+    event_loop_set(relay->loop, relay->sockfd, sock_events, relay);
+    if (relay->input_fd >= 0) {
+        event_loop_set(relay->loop, relay->input_fd, dir_wants_read(relay, &relay->decode) ? EVENT_READ : 0, relay);
+    }
+    if (relay->output_fd >= 0) {
+        event_loop_set(relay->loop, relay->output_fd,
+                       (!relay->syncing && bytebuf_len(&relay->encode.out) > 0) ? EVENT_WRITE : 0, relay);
+    }
+    return timeout_us;
+}
+
+void relay_handle_event(relay_t *relay, const event_t *event) {
+    int fd = event->fd;
+
+    if (fd == relay->session_fd) {
+        int input_fd, output_fd;
+        if (relay->detached && session_accept(relay->session_fd, &relay->session_conn, &input_fd, &output_fd) == 0) {
+            attach_tty(relay, input_fd, output_fd);
+        }
+        return;
+    }
+    if (event->events & (EVENT_WRITE | EVENT_ERROR)) {
+        if (fd == relay->output_fd && bytebuf_len(&relay->encode.out) > 0) {
+            write_dir(relay, &relay->encode);
+        }
+        if (fd == relay->sockfd && bytebuf_len(&relay->decode.out) > 0) {
+            write_dir(relay, &relay->decode);
+        }
+    }
+    if (event->events & (EVENT_READ | EVENT_ERROR)) {
+        if (fd == relay->sockfd && dir_wants_read(relay, &relay->encode)) {
+            read_dir(relay, &relay->encode);
+        }
+        if (fd == relay->input_fd && dir_wants_read(relay, &relay->decode)) {
+            read_dir(relay, &relay->decode);
+        }
+    }
+}
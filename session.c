@@ -0,0 +1,247 @@
+#include "trans.h"
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// --resume: ttyが切れても中継を続ける。
+// -s側はコマンドを起動するたびに最初に "trans-resume <token>\n" を書く
+// (起動し直したときは "trans-resume <token> again\n")。
+// 標準入出力側は最初の1行でtokenを受け取り、同じtokenで待っているプロセスがあれば
+// unixソケットで標準入出力を渡す。なければ自分が新しいセッションになり、次のttyを待つ
+
+#define SESSION_HELLO "trans-resume "
+#define SESSION_AGAIN " again"
+#define SESSION_HELLO_MAX 128
+
+// 終了するときに消すunixソケットのパス
+static char listening_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static void remove_listening_path(void) {
+    if (listening_path[0]) {
+        unlink(listening_path);
+        listening_path[0] = '\0';
+    }
+}
+
+static void session_dir(char *path, size_t size) {
+    const char *tmp = getenv("TMPDIR");
+    snprintf(path, size, "%s/trans-%lu", (tmp && *tmp) ? tmp : "/tmp", (unsigned long)getuid());
+}
+
+static int session_address(const char *token, struct sockaddr_un *addr) {
+    char dir[sizeof(addr->sun_path)];
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    session_dir(dir, sizeof(dir));
+    if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", dir, token) >= (int)sizeof(addr->sun_path)) {
+        fprintf(stderr, "Session path too long: %s\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+void session_new_token(char *token) {
+    unsigned char random[SESSION_TOKEN_SIZE / 2];
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd < 0 || read(fd, random, sizeof(random)) != (ssize_t)sizeof(random)) {
+        // 乱数が読めなければ時刻とpidで作る
+        long long seed = monotonic_us() ^ ((long long)getpid() << 32);
+        for (size_t i = 0; i < sizeof(random); i++) {
+            random[i] = (unsigned char)(seed >> (8 * (i % 8)));
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    for (size_t i = 0; i < sizeof(random); i++) {
+        sprintf(token + 2 * i, "%02x", random[i]);
+    }
+}
+
+int session_hello(char *line, size_t size, const char *token, int again) {
+    return snprintf(line, size, "%s%s%s\n", SESSION_HELLO, token, again ? SESSION_AGAIN : "");
+}
+
+// "trans-resume <token>" の行まで読む。前に来るsshのバナーなどは読み飛ばす。
+// 起動し直されたのなら*againを真にする
+int session_read_hello(int fd, char *token, int *again) {
+    char line[SESSION_HELLO_MAX];
+    size_t len = 0;
+    char c;
+
+    while (1) {
+        ssize_t n = read(fd, &c, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        if (c != '\n' && c != '\r') {
+            if (len < sizeof(line) - 1) {
+                line[len++] = c;
+            }
+            continue;
+        }
+        line[len] = '\0';
+        len = 0;
+
+        char *hello = strstr(line, SESSION_HELLO);
+        if (!hello) {
+            continue;
+        }
+        hello += strlen(SESSION_HELLO);
+        if (strspn(hello, "0123456789abcdef") != SESSION_TOKEN_SIZE) {
+            continue;
+        }
+        *again = (strcmp(hello + SESSION_TOKEN_SIZE, SESSION_AGAIN) == 0);
+        if (*again || hello[SESSION_TOKEN_SIZE] == '\0') {
+            memcpy(token, hello, SESSION_TOKEN_SIZE);
+            token[SESSION_TOKEN_SIZE] = '\0';
+            return 0;
+        }
+    }
+}
+
+// 新しいセッションとして、次のttyを受け取るunixソケットを作る
+int session_listen(const char *token) {
+    struct sockaddr_un addr;
+    char dir[sizeof(addr.sun_path)];
+    struct stat st;
+
+    session_dir(dir, sizeof(dir));
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    // 他のユーザーが作ったディレクトリは使わない
+    if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 0077)) {
+        fprintf(stderr, "%s: not a private directory\n", dir);
+        return -1;
+    }
+    if (session_address(token, &addr) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        perror(addr.sun_path);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    // シグナルで終わっても残さない (cleanup_and_exitはexitする)
+    if (!listening_path[0]) {
+        atexit(remove_listening_path);
+    }
+    strcpy(listening_path, addr.sun_path);
+    return fd;
+}
+
+void session_remove(const char *token) {
+    struct sockaddr_un addr;
+    if (session_address(token, &addr) == 0) {
+        unlink(addr.sun_path);
+        if (strcmp(addr.sun_path, listening_path) == 0) {
+            listening_path[0] = '\0';
+        }
+    }
+}
+
+// tokenのセッションが待っていれば標準入出力を渡し、そのセッションが使い終わるまで待つ。
+// 待っているセッションがなければ-1を返す
+int session_handover(const char *token, int input_fd, int output_fd) {
+    struct sockaddr_un addr;
+    int fds[2] = { input_fd, output_fd };
+    char control[CMSG_SPACE(sizeof(fds))];
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+
+    if (session_address(token, &addr) < 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd, &msg, 0) < 0) {
+        perror("sendmsg");
+        close(fd);
+        return -1;
+    }
+
+    // 渡した後は持っていない。セッションが閉じるまで終わらずにttyを保つ
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, input_fd);
+        dup2(null_fd, output_fd);
+        close(null_fd);
+    }
+    ssize_t n;
+    while ((n = read(fd, &byte, 1)) > 0 || (n < 0 && errno == EINTR)) {
+    }
+    close(fd);
+    return 0;
+}
+
+// 渡された標準入出力を受け取る。接続は*conn_fdに返し、閉じると渡したプロセスが終わる
+int session_accept(int listen_fd, int *conn_fd, int *input_fd, int *output_fd) {
+    int fds[2];
+    char control[CMSG_SPACE(sizeof(fds))];
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    while ((n = recvmsg(fd, &msg, 0)) < 0 && errno == EINTR) {
+    }
+    struct cmsghdr *cmsg = (n > 0) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        close(fd);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    *conn_fd = fd;
+    *input_fd = fds[0];
+    *output_fd = fds[1];
+    return 0;
+}
@@ -0,0 +1,392 @@
+#include "trans.h"
+#include <sys/mman.h>
+
+size_t bytebuf_len(const bytebuf_t *buf) {
+    return buf->end - buf->start;
+}
+
+// bytebuf_map: 大きさcapのmemfdを、2*capの領域の前半と後半に重ねてマップする。
+// data[i]とdata[cap + i]が同じバイトになるので、startから未消費部分も空きも一続きに見え、
+// 書き込みの途中で末尾に追加しても先頭を詰める必要がない。
+// start < cap に保てば、未消費部分と空きは合わせてcapに収まる
+static unsigned char *map_ring(size_t cap) {
+#ifdef MFD_CLOEXEC
+    int fd = memfd_create("trans-bytebuf", MFD_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    unsigned char *base = NULL;
+    if (ftruncate(fd, (off_t)cap) == 0) {
+        base = mmap(NULL, 2 * cap, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            base = NULL;
+        } else if (mmap(base, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+                   mmap(base + cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(base, 2 * cap);
+            base = NULL;
+        }
+    }
+    close(fd); // マップが残っている間は領域も残る
+    return base;
+#else
+    (void)cap;
+    return NULL;
+#endif
+}
+
+// 空きが足りなければ大きなリングに移す。マップできなければ普通のバッファに戻してNULLを返す
+static unsigned char *reserve_mapped(bytebuf_t *buf, size_t extra) {
+    size_t len = bytebuf_len(buf);
+
+    if (buf->cap - len < extra) {
+        size_t new_cap = buf->cap ? buf->cap : (size_t)sysconf(_SC_PAGESIZE);
+        while (new_cap - len < extra) {
+            new_cap *= 2;
+        }
+        unsigned char *new_data = map_ring(new_cap);
+        if (!new_data) {
+            bytebuf_t heap = {0};
+            if (len > 0) {
+                bytebuf_append(&heap, buf->data + buf->start, len);
+            }
+            bytebuf_free(buf);
+            *buf = heap;
+            return NULL;
+        }
+        if (len > 0) {
+            memcpy(new_data, buf->data + buf->start, len);
+        }
+        bytebuf_free(buf);
+        buf->data = new_data;
+        buf->cap = new_cap;
+        buf->start = 0;
+        buf->end = len;
+    }
+    return buf->data + buf->end;
+}
+
+unsigned char *bytebuf_reserve(bytebuf_t *buf, size_t extra) {
+    if (buf->mapped) {
+        unsigned char *p = reserve_mapped(buf, extra);
+        if (p) {
+            return p;
+        }
+    }
+    if (buf->cap - buf->end < extra && buf->start > 0) {
+        // 消費済みの先頭を詰めて空きを作る
+        memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+        buf->end -= buf->start;
+        buf->start = 0;
+    }
+    if (buf->cap - buf->end < extra) {
+        size_t new_cap = buf->cap ? buf->cap : MIN_BUFFER_SIZE;
+        while (new_cap - buf->end < extra) {
+            new_cap *= 2;
+        }
+        unsigned char *new_data = realloc(buf->data, new_cap);
+        if (!new_data) {
+            perror("realloc");
+            exit(1);
+        }
+        buf->data = new_data;
+        buf->cap = new_cap;
+    }
+    return buf->data + buf->end;
+}
+
+void bytebuf_append(bytebuf_t *buf, const void *data, size_t len) {
+    memcpy(bytebuf_reserve(buf, len), data, len);
+    buf->end += len;
+}
+
+void bytebuf_consume(bytebuf_t *buf, size_t len) {
+    buf->start += len;
+    if (buf->start >= buf->end) {
+        buf->start = 0;
+        buf->end = 0;
+    } else if (buf->mapped && buf->start >= buf->cap) {
+        // 後半に入ったら、同じ内容の前半を指し直す
+        buf->start -= buf->cap;
+        buf->end -= buf->cap;
+    }
+}
+
+// 領域を手放す。bytebuf_mapした指定は残り、次に確保するときもリングにする
+void bytebuf_free(bytebuf_t *buf) {
+    if (buf->mapped) {
+        if (buf->data) {
+            munmap(buf->data, 2 * buf->cap);
+        }
+    } else {
+        free(buf->data);
+    }
+    buf->data = NULL;
+    buf->start = buf->end = buf->cap = 0;
+}
+
+// 以後の領域を、消費済みの先頭を詰めずに追加できるリングにする。
+// 書き込みが追いつかない間も出力を溜め続けるキューに使う
+void bytebuf_map(bytebuf_t *buf) {
+    bytebuf_free(buf);
+    buf->mapped = 1;
+}
+
+volatile sig_atomic_t stats_requested = 0;
+
+// 使用中のストリームの一覧
+static codec_stream_t *active_streams = NULL;
+
+int codec_stream_init(codec_stream_t *cs, const config_t *config, int encoding, capture_t *capture) {
+    memset(cs, 0, sizeof(*cs));
+    cs->config = config;
+    cs->encoding = encoding;
+    cs->capture = capture;
+    cs->stats.conn_id = -1;
+    decoder_init(&cs->decoder, config->method);
+    if (config->compress_level >= 0) {
+        cs->compress_stage = compress_stage_new(encoding, config->compress_level);
+        if (!cs->compress_stage) {
+            return -1;
+        }
+    }
+    if (config->dedup_cache > 0) {
+        cs->dedup_stage = dedup_stage_new(encoding, config->dedup_cache);
+        if (!cs->dedup_stage) {
+            return -1;
+        }
+    }
+
+    cs->next = active_streams;
+    if (active_streams) {
+        active_streams->prev = cs;
+    }
+    active_streams = cs;
+    return 0;
+}
+
+void codec_stream_close(codec_stream_t *cs) {
+    if (cs->prev) {
+        cs->prev->next = cs->next;
+    } else if (active_streams == cs) {
+        active_streams = cs->next;
+    }
+    if (cs->next) {
+        cs->next->prev = cs->prev;
+    }
+    compress_stage_free(cs->compress_stage);
+    dedup_stage_free(cs->dedup_stage);
+    bytebuf_free(&cs->scratch);
+    bytebuf_free(&cs->deduped);
+    bytebuf_free(&cs->payload);
+    capture_close(cs->capture);
+    memset(cs, 0, sizeof(*cs));
+}
+
+// 変換に使っているバッファの合計 (zlibの内部状態は含まない)
+size_t codec_stream_memory(const codec_stream_t *cs) {
+    size_t total = cs->scratch.cap + cs->payload.cap + cs->deduped.cap;
+
+    if (cs->dedup_stage) {
+        total += dedup_stage_memory(cs->dedup_stage);
+    }
+    return total;
+}
+
+void codec_stream_encode(codec_stream_t *cs, const unsigned char *data, size_t len, bytebuf_t *out) {
+    const config_t *config = cs->config;
+    long long started = monotonic_us();
+
+    capture_record(cs->capture, CAPTURE_TOENC, data, len);
+    stats_add(&cs->stats.bytes_in, len);
+    if (cs->dedup_stage) {
+        // キャッシュにあるチャンクを参照に置き換えてから圧縮する
+        bytebuf_consume(&cs->deduped, bytebuf_len(&cs->deduped));
+        dedup_stage_encode(cs->dedup_stage, data, len, &cs->deduped);
+        data = cs->deduped.data + cs->deduped.start;
+        len = bytebuf_len(&cs->deduped);
+    }
+    if (cs->compress_stage) {
+        unsigned char *compressed = bytebuf_reserve(&cs->scratch, compress_bound(len));
+        len = compress_stage_deflate(cs->compress_stage, data, len, compressed);
+        data = compressed;
+    }
+
+    // reserveで先頭が詰められることがあるので、増えた長さで末尾から数える
+    size_t before = bytebuf_len(out);
+    if (cs->link) {
+        // フレームに分けてからエンコードする。エスケープの数はフレームの大きさから求める
+        len = link_send(cs->link, data, len, out);
+    } else {
+        unsigned char *encoded = bytebuf_reserve(out, encode_bound(config->method, len));
+        out->end += encode_data_set(config->method, cs->escapes, data, len, encoded);
+    }
+    size_t encoded_len = bytebuf_len(out) - before;
+    const unsigned char *encoded = out->data + out->end - encoded_len;
+
+    stats_add(&cs->stats.bytes_out, encoded_len);
+    if (config->method == METHOD_ESCAPE) {
+        stats_add(&cs->stats.escapes, (encoded_len - len) / 2);    // 1バイトが3バイトになる
+    } else if (config->method == METHOD_DENSE) {
+        stats_add(&cs->stats.escapes, encoded_len - len);          // 1バイトが2バイトになる
+    }
+
+    capture_record(cs->capture, CAPTURE_ENC_D, encoded, encoded_len);
+    latency_record(cs->encoding, LATENCY_CODEC, monotonic_us() - started);
+}
+
+// wireのデータをすべて読む。途中で切れたエスケープや行はデコーダが次の呼び出しへ持ち越す
+void codec_stream_decode(codec_stream_t *cs, bytebuf_t *wire, bytebuf_t *out) {
+    codec_stream_decode_data(cs, wire->data + wire->start, bytebuf_len(wire), out);
+    bytebuf_consume(wire, bytebuf_len(wire));
+}
+
+// 展開した結果を、重複除去していれば元に戻してoutに書く
+static void deliver_decoded(codec_stream_t *cs, const unsigned char *data, size_t len, bytebuf_t *out) {
+    size_t before = bytebuf_len(out);
+
+    if (cs->dedup_stage) {
+        dedup_stage_decode(cs->dedup_stage, data, len, out);
+    } else {
+        bytebuf_append(out, data, len);
+    }
+    size_t delivered = bytebuf_len(out) - before;
+    capture_record(cs->capture, CAPTURE_DEC_D, out->data + out->end - delivered, delivered);
+    stats_add(&cs->stats.bytes_out, delivered);
+}
+
+static void decode_wire(codec_stream_t *cs, const unsigned char *wire, size_t wire_len, bytebuf_t *out) {
+
+    // 圧縮も重複除去もフレーム化もしていなければ、デコード結果を直接outに書く
+    int staged = cs->compress_stage || cs->dedup_stage;
+    bytebuf_t *target = (staged || cs->link) ? &cs->scratch : out;
+    unsigned char *decoded = bytebuf_reserve(target, decoder_bound(&cs->decoder, wire_len));
+    size_t decoded_len = decoder_feed(&cs->decoder, wire, wire_len, decoded);
+
+    capture_record(cs->capture, CAPTURE_TODEC, wire, wire_len);
+    stats_add(&cs->stats.bytes_in, wire_len);
+    if (cs->decoder.held_len > 0) {
+        stats_add(&cs->stats.carry_overs, 1);
+        stats_add(&cs->stats.carried_bytes, cs->decoder.held_len);
+    }
+
+    if (cs->link) {
+        // 順番どおりに届いたフレームの中身だけを取り出す
+        bytebuf_t *payload = staged ? &cs->payload : out;
+        size_t before = bytebuf_len(payload);
+        link_receive(cs->link, decoded, decoded_len, payload);
+        decoded_len = bytebuf_len(payload) - before;
+        decoded = payload->data + payload->end - decoded_len;
+        if (!staged) {
+            capture_record(cs->capture, CAPTURE_DEC_D, decoded, decoded_len);
+            stats_add(&cs->stats.bytes_out, decoded_len);
+            return;
+        }
+    } else if (!staged) {
+        capture_record(cs->capture, CAPTURE_DEC_D, decoded, decoded_len);
+        out->end += decoded_len;
+        stats_add(&cs->stats.bytes_out, decoded_len);
+        return;
+    }
+
+    if (cs->compress_stage) {
+        const unsigned char *compressed = decoded;
+        const unsigned char *inflated;
+        size_t inflated_len;
+        while ((inflated_len = compress_stage_inflate(cs->compress_stage, &compressed, &decoded_len,
+                                                      &inflated)) > 0) {
+            deliver_decoded(cs, inflated, inflated_len, out);
+        }
+    } else {
+        deliver_decoded(cs, decoded, decoded_len, out);
+    }
+    if (cs->link) {
+        bytebuf_consume(&cs->payload, bytebuf_len(&cs->payload));
+    }
+}
+
+void codec_stream_decode_data(codec_stream_t *cs, const unsigned char *wire, size_t wire_len, bytebuf_t *out) {
+    if (wire_len == 0) return;
+
+    long long started = monotonic_us();
+    decode_wire(cs, wire, wire_len, out);
+    latency_record(cs->encoding, LATENCY_CODEC, monotonic_us() - started);
+}
+
+long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// --pipelineではワーカーが変換の統計を数え、中継のスレッドがstats_dumpで読む。
+// 統計の数はこの2つで読み書きする
+void stats_add(unsigned long long *counter, unsigned long long n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+unsigned long long stats_get(const unsigned long long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// 書き込みがEAGAINになった
+void stats_write_stalled(stream_stats_t *stats) {
+    stats->write_stalls++;
+    if (stats->stall_started == 0) {
+        stats->stall_started = monotonic_us();
+    }
+}
+
+// 書き込みが進んだ。詰まっていた時間を足す
+void stats_write_progress(stream_stats_t *stats) {
+    if (stats->stall_started != 0) {
+        stats->stalled_us += (unsigned long long)(monotonic_us() - stats->stall_started);
+        stats->stall_started = 0;
+    }
+}
+
+void stats_dump(FILE *file) {
+    long long now = monotonic_us();
+
+    for (codec_stream_t *cs = active_streams; cs; cs = cs->next) {
+        const stream_stats_t *st = &cs->stats;
+        unsigned long long bytes_in = stats_get(&st->bytes_in);
+        unsigned long long bytes_out = stats_get(&st->bytes_out);
+        unsigned long long stalled_us = st->stalled_us;
+        char conn[32] = "";
+
+        if (st->stall_started != 0) {
+            stalled_us += (unsigned long long)(now - st->stall_started);
+        }
+        if (st->conn_id >= 0) {
+            sprintf(conn, " #%d", st->conn_id);
+        }
+        fprintf(file,
+                "stats %d%s %s: in %llu out %llu ratio %.3f escapes %llu "
+                "flush timeout %llu full %llu small %llu eof %llu carry %llu (%llu bytes) "
+                "write stalls %llu (%.3fs)",
+                (int)getpid(), conn, cs->encoding ? "port->stdio" : "stdio->port",
+                bytes_in, bytes_out, bytes_in ? (double)bytes_out / bytes_in : 0.0, stats_get(&st->escapes),
+                stats_get(&st->flushes[FLUSH_TIMEOUT]), stats_get(&st->flushes[FLUSH_FULL]),
+                stats_get(&st->flushes[FLUSH_SMALL_READ]), stats_get(&st->flushes[FLUSH_EOF]),
+                stats_get(&st->carry_overs), stats_get(&st->carried_bytes),
+                st->write_stalls, stalled_us / 1e6);
+        if (cs->link) {
+            fprintf(file, " bad frames %llu retransmits %llu", st->bad_frames, st->retransmits);
+        }
+        if (cs->dedup_stage && cs->encoding) {
+            unsigned long long refs;
+            unsigned long long saved = dedup_stage_saved(cs->dedup_stage, &refs);
+            fprintf(file, " dedup refs %llu (%llu bytes)", refs, saved);
+        }
+        fputc('\n', file);
+    }
+    latency_dump(file);
+}
+
+// SIGUSR1を受けていたら統計を出力する。イベントループの各周で呼ぶ
+void stats_dump_if_requested(void) {
+    if (stats_requested) {
+        stats_requested = 0;
+        stats_dump(stderr);
+    }
+}
@@ -0,0 +1,97 @@
+#include "trans.h"
+#include <termios.h>
+
+// --sync: sshのバナーやMOTD、stty rawが済むのを--delayで待つ代わりに、
+// 標準入出力側がttyをrawにしてから印を1度だけ書き、-s側はそれまでに届いたものを捨てる。
+// -s側は印を受け取るまでコマンドに何も書かないので、rawになる前のttyにデータが流れない
+
+static struct termios saved_termios;
+static int termios_saved;
+
+static void restore_termios(void) {
+    if (termios_saved) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+        termios_saved = 0;
+    }
+}
+
+// 標準入出力側: 標準入力がttyならrawにして、印を標準出力に書く
+int sync_announce(void) {
+    const char *preamble = SYNC_PREAMBLE;
+    size_t len = strlen(preamble);
+
+    if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved_termios) == 0) {
+        struct termios raw = saved_termios;
+        cfmakeraw(&raw);
+        // rawになる前に届いていた入力はエコーや行編集を受けているので捨てる
+        if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == 0) {
+            termios_saved = 1;
+            atexit(restore_termios);
+        }
+    }
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, preamble, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("write");
+            return -1;
+        }
+        preamble += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// -s側: ttyから読んだデータを渡す。印までを取り除いたら1を返し、inputにはその後のデータが残る。
+// 見つからなければ、印の途中かもしれない末尾だけを残して捨てる
+int sync_receive(bytebuf_t *input) {
+    size_t len = bytebuf_len(input);
+    size_t preamble_len = strlen(SYNC_PREAMBLE);
+    const unsigned char *found = memmem(input->data + input->start, len, SYNC_PREAMBLE, preamble_len);
+
+    if (!found) {
+        if (len >= preamble_len) {
+            bytebuf_consume(input, len - (preamble_len - 1));
+        }
+        return 0;
+    }
+    bytebuf_consume(input, (size_t)(found - (input->data + input->start)) + preamble_len);
+    return 1;
+}
+
+// 1本のttyで印を受け取るまで待つ (--mux用)。印の後に届いたデータはleftoverに残す
+int sync_channel(int input_fd, bytebuf_t *leftover) {
+    long long deadline = monotonic_us() + SYNC_TIMEOUT_US;
+
+    while (1) {
+        struct pollfd pfd = { input_fd, POLLIN, 0 };
+        long long now = monotonic_us();
+        if (now >= deadline) {
+            fprintf(stderr, "Timed out waiting for the peer to be ready\n");
+            return -1;
+        }
+        int ready = poll(&pfd, 1, (int)((deadline - now + 999) / 1000));
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        unsigned char *p = bytebuf_reserve(leftover, 4096);
+        ssize_t n = read(input_fd, p, 4096);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Channel closed before the peer was ready\n");
+            return -1;
+        }
+        leftover->end += (size_t)n;
+        if (sync_receive(leftover)) {
+            return 0;
+        }
+    }
+}
@@ -1,14 +1,18 @@
 #include "trans.h"
 #include <assert.h>
 #include <string.h>
+#include <ctype.h>
+
+#define TEST_BUFFER_SIZE 256
+#define TEST_ENCODED_SIZE ESCAPE_ENCODE_BOUND(TEST_BUFFER_SIZE)
 
 void test_escape_encode_decode() {
     printf("Testing escape encode/decode...\n");
     
     // テストケース1: 特殊文字を含むデータ
     unsigned char input1[] = {0x0d, 0x0a, 0x1c, 0x7f, 0x5c, 'H', 'e', 'l', 'l', 'o'};
-    char encoded[MAX_ENCODED_SIZE];
-    unsigned char decoded[BUFFER_SIZE];
+    char encoded[TEST_ENCODED_SIZE];
+    unsigned char decoded[TEST_BUFFER_SIZE];
     
     size_t encoded_len = escape_encode_data(input1, sizeof(input1), encoded);
     size_t remaining_bytes;
@@ -43,8 +47,8 @@ void test_uuencode_decode() {
     
     // テストケース1: 基本的な文字列
     unsigned char input1[] = "Hello";
-    char encoded[MAX_ENCODED_SIZE];
-    unsigned char decoded[BUFFER_SIZE];
+    char encoded[TEST_ENCODED_SIZE];
+    unsigned char decoded[TEST_BUFFER_SIZE];
     
     size_t input1_len = strlen((char*)input1);
     size_t encoded_len = uuencode_data(input1, input1_len, encoded);
@@ -96,44 +100,44 @@ void test_uuencode_decode() {
 void test_large_data() {
     printf("Testing large data...\n");
     
-    // 大きなデータのテスト (BUFFER_SIZEまで)
-    unsigned char large_input[BUFFER_SIZE];
-    for (int i = 0; i < BUFFER_SIZE; i++) {
+    // 大きなデータのテスト (TEST_BUFFER_SIZEまで)
+    unsigned char large_input[TEST_BUFFER_SIZE];
+    for (int i = 0; i < TEST_BUFFER_SIZE; i++) {
         large_input[i] = i % 256;
     }
     
-    char encoded[MAX_ENCODED_SIZE];
-    unsigned char decoded[BUFFER_SIZE];
+    char encoded[TEST_ENCODED_SIZE];
+    unsigned char decoded[TEST_BUFFER_SIZE];
     size_t remaining_bytes;
     
     // エスケープエンコードテスト
-    size_t encoded_len = escape_encode_data(large_input, BUFFER_SIZE, encoded);
+    size_t encoded_len = escape_encode_data(large_input, TEST_BUFFER_SIZE, encoded);
     size_t decoded_len = escape_decode_data(encoded, encoded_len, decoded, &remaining_bytes);
     
     printf("  Encoded %zu bytes to %zu bytes, decoded %zu bytes, remaining %zu\n", 
-           (size_t)BUFFER_SIZE, encoded_len, decoded_len, remaining_bytes);
+           (size_t)TEST_BUFFER_SIZE, encoded_len, decoded_len, remaining_bytes);
     
-    if (decoded_len != BUFFER_SIZE || remaining_bytes != 0) {
+    if (decoded_len != TEST_BUFFER_SIZE || remaining_bytes != 0) {
         printf("  First 20 bytes of original: ");
-        for (int i = 0; i < 20 && i < BUFFER_SIZE; i++) printf("%02x ", large_input[i]);
+        for (int i = 0; i < 20 && i < TEST_BUFFER_SIZE; i++) printf("%02x ", large_input[i]);
         printf("\n");
         printf("  First 20 bytes of decoded: ");
         for (int i = 0; i < 20 && i < decoded_len; i++) printf("%02x ", decoded[i]);
         printf("\n");
     }
     
-    assert(decoded_len == BUFFER_SIZE);
+    assert(decoded_len == TEST_BUFFER_SIZE);
     assert(remaining_bytes == 0);
-    assert(memcmp(large_input, decoded, BUFFER_SIZE) == 0);
+    assert(memcmp(large_input, decoded, TEST_BUFFER_SIZE) == 0);
     printf("  Large data escape encode/decode passed\n");
     
     // uuencodeテスト
-    encoded_len = uuencode_data(large_input, BUFFER_SIZE, encoded);
+    encoded_len = uuencode_data(large_input, TEST_BUFFER_SIZE, encoded);
     decoded_len = uudecode_data(encoded, encoded_len, decoded, &remaining_bytes);
     
-    assert(decoded_len == BUFFER_SIZE);
+    assert(decoded_len == TEST_BUFFER_SIZE);
     assert(remaining_bytes == 0);
-    assert(memcmp(large_input, decoded, BUFFER_SIZE) == 0);
+    assert(memcmp(large_input, decoded, TEST_BUFFER_SIZE) == 0);
     printf("  Large data uuencode/decode passed\n");
 }
 
@@ -145,7 +149,7 @@ void test_buffer_boundary() {
     
     // テストケース1: バッファ末尾で \ だけ
     unsigned char escape_partial1[] = {'H', 'e', 'l', 'l', 'o', 0x5c};
-    unsigned char decoded[BUFFER_SIZE];
+    unsigned char decoded[TEST_BUFFER_SIZE];
     size_t remaining_bytes;
     size_t decoded_len = escape_decode_data(escape_partial1, sizeof(escape_partial1), decoded, &remaining_bytes);
     
@@ -186,6 +190,991 @@ void test_buffer_boundary() {
     printf("  All buffer boundary tests passed\n");
 }
 
+void test_encode_bound() {
+    printf("Testing encoded size bounds...\n");
+
+    // 最悪ケース(全バイトがエスケープ対象)でも上限を超えないこと
+    static unsigned char input[1000];
+    static unsigned char encoded[ESCAPE_ENCODE_BOUND(1000)];
+    memset(input, 0x5c, sizeof(input));
+
+    for (size_t len = 0; len <= sizeof(input); len++) {
+        size_t escape_len = escape_encode_data(input, len, encoded);
+        assert(escape_len + 1 <= encode_bound(METHOD_ESCAPE, len));
+
+        size_t uu_len = uuencode_data(input, len, encoded);
+        assert(uu_len + 1 <= encode_bound(METHOD_UUENCODE, len));
+
+        size_t dense_len = dense_encode_data(input, len, encoded);
+        assert(dense_len + 1 <= encode_bound(METHOD_DENSE, len));
+
+        assert(decode_bound(METHOD_ESCAPE, escape_len) >= len);
+        assert(decode_bound(METHOD_UUENCODE, uu_len) >= len);
+    }
+    printf("  Bounds hold for lengths 0..%zu\n", sizeof(input));
+}
+
+// 元のsprintf/sscanf版エスケープコーデック。最適化版の出力と比較する
+static size_t reference_escape_encode(const unsigned char *input, size_t input_len, unsigned char *output) {
+    size_t i, j = 0;
+    
+    for (i = 0; i < input_len; i++) {
+        unsigned char c = input[i];
+        
+        if (c == 0x0d || c == 0x0a || c == 0x1c || c == 0x7f || c == 0x5c) {
+            output[j++] = 0x5c;
+            sprintf((char *)&output[j], "%02x", c);
+            j += 2;
+        } else {
+            output[j++] = c;
+        }
+    }
+    
+    output[j] = '\0';
+    return j;
+}
+
+static size_t reference_escape_decode(const unsigned char *input, size_t input_len, unsigned char *output, size_t *remaining_bytes) {
+    size_t i = 0, j = 0;
+    *remaining_bytes = 0;
+    
+    while (i < input_len) {
+        if (input[i] == 0x5c) {
+            if (i + 2 < input_len) {
+                char hex_str[3];
+                hex_str[0] = input[i + 1];
+                hex_str[1] = input[i + 2];
+                hex_str[2] = '\0';
+                
+                if (isxdigit(hex_str[0]) && isxdigit(hex_str[1])) {
+                    unsigned int byte_val;
+                    sscanf(hex_str, "%02x", &byte_val);
+                    output[j++] = (unsigned char)byte_val;
+                    i += 3;
+                } else {
+                    output[j++] = input[i++];
+                }
+            } else {
+                *remaining_bytes = input_len - i;
+                break;
+            }
+        } else {
+            output[j++] = input[i++];
+        }
+    }
+    
+    return j;
+}
+
+// 元の1グループずつのuuencode。最適化版の出力と比較する
+static size_t reference_uuencode(const unsigned char *input, size_t input_len, unsigned char *output) {
+    size_t i, j = 0;
+    size_t bytes_processed = 0;
+    
+    while (bytes_processed < input_len) {
+        size_t line_bytes = (input_len - bytes_processed > 45) ? 45 : (input_len - bytes_processed);
+        
+        output[j++] = ' ' + line_bytes;
+        
+        for (i = 0; i < line_bytes; i += 3) {
+            unsigned char c1 = input[bytes_processed + i];
+            unsigned char c2 = (bytes_processed + i + 1 < input_len) ? input[bytes_processed + i + 1] : 0;
+            unsigned char c3 = (bytes_processed + i + 2 < input_len) ? input[bytes_processed + i + 2] : 0;
+            
+            output[j++] = ' ' + ((c1 >> 2) & 0x3f);
+            output[j++] = ' ' + (((c1 << 4) & 0x30) | ((c2 >> 4) & 0x0f));
+            output[j++] = ' ' + (((c2 << 2) & 0x3c) | ((c3 >> 6) & 0x03));
+            output[j++] = ' ' + (c3 & 0x3f);
+        }
+        
+        output[j++] = '\n';
+        bytes_processed += line_bytes;
+    }
+    
+    if (input_len == 0) {
+        output[j++] = ' ';
+        output[j++] = '\n';
+    }
+    
+    output[j] = '\0';
+    return j;
+}
+
+// network.cと同じく、残りバイトを次の読み込みの先頭に回しながらchunkずつデコードする
+typedef size_t (*decode_func_t)(const unsigned char *, size_t, unsigned char *, size_t *);
+
+static size_t decode_in_chunks(decode_func_t decode, const unsigned char *encoded, size_t encoded_len,
+                               unsigned char *decoded, size_t max_chunk, unsigned int seed) {
+    unsigned char buffer[ESCAPE_ENCODE_BOUND(1200)];
+    size_t buffer_pos = 0, offset = 0, decoded_len = 0;
+
+    while (offset < encoded_len) {
+        size_t chunk = 1 + (seed = seed * 1103515245u + 12345u) % max_chunk;
+        if (chunk > encoded_len - offset) {
+            chunk = encoded_len - offset;
+        }
+        memcpy(buffer + buffer_pos, encoded + offset, chunk);
+        buffer_pos += chunk;
+        offset += chunk;
+
+        size_t remaining;
+        decoded_len += decode(buffer, buffer_pos, decoded + decoded_len, &remaining);
+        memmove(buffer, buffer + buffer_pos - remaining, remaining);
+        buffer_pos = remaining;
+    }
+    return decoded_len;
+}
+
+// 再現可能な疑似乱数 (xorshift32)
+static unsigned int test_random_state = 2463534242u;
+
+static unsigned int test_random(void) {
+    test_random_state ^= test_random_state << 13;
+    test_random_state ^= test_random_state >> 17;
+    test_random_state ^= test_random_state << 5;
+    return test_random_state;
+}
+
+// 特殊バイトの割合がdensity/256程度になるデータを作る
+static void fill_test_data(unsigned char *data, size_t len, unsigned int density) {
+    static const unsigned char specials[] = {0x0d, 0x0a, 0x1c, 0x7f, 0x5c};
+    for (size_t i = 0; i < len; i++) {
+        if ((test_random() & 0xff) < density) {
+            data[i] = specials[test_random() % sizeof(specials)];
+        } else {
+            data[i] = (unsigned char)test_random();
+        }
+    }
+}
+
+void test_escape_simd_identical() {
+    printf("Testing SIMD escape codec against reference...\n");
+
+    static unsigned char input[1200];
+    static unsigned char expected[ESCAPE_ENCODE_BOUND(1200)];
+    static unsigned char actual[ESCAPE_ENCODE_BOUND(1200)];
+    static const unsigned int densities[] = {0, 4, 64, 256};
+    simd_level_t available = simd_detect_level();
+
+    for (int level = SIMD_NONE; level <= (int)available; level++) {
+        codec_set_simd_level((simd_level_t)level);
+
+        for (size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+            for (size_t len = 0; len <= sizeof(input); len += (len < 100) ? 1 : 37) {
+                fill_test_data(input, len, densities[d]);
+
+                // エンコード結果がバイト単位で一致すること
+                size_t expected_len = reference_escape_encode(input, len, expected);
+                size_t actual_len = escape_encode_data(input, len, actual);
+                assert(actual_len == expected_len);
+                assert(memcmp(actual, expected, expected_len + 1) == 0);
+
+                // 任意の位置で切ったエンコード列のデコード結果と残りバイト数が一致すること
+                size_t split = expected_len ? test_random() % expected_len : 0;
+                size_t expected_remaining, actual_remaining;
+                unsigned char encoded[ESCAPE_ENCODE_BOUND(1200)];
+                memcpy(encoded, expected, expected_len);
+                size_t ref_decoded = reference_escape_decode(encoded, split, expected, &expected_remaining);
+                size_t decoded = escape_decode_data(encoded, split, actual, &actual_remaining);
+                assert(decoded == ref_decoded);
+                assert(actual_remaining == expected_remaining);
+                assert(memcmp(actual, expected, decoded) == 0);
+
+                // 不正な16進数や大文字の16進数を含む入力も同じように扱うこと
+                for (size_t k = 0; k < len; k++) {
+                    static const unsigned char noise[] = {0x5c, 'A', 'f', 'G', '0', 'z'};
+                    if (test_random() % 4 == 0) {
+                        input[k] = noise[test_random() % sizeof(noise)];
+                    }
+                }
+                ref_decoded = reference_escape_decode(input, len, expected, &expected_remaining);
+                decoded = escape_decode_data(input, len, actual, &actual_remaining);
+                assert(decoded == ref_decoded);
+                assert(actual_remaining == expected_remaining);
+                assert(memcmp(actual, expected, decoded) == 0);
+            }
+        }
+        printf("  %s: identical to reference\n", simd_level_name((simd_level_t)level));
+    }
+
+    codec_set_simd_level(available);
+}
+
+void test_uuencode_fast_path() {
+    printf("Testing table-driven/SIMD uuencode against reference...\n");
+
+    static unsigned char input[1200];
+    static unsigned char expected[UUENCODE_BOUND(1200)];
+    static unsigned char actual[UUENCODE_BOUND(1200)];
+    static unsigned char decoded[1200];
+    simd_level_t available = simd_detect_level();
+
+    for (int level = SIMD_NONE; level <= (int)available; level++) {
+        codec_set_simd_level((simd_level_t)level);
+
+        for (size_t len = 0; len <= sizeof(input); len += (len < 100) ? 1 : 29) {
+            fill_test_data(input, len, 16);
+
+            // エンコード結果がバイト単位で一致すること
+            size_t expected_len = reference_uuencode(input, len, expected);
+            size_t actual_len = uuencode_data(input, len, actual);
+            assert(actual_len == expected_len);
+            assert(memcmp(actual, expected, expected_len + 1) == 0);
+
+            // どこで分割されても元のデータに戻ること
+            size_t decoded_len = decode_in_chunks(uudecode_data, actual, actual_len, decoded, 80, (unsigned int)len);
+            assert(decoded_len == len);
+            assert(memcmp(decoded, input, len) == 0);
+        }
+
+        // 範囲外の文字を含む行は捨て、次の行から復帰すること
+        unsigned char text[90];
+        memset(text, 'A', sizeof(text));
+        size_t encoded_len = uuencode_data(text, sizeof(text), actual);
+        actual[10] = 0x7f;
+        size_t remaining;
+        size_t decoded_len = uudecode_data(actual, encoded_len, decoded, &remaining);
+        assert(decoded_len == 45);
+        assert(remaining == 0);
+        assert(memcmp(decoded, text, 45) == 0);
+
+        printf("  %s: identical to reference\n", simd_level_name((simd_level_t)level));
+    }
+
+    codec_set_simd_level(available);
+}
+
+void test_dense_encode_decode() {
+    printf("Testing dense encode/decode...\n");
+
+    static unsigned char input[1200];
+    static unsigned char encoded[DENSE_ENCODE_BOUND(1200)];
+    static unsigned char scalar_encoded[DENSE_ENCODE_BOUND(1200)];
+    static unsigned char decoded[1200];
+    simd_level_t available = simd_detect_level();
+
+    // 全バイト値が往復し、危険なバイトがそのまま出力されないこと
+    for (int i = 0; i < 256; i++) {
+        input[i] = (unsigned char)i;
+    }
+    size_t encoded_len = dense_encode_data(input, 256, encoded);
+    for (size_t k = 0; k < encoded_len; k++) {
+        assert(encoded[k] != 0x0d && encoded[k] != 0x0a && encoded[k] != 0x1c && encoded[k] != 0x7f);
+    }
+    size_t remaining;
+    size_t decoded_len = dense_decode_data(encoded, encoded_len, decoded, &remaining);
+    assert(decoded_len == 256);
+    assert(remaining == 0);
+    assert(memcmp(decoded, input, 256) == 0);
+    printf("  Test 1 passed: All byte values (256 -> %zu bytes)\n", encoded_len);
+
+    // バッファ末尾のエスケープ文字は次回に回すこと
+    unsigned char partial[] = {'H' + 42, 'i' + 42, 0x3d};
+    decoded_len = dense_decode_data(partial, sizeof(partial), decoded, &remaining);
+    assert(decoded_len == 2);
+    assert(remaining == 1);
+    assert(memcmp(decoded, "Hi", 2) == 0);
+    printf("  Test 2 passed: Partial escape at buffer end\n");
+
+    // 乱数データのオーバーヘッドが小さいこと
+    fill_test_data(input, sizeof(input), 0);
+    encoded_len = dense_encode_data(input, sizeof(input), encoded);
+    assert(encoded_len < sizeof(input) * 104 / 100);
+    printf("  Test 3 passed: Random data overhead %zu -> %zu bytes\n", sizeof(input), encoded_len);
+
+    // SIMD版がスカラー版と同じ出力をし、どこで分割されても元に戻ること
+    for (int level = SIMD_NONE; level <= (int)available; level++) {
+        for (size_t len = 0; len <= sizeof(input); len += (len < 100) ? 1 : 37) {
+            fill_test_data(input, len, 32);
+            codec_set_simd_level(SIMD_NONE);
+            size_t scalar_len = dense_encode_data(input, len, scalar_encoded);
+            codec_set_simd_level((simd_level_t)level);
+            encoded_len = dense_encode_data(input, len, encoded);
+            assert(encoded_len == scalar_len);
+            assert(memcmp(encoded, scalar_encoded, encoded_len + 1) == 0);
+
+            decoded_len = decode_in_chunks(dense_decode_data, encoded, encoded_len, decoded, 40, (unsigned int)len);
+            assert(decoded_len == len);
+            assert(memcmp(decoded, input, len) == 0);
+        }
+        printf("  %s: round trip and scalar-identical output passed\n", simd_level_name((simd_level_t)level));
+    }
+
+    codec_set_simd_level(available);
+}
+
+// 記録を細かく分けて受け取る側に渡し、元に戻るか確かめる。送った記録の大きさを返す
+static size_t run_dedup(dedup_stage_t *sender, dedup_stage_t *receiver, const unsigned char *data, size_t len,
+                        size_t flush_size) {
+    bytebuf_t wire = {0}, restored = {0};
+    size_t wire_total = 0;
+
+    for (size_t at = 0; at < len; at += flush_size) {
+        size_t n = (len - at < flush_size) ? len - at : flush_size;
+        dedup_stage_encode(sender, data + at, n, &wire);
+        wire_total += bytebuf_len(&wire);
+        while (bytebuf_len(&wire) > 0) {
+            size_t piece = 1 + test_random() % 3000;
+            if (piece > bytebuf_len(&wire)) {
+                piece = bytebuf_len(&wire);
+            }
+            dedup_stage_decode(receiver, wire.data + wire.start, piece, &restored);
+            bytebuf_consume(&wire, piece);
+        }
+    }
+    assert(bytebuf_len(&restored) == len && memcmp(restored.data + restored.start, data, len) == 0);
+    bytebuf_free(&wire);
+    bytebuf_free(&restored);
+    return wire_total;
+}
+
+void test_dedup_stage() {
+    printf("Testing dedup stage...\n");
+
+    size_t len = 3 * 1024 * 1024;
+    unsigned char *data = malloc(len);
+    assert(data);
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (unsigned char)test_random();
+    }
+
+    // 2度目は、flushの区切りが違っても大部分が参照になる
+    dedup_stage_t *sender = dedup_stage_new(1, 8 * 1024 * 1024);
+    dedup_stage_t *receiver = dedup_stage_new(0, 8 * 1024 * 1024);
+    assert(sender && receiver);
+    size_t first = run_dedup(sender, receiver, data, 512 * 1024, 65536);
+    // キャッシュは送る側も受ける側も最初に確保する
+    assert(dedup_stage_memory(sender) > 8 * 1024 * 1024 && dedup_stage_memory(receiver) > 8 * 1024 * 1024);
+    size_t second = run_dedup(sender, receiver, data, 512 * 1024, 40000);
+    assert(first > 512 * 1024);
+    assert(second < 512 * 1024 / 4);
+    unsigned long long refs;
+    assert(dedup_stage_saved(sender, &refs) > 0 && refs > 0);
+    printf("  Repeated 512KB sent as %zu bytes after %zu\n", second, first);
+
+    // 小さな書き込みはキャッシュに加えずにそのまま届く
+    run_dedup(sender, receiver, (const unsigned char *)"ls -l\r", 6, 6);
+    dedup_stage_free(sender);
+    dedup_stage_free(receiver);
+
+    // キャッシュより大きなデータを繰り返しても、両端で同じチャンクが消える
+    sender = dedup_stage_new(1, 1024 * 1024);
+    receiver = dedup_stage_new(0, 1024 * 1024);
+    assert(sender && receiver);
+    for (int round = 0; round < 3; round++) {
+        run_dedup(sender, receiver, data, len, 100000);
+    }
+    size_t recent = run_dedup(sender, receiver, data + len - 256 * 1024, 256 * 1024, 65536);
+    assert(recent < 256 * 1024 / 4);
+    printf("  Eviction stays in step past a 1MB cache\n");
+
+    dedup_stage_free(sender);
+    dedup_stage_free(receiver);
+    free(data);
+}
+
+void test_latency_histogram() {
+    printf("Testing latency histogram...\n");
+
+    static latency_histogram_t h;
+    assert(latency_histogram_percentile(&h, 0.5) == 0);
+    for (long long us = 1; us <= 10000; us++) {
+        latency_histogram_add(&h, us);
+    }
+    // 区間の幅は値の1/16以内
+    long long p50 = latency_histogram_percentile(&h, 0.5);
+    long long p99 = latency_histogram_percentile(&h, 0.99);
+    long long p999 = latency_histogram_percentile(&h, 0.999);
+    assert(p50 >= 5000 && p50 <= 5000 + 5000 / 16);
+    assert(p99 >= 9900 && p99 <= 9900 + 9900 / 16);
+    assert(p999 >= 9990 && p999 <= 10000);
+    assert(latency_histogram_percentile(&h, 1.0) == 10000);
+    printf("  p50 %lld p99 %lld p999 %lld of 1..10000us\n", p50, p99, p999);
+
+    // 小さな値はそのまま、大きすぎる値は最後の区間に入る
+    static latency_histogram_t small;
+    latency_histogram_add(&small, 0);
+    latency_histogram_add(&small, 3);
+    latency_histogram_add(&small, 1LL << 50);
+    assert(latency_histogram_percentile(&small, 0.3) == 0);
+    assert(latency_histogram_percentile(&small, 0.6) == 3);
+    assert(latency_histogram_percentile(&small, 1.0) == 1LL << 50);
+    printf("  Exact below 16us, clamped above 2^40us\n");
+}
+
+void test_parse_flush_latency() {
+    printf("Testing flush latency parsing...\n");
+
+    flush_policy_t policy;
+    assert(parse_flush_latency("0") == 0);
+    assert(parse_flush_latency("5000000") == FLUSH_MAX_LATENCY_US);
+    const char *bad[] = { "", "-1", "12x", "5000001", "9223372036854775807", "99999999999999999999999" };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        policy.latency_us = 123;
+        assert(parse_flush_latency(bad[i]) == -1);
+        assert(parse_flush_policy(bad[i], &policy) == -1 && policy.latency_us == 123);
+    }
+    printf("  --flush-latency-us accepts 0..%ld, rejects overflow and out of range\n", (long)FLUSH_MAX_LATENCY_US);
+
+    assert(parse_flush_policy("bulk", &policy) == 0 && policy.latency_us == FLUSH_BULK_LATENCY_US);
+    assert(parse_flush_policy("2000", &policy) == 0 && policy.latency_us == 2000 &&
+           policy.small_read == FLUSH_INTERACTIVE_SMALL_READ);
+    printf("  --flush policies read presets and bounded numbers\n");
+}
+
+void test_dump_parse_hex() {
+    printf("Testing dump log hex parser...\n");
+
+    static char line[3 * 300];
+    static unsigned char expected[300], simd_out[300 + 16], scalar_out[300 + 16];
+    for (size_t len = 0; len < 300; len++) {
+        size_t pos = 0;
+        for (size_t i = 0; i < len; i++) {
+            expected[i] = (unsigned char)test_random();
+            pos += (size_t)sprintf(line + pos, (i % 3) ? "%02x " : "%02X ", expected[i]);
+        }
+        pos -= (len > 0); // 最後の空白は付かない
+        int simd_foreign, scalar_foreign;
+        size_t simd_len = dump_parse_hex(line, pos, simd_out, codec_simd_level(), &simd_foreign);
+        size_t scalar_len = dump_parse_hex(line, pos, scalar_out, SIMD_NONE, &scalar_foreign);
+        assert(simd_len == len && scalar_len == len && !simd_foreign && !scalar_foreign);
+        assert(memcmp(simd_out, expected, len) == 0 && memcmp(scalar_out, expected, len) == 0);
+    }
+
+    // いつもの形でない語はRubyのto_i(16)と同じく読む
+    const char *odd = "00 11 22 33 44 55 66 77  0x1f\tabc -1 zz 7q 88 99 aa bb cc dd ee\r";
+    unsigned char odd_expected[] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x1f, 0xbc, 0xff, 0x00,
+                                     0x07, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee };
+    int foreign;
+    assert(dump_parse_hex(odd, strlen(odd), simd_out, codec_simd_level(), &foreign) == sizeof(odd_expected));
+    assert(memcmp(simd_out, odd_expected, sizeof(odd_expected)) == 0 && foreign);
+    printf("  SIMD (%s) and scalar agree on 0..299 byte lines\n", simd_level_name(codec_simd_level()));
+
+    // 改行位置が違っても連結したバイト列が同じなら一致し、違えばバイトごとに数える
+    const char *left = "/tmp/test_dump_check_l.txt";
+    const char *right = "/tmp/test_dump_check_r.txt";
+    FILE *file = fopen(left, "w");
+    fprintf(file, "01:00:00.000001 l:toenc:30 31 32\n01:00:00.000002 l:write 3 bytes\n"
+                  "01:00:00.000003 l:toenc:33 34\n01:00:00.000004 l:dec-d:41\n");
+    fclose(file);
+    file = fopen(right, "w");
+    fprintf(file, "01:00:00.000005 r:dec-d:30\n01:00:00.000006 r:dec-d:31 32 33 34\n"
+                  "01:00:00.000007 r:toenc:41 42\n");
+    fclose(file);
+    char *paths[] = { (char *)left, (char *)right };
+    FILE *out = tmpfile();
+    assert(dump_check(2, paths, out) == 1); // r:toencの42が余る
+    rewind(out);
+    char report[4096];
+    report[fread(report, 1, sizeof(report) - 1, out)] = '\0';
+    assert(strstr(report, "位置 1: l:dec-d vs r:toenc") && strstr(report, "\033[7m42\033[0m"));
+    fclose(out);
+    unlink(left);
+    unlink(right);
+    printf("  Paired streams compared across lines and files\n");
+}
+
+// ボトルネックの速さrate (バイト/μs)、往復rtt_msの通信路を1ms刻みで動かす。sendingの間は送り続ける。
+// 最後の1/3の間に届いたバイト数を返す
+static unsigned long long run_flow_link(flow_t *flow, double rate, int rtt_ms, int ms, int sending,
+                                        unsigned long long *served) {
+    static unsigned long long history[120000];
+    static int tick;
+    unsigned long long at_two_thirds = 0;
+
+    assert(tick + ms <= (int)(sizeof(history) / sizeof(history[0])));
+    for (int end = tick + ms; tick < end; tick++) {
+        long long now = 1000000 + (long long)tick * 1000;
+        // CREDITは、往復の時間だけ前に通り抜けたバイト数を8KBごとに返す
+        if (tick >= rtt_ms) {
+            flow_acked(flow, history[tick - rtt_ms] / 8192 * 8192, now);
+        }
+        if (sending) {
+            size_t room = flow_room(flow);
+            if (room > 0) {
+                flow_sent(flow, room, now);
+            }
+            flow_blocked(flow);
+        }
+        unsigned long long capacity = (unsigned long long)(rate * 1000);
+        *served += (flow->sent - *served < capacity) ? flow->sent - *served : capacity;
+        history[tick] = *served;
+        if (end - tick == ms / 3) {
+            at_two_thirds = *served;
+        }
+    }
+    return *served - at_two_thirds;
+}
+
+void test_flow_window() {
+    printf("Testing flow control window...\n");
+
+    // 1MB/s、往復300msの遅い通信路: BDPは300KB
+    flow_t flow;
+    unsigned long long served = 0;
+    flow_init(&flow, 0, 1);
+    unsigned long long delivered = run_flow_link(&flow, 1.0, 300, 30000, 1, &served);
+    size_t bdp = 300 * 1000;
+    printf("  300ms RTT: window %zuKB (BDP %zuKB), min RTT %lldms, %.0f%% of the link used\n",
+           flow.window / 1024, bdp / 1024, flow.min_rtt / 1000, delivered / 10000.0 / 10);
+    assert(flow.window >= bdp && flow.window <= bdp + 300 * 1000);
+    assert(delivered >= 9000 * 1000);
+    assert(flow.sent - served < 300 * 1000); // 待ち行列は目標の遅延ほどに収まる
+
+    // 送るものがない間は窓を縮めない (止める直前の測定の分だけ揺れてよい)
+    size_t window = flow.window;
+    run_flow_link(&flow, 1.0, 300, 20000, 0, &served);
+    assert(flow.window >= window * 9 / 10 && flow.drain_started == 0);
+    printf("  Idle gap keeps the window\n");
+}
+
+void test_compress_stage() {
+    printf("Testing compression stage...\n");
+
+    static unsigned char input[4096];
+    static unsigned char compressed[4096 + 4096 / 8 + 64 + 1];
+    compress_stage_t *deflater = compress_stage_new(1, 6);
+    compress_stage_t *inflater = compress_stage_new(0, 0);
+    assert(deflater && inflater);
+
+    // flushごとに出力が完結し、それだけで相手が展開できること
+    size_t total_in = 0, total_out = 0;
+    for (int round = 0; round < 8; round++) {
+        size_t len = 100 + (size_t)round * 500;
+        for (size_t i = 0; i < len; i++) {
+            input[i] = (round % 2) ? (unsigned char)test_random() : (unsigned char)("0123456789abcdef"[i % 16]);
+        }
+        size_t compressed_len = compress_stage_deflate(deflater, input, len, compressed);
+        assert(compressed_len <= compress_bound(len));
+        if (round == 0) {
+            // 最初のflushだけが方式とレベルのヘッダで始まる
+            assert(compress_parse_header(compressed[0]) == 6);
+        }
+
+        const unsigned char *next = compressed;
+        size_t next_len = compressed_len;
+        const unsigned char *inflated;
+        size_t inflated_len, restored = 0;
+        while ((inflated_len = compress_stage_inflate(inflater, &next, &next_len, &inflated)) > 0) {
+            assert(memcmp(inflated, input + restored, inflated_len) == 0);
+            restored += inflated_len;
+        }
+        assert(restored == len);
+        assert(next_len == 0);
+        total_in += len;
+        total_out += compressed_len;
+    }
+    printf("  Sync-flushed rounds restored: %zu -> %zu bytes\n", total_in, total_out);
+
+    // -zのない相手や、ヘッダのない古い版のzlibのストリームはヘッダで見分ける
+    assert(compress_parse_header('h') == -1);
+    assert(compress_parse_header(0x78) == -1);
+    assert(compress_parse_header(0xaf) == -1);
+    assert(compress_parse_header(0xa0) == 0 && compress_parse_header(0xa9) == 9);
+    printf("  Header carries the method and level, plain and headerless streams rejected\n");
+
+    // 辞書がflushをまたいで残り、繰り返しが小さく圧縮されること
+    fill_test_data(input, 1000, 0);
+    size_t first = compress_stage_deflate(deflater, input, 1000, compressed);
+    size_t second = compress_stage_deflate(deflater, input, 1000, compressed);
+    assert(first >= 1000);
+    assert(second < 100);
+    printf("  Dictionary kept across flushes: %zu then %zu bytes\n", first, second);
+
+    compress_stage_free(deflater);
+    compress_stage_free(inflater);
+}
+
+// wireをデコードしてlinkに渡す
+static void deliver_wire(link_t *link, bytebuf_t *wire, bytebuf_t *out) {
+    size_t wire_len = bytebuf_len(wire);
+    unsigned char *decoded = malloc(wire_len + 1);
+    size_t remaining_bytes;
+    size_t decoded_len = escape_decode_data(wire->data + wire->start, wire_len, decoded, &remaining_bytes);
+
+    link_receive(link, decoded, decoded_len, out);
+    bytebuf_consume(wire, wire_len - remaining_bytes);
+    free(decoded);
+}
+
+void test_framed_link() {
+    printf("Testing framed link...\n");
+
+    assert(crc32c("123456789", 9) == 0xe3069283);
+    printf("  CRC32C check value passed\n");
+
+    config_t config;
+    memset(&config, 0, sizeof(config));
+    config.method = METHOD_ESCAPE;
+    stream_stats_t a_tx, a_rx, b_tx, b_rx;
+    memset(&a_tx, 0, sizeof(a_tx));
+    a_rx = b_tx = b_rx = a_tx;
+    link_t *a = link_new(&config, &a_tx, &a_rx);
+    link_t *b = link_new(&config, &b_tx, &b_rx);
+    bytebuf_t wire_ab = {0}, wire_ba = {0}, received = {0}, ignored = {0};
+    static unsigned char input[64 * 1024];
+    fill_test_data(input, sizeof(input), 16);
+
+    // 途中の1バイトを化けさせ、別の1バイトを抜く
+    link_send(a, input, sizeof(input), &wire_ab);
+    size_t wire_len = bytebuf_len(&wire_ab);
+    wire_ab.data[wire_len / 3] ^= 0x40;
+    memmove(wire_ab.data + wire_len * 2 / 3, wire_ab.data + wire_len * 2 / 3 + 1, wire_len - wire_len * 2 / 3 - 1);
+    wire_ab.end--;
+    link_send_eof(a, &wire_ab);
+
+    // NAKと再送をやり取りして、壊れたフレームだけを送り直してもらう
+    long long now = 1;
+    for (int round = 0; round < 20 && !(link_peer_eof(b) && link_idle(a)); round++) {
+        deliver_wire(b, &wire_ab, &received);
+        link_service(b, &wire_ba, now);
+        deliver_wire(a, &wire_ba, &ignored);
+        link_service(a, &wire_ab, now);
+        now += 100000;
+    }
+    assert(bytebuf_len(&received) == sizeof(input));
+    assert(memcmp(received.data + received.start, input, sizeof(input)) == 0);
+    assert(link_peer_eof(b) && link_idle(a));
+    assert(b_rx.bad_frames >= 2 && a_tx.retransmits >= 2 && a_tx.retransmits <= 4);
+    assert(bytebuf_len(&ignored) == 0);
+    printf("  %llu bad frames recovered by %llu retransmits\n", b_rx.bad_frames, a_tx.retransmits);
+
+    link_free(a);
+    link_free(b);
+    bytebuf_free(&wire_ab);
+    bytebuf_free(&wire_ba);
+    bytebuf_free(&received);
+    bytebuf_free(&ignored);
+}
+
+void test_link_rewind() {
+    printf("Testing link rewind after a lost tty...\n");
+
+    config_t config;
+    memset(&config, 0, sizeof(config));
+    config.method = METHOD_ESCAPE;
+    stream_stats_t a_tx, a_rx, b_tx, b_rx;
+    memset(&a_tx, 0, sizeof(a_tx));
+    a_rx = b_tx = b_rx = a_tx;
+    link_t *a = link_new(&config, &a_tx, &a_rx);
+    link_t *b = link_new(&config, &b_tx, &b_rx);
+    bytebuf_t wire_ab = {0}, wire_ba = {0}, received = {0}, ignored = {0};
+    static unsigned char input[32 * 1024];
+    fill_test_data(input, sizeof(input), 16);
+
+    // フレームの途中でttyが切れ、残りは届かない
+    link_send(a, input, sizeof(input), &wire_ab);
+    wire_ab.end = wire_ab.start + bytebuf_len(&wire_ab) / 2 + 7;
+    deliver_wire(b, &wire_ab, &received);
+    bytebuf_consume(&wire_ab, bytebuf_len(&wire_ab));
+    size_t before = bytebuf_len(&received);
+    assert(before > 0 && before < sizeof(input));
+
+    // つながり直したら、確認応答されていないフレームをすべて送り直す
+    link_rewind(b);
+    link_rewind(a);
+    link_send_eof(a, &wire_ab);
+    long long now = 1;
+    link_service(a, &wire_ab, now);
+    for (int round = 0; round < 10 && !(link_peer_eof(b) && link_idle(a)); round++) {
+        deliver_wire(b, &wire_ab, &received);
+        link_service(b, &wire_ba, now);
+        deliver_wire(a, &wire_ba, &ignored);
+        link_service(a, &wire_ab, now);
+        now += 100000;
+    }
+    assert(bytebuf_len(&received) == sizeof(input));
+    assert(memcmp(received.data + received.start, input, sizeof(input)) == 0);
+    assert(link_peer_eof(b) && link_idle(a));
+    printf("  %zu bytes before the cut, rest resent (%llu frames)\n", before, a_tx.retransmits);
+
+    link_free(a);
+    link_free(b);
+    bytebuf_free(&wire_ab);
+    bytebuf_free(&wire_ba);
+    bytebuf_free(&received);
+    bytebuf_free(&ignored);
+}
+
+void test_escape_set() {
+    printf("Testing negotiated escape sets...\n");
+
+    static unsigned char input[1200];
+    static unsigned char expected[ESCAPE_ENCODE_BOUND(1200)];
+    static unsigned char actual[ESCAPE_ENCODE_BOUND(1200)];
+    simd_level_t available = simd_detect_level();
+    unsigned char needed[256];
+    escape_set_t set;
+
+    for (int round = 0; round < 8; round++) {
+        // 空の対象から全バイトまで。0x5cは必ず対象になる
+        for (int c = 0; c < 256; c++) {
+            needed[c] = (round == 7) || (round > 0 && test_random() % (8 - round) == 0);
+        }
+        escape_set_init(&set, needed);
+        assert(set.needed[0x5c]);
+
+        for (size_t len = 0; len <= sizeof(input); len += (len < 100) ? 1 : 37) {
+            for (size_t k = 0; k < len; k++) {
+                input[k] = (unsigned char)test_random();
+            }
+            codec_set_simd_level(SIMD_NONE);
+            size_t expected_len = escape_encode_set(&set, input, len, expected);
+            for (int level = SIMD_SSE2; level <= (int)available; level++) {
+                codec_set_simd_level((simd_level_t)level);
+                assert(escape_encode_set(&set, input, len, actual) == expected_len);
+                assert(memcmp(actual, expected, expected_len + 1) == 0);
+            }
+            // 対象のバイトは、エスケープの\と16進数字としてしか現れない
+            for (size_t k = 0; k < expected_len; k++) {
+                assert(!set.needed[expected[k]] || expected[k] == 0x5c || strchr("0123456789abcdef", expected[k]));
+            }
+
+            // 既定のデコーダで元に戻ること
+            size_t remaining;
+            size_t decoded = escape_decode_data(expected, expected_len, actual, &remaining);
+            assert(decoded == len && remaining == 0);
+            assert(memcmp(actual, input, len) == 0);
+        }
+    }
+    codec_set_simd_level(available);
+    printf("  SIMD and scalar agree, default decoder restores input\n");
+
+    // 片方向でLFがCRLFに、XOFFが消える通信路を検査する
+    probe_t *a = probe_new();
+    probe_t *b = probe_new();
+    bytebuf_t ab = {0}, ba = {0}, a_in = {0}, b_in = {0};
+    probe_start(a, &ab);
+    probe_start(b, &ba);
+    int a_done = 0, b_done = 0;
+    for (int round = 0; round < 4 && !(a_done && b_done); round++) {
+        for (size_t k = ab.start; k < ab.end; k++) {
+            if (ab.data[k] == 0x0a) {
+                bytebuf_append(&b_in, "\r", 1);
+            }
+            if (ab.data[k] != 0x13) {
+                bytebuf_append(&b_in, ab.data + k, 1);
+            }
+        }
+        bytebuf_consume(&ab, bytebuf_len(&ab));
+        bytebuf_append(&a_in, ba.data + ba.start, bytebuf_len(&ba));
+        bytebuf_consume(&ba, bytebuf_len(&ba));
+        if (round == 1) {
+            bytebuf_append(&b_in, "data", 4); // 結果の後に届いたデータは残す
+        }
+        a_done = probe_receive(a, &a_in, &ab);
+        b_done = probe_receive(b, &b_in, &ba);
+    }
+    assert(a_done && b_done);
+    escape_set_t a_set, b_set;
+    assert(probe_escape_set(a, &a_set) == 3);
+    assert(a_set.needed[0x0a] && a_set.needed[0x13] && a_set.needed[0x5c]);
+    assert(probe_escape_set(b, &b_set) == 1);
+    assert(bytebuf_len(&a_in) == 0);
+    assert(bytebuf_len(&b_in) == 4 && memcmp(b_in.data + b_in.start, "data", 4) == 0);
+    printf("  Probe found 0x0a and 0x13 on the mangled direction, none on the clean one\n");
+
+    probe_free(a);
+    probe_free(b);
+    bytebuf_free(&ab);
+    bytebuf_free(&ba);
+    bytebuf_free(&a_in);
+    bytebuf_free(&b_in);
+}
+
+void test_decoder_stream() {
+    printf("Testing streaming decoder at every split point...\n");
+
+    static const encode_method_t methods[] = { METHOD_ESCAPE, METHOD_UUENCODE, METHOD_DENSE };
+    static const char *names[] = { "escape", "uuencode", "dense" };
+    unsigned char input[300];
+    unsigned char wire[UUENCODE_BOUND(sizeof(input)) + 16];
+    unsigned char expected[sizeof(wire)];
+    unsigned char actual[sizeof(wire)];
+    fill_test_data(input, sizeof(input), 64);
+
+    for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+        size_t wire_len = encode_data(methods[m], input, sizeof(input), wire);
+        if (methods[m] == METHOD_UUENCODE) {
+            wire[62 + 10] = '~';   // 2行目を壊す。行の残りは改行まで読み飛ばされる
+            wire[124] = 'z';       // 3行目の長さを壊す
+        }
+        size_t remaining;
+        size_t expected_len = decode_data(methods[m], wire, wire_len, expected, &remaining);
+        assert(remaining == 0);
+
+        // 2つに分けて渡しても、1バイトずつ渡しても同じ結果になる
+        for (size_t split = 0; split <= wire_len; split++) {
+            decoder_t dec;
+            decoder_init(&dec, methods[m]);
+            size_t len = decoder_feed(&dec, wire, split, actual);
+            len += decoder_feed(&dec, wire + split, wire_len - split, actual + len);
+            assert(len == expected_len && dec.held_len == 0);
+            assert(memcmp(actual, expected, len) == 0);
+        }
+        decoder_t dec;
+        decoder_init(&dec, methods[m]);
+        size_t len = 0;
+        for (size_t i = 0; i < wire_len; i++) {
+            len += decoder_feed(&dec, wire + i, 1, actual + len);
+            assert(dec.held_len <= DECODER_HELD_MAX);
+        }
+        assert(len == expected_len && memcmp(actual, expected, len) == 0);
+        printf("  %s: %zu split points and byte-by-byte feed match one-shot decode\n", names[m], wire_len + 1);
+    }
+}
+
+void test_sync_preamble() {
+    printf("Testing --sync preamble detection...\n");
+
+    // バナーと、印の途中までに見える雑音の後に、印を1バイトずつ届ける
+    const char *noise = "Last login: today\r\n@trans-ready:5c1e\r\n$ ";
+    const char *preamble = SYNC_PREAMBLE;
+    bytebuf_t input = {0};
+    bytebuf_append(&input, noise, strlen(noise));
+    assert(sync_receive(&input) == 0);
+    assert(bytebuf_len(&input) < strlen(preamble));
+    int found = 0;
+    for (size_t i = 0; i < strlen(preamble); i++) {
+        bytebuf_append(&input, preamble + i, 1);
+        found = sync_receive(&input);
+        assert(found == (i == strlen(preamble) - 1));
+    }
+    assert(bytebuf_len(&input) == 0);
+    printf("  Preamble split across reads is found after noise\n");
+
+    // 印と同じ読み込みで届いたデータは残す
+    bytebuf_append(&input, "\x1b[0m", 4);
+    bytebuf_append(&input, preamble, strlen(preamble));
+    bytebuf_append(&input, "data", 4);
+    assert(sync_receive(&input) == 1);
+    assert(bytebuf_len(&input) == 4 && memcmp(input.data + input.start, "data", 4) == 0);
+    printf("  Data after the preamble is kept\n");
+
+    bytebuf_free(&input);
+}
+
+void test_bytebuf_mapped() {
+    printf("Testing double-mapped bytebuf...\n");
+
+    // 書き込みが少しずつしか進まないキューを模して、消費と追加を交互に繰り返す
+    bytebuf_t queue = {0};
+    bytebuf_map(&queue);
+    unsigned char chunk[1000];
+    unsigned char next_in = 0, next_out = 0;
+    bytebuf_append(&queue, "x", 1);
+    bytebuf_consume(&queue, 1);
+    unsigned char *data = queue.data;
+    size_t cap = queue.cap;
+    for (int round = 0; round < 200; round++) {
+        size_t len = (size_t)(round * 37 % (int)sizeof(chunk)) + 1;
+        if (bytebuf_len(&queue) + len > cap) {
+            len = cap - bytebuf_len(&queue);
+        }
+        for (size_t i = 0; i < len; i++) {
+            chunk[i] = next_in++;
+        }
+        bytebuf_append(&queue, chunk, len);
+        size_t drained = bytebuf_len(&queue) * 2 / 3;
+        for (size_t i = 0; i < drained; i++) {
+            assert(queue.data[queue.start + i] == next_out);
+            next_out++;
+        }
+        bytebuf_consume(&queue, drained);
+        assert(queue.start < queue.cap);
+    }
+    // 空きが足りている間は領域が変わらない (先頭を詰めていない)
+    assert(queue.data == data && queue.cap == cap);
+    printf("  Wrapped %zu-byte ring without compaction\n", cap);
+
+    // 広げても書き残しはそのまま残る
+    size_t kept = bytebuf_len(&queue);
+    for (size_t i = 0; i < sizeof(chunk); i++) {
+        chunk[i] = next_in++;
+    }
+    for (size_t added = 0; added <= cap; added += sizeof(chunk)) {
+        bytebuf_append(&queue, chunk, sizeof(chunk));
+        for (size_t i = 0; i < sizeof(chunk); i++) {
+            chunk[i] = next_in++;
+        }
+    }
+    assert(queue.cap > cap);
+    for (size_t i = 0; i < bytebuf_len(&queue); i++) {
+        assert(queue.data[queue.start + i] == next_out);
+        next_out++;
+    }
+    assert(bytebuf_len(&queue) > kept);
+    printf("  Growing keeps queued data\n");
+
+    bytebuf_free(&queue);
+    assert(queue.mapped && queue.data == NULL);
+    bytebuf_append(&queue, "again", 5);
+    assert(bytebuf_len(&queue) == 5 && memcmp(queue.data + queue.start, "again", 5) == 0);
+    bytebuf_free(&queue);
+}
+
+// 積めるだけ積み、ワーカーの結果をoutに取り出す。すべて変換し終えるまで待つ
+static void run_pipeline(pipeline_t *p, const unsigned char *input, size_t len, size_t chunk, bytebuf_t *out) {
+    size_t pushed = 0;
+
+    while (pushed < len || !pipeline_idle(p)) {
+        pipeline_arm(p);
+        size_t n = (len - pushed < chunk) ? len - pushed : chunk;
+        if (n > 0 && pipeline_space(p) >= n) {
+            pipeline_push(p, input + pushed, n);
+            pushed += n;
+            continue;
+        }
+        if (pipeline_pull(p, out, (size_t)-1) == 0) {
+            struct pollfd pfd = { pipeline_fd(p), POLLIN, 0 };
+            poll(&pfd, 1, 100);
+        }
+    }
+}
+
+void test_pipeline() {
+    printf("Testing codec pipeline threads...\n");
+
+    config_t config;
+    memset(&config, 0, sizeof(config));
+    config.method = METHOD_ESCAPE;
+    config.compress_level = 6;
+    codec_stream_t direct, encoder, decoder;
+    assert(codec_stream_init(&direct, &config, 1, NULL) == 0);
+    assert(codec_stream_init(&encoder, &config, 1, NULL) == 0);
+    assert(codec_stream_init(&decoder, &config, 0, NULL) == 0);
+
+    // リングが小さいので、ワーカーとの間で何度も待ち合わせる
+    static unsigned char input[256 * 1024];
+    fill_test_data(input, sizeof(input), 16);
+    pipeline_t *enc = pipeline_new(&encoder, 1, 4096);
+    pipeline_t *dec = pipeline_new(&decoder, 0, 4096);
+    assert(enc && dec);
+    bytebuf_t wire = {0}, expected = {0}, decoded = {0};
+    run_pipeline(enc, input, sizeof(input), 4096, &wire);
+    for (size_t pos = 0; pos < sizeof(input); pos += 4096) {
+        codec_stream_encode(&direct, input + pos, 4096, &expected);
+    }
+    assert(bytebuf_len(&wire) == bytebuf_len(&expected));
+    assert(memcmp(wire.data + wire.start, expected.data + expected.start, bytebuf_len(&wire)) == 0);
+    printf("  Encoded %zu bytes in the worker, same as in the caller\n", bytebuf_len(&wire));
+
+    // エスケープや圧縮ブロックの途中で切って渡しても、ワーカーが残りを持ち越す
+    run_pipeline(dec, wire.data + wire.start, bytebuf_len(&wire), 999, &decoded);
+    assert(bytebuf_len(&decoded) == sizeof(input));
+    assert(memcmp(decoded.data + decoded.start, input, sizeof(input)) == 0);
+    printf("  Decoded back across odd chunk boundaries\n");
+
+    pipeline_free(enc);
+    pipeline_free(dec);
+    codec_stream_close(&direct);
+    codec_stream_close(&encoder);
+    codec_stream_close(&decoder);
+    bytebuf_free(&wire);
+    bytebuf_free(&expected);
+    bytebuf_free(&decoded);
+}
+
 int main() {
     printf("Running encoding/decoding unit tests...\n\n");
     
@@ -200,6 +1189,57 @@ int main() {
     
     test_buffer_boundary();
     printf("\n");
+
+    test_decoder_stream();
+    printf("\n");
+    
+    test_encode_bound();
+    printf("\n");
+    
+    test_escape_simd_identical();
+    printf("\n");
+
+    test_escape_set();
+    printf("\n");
+
+    test_sync_preamble();
+    printf("\n");
+
+    test_bytebuf_mapped();
+    printf("\n");
+    
+    test_uuencode_fast_path();
+    printf("\n");
+    
+    test_dense_encode_decode();
+    printf("\n");
+    
+    test_compress_stage();
+    printf("\n");
+
+    test_dedup_stage();
+    printf("\n");
+
+    test_latency_histogram();
+    printf("\n");
+
+    test_dump_parse_hex();
+    printf("\n");
+
+    test_flow_window();
+    printf("\n");
+
+    test_parse_flush_latency();
+    printf("\n");
+
+    test_framed_link();
+    printf("\n");
+
+    test_link_rewind();
+    printf("\n");
+
+    test_pipeline();
+    printf("\n");
     
     printf("All tests passed!\n");
     return 0;
@@ -1,6 +1,10 @@
 #ifndef TRANS_H
 #define TRANS_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,59 +17,419 @@
 #include <signal.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/errno.h>
 #include <fcntl.h>
 #include <poll.h>
 
-#define BUFFER_SIZE 256
-#define MAX_ENCODED_SIZE (BUFFER_SIZE * 4)
+// 入力バッファの大きさ。実行時に最小値と--buffer-sizeの間で伸縮する
+#define MIN_BUFFER_SIZE 256
+#define INITIAL_BUFFER_SIZE 4096
+#define DEFAULT_BUFFER_SIZE (64 * 1024)
+#define MAX_BUFFER_SIZE (16 * 1024 * 1024)
+
+// --muxのフロー制御の窓の最小値。最大のフレームとCREDITの間隔より大きくする
+#define MIN_FLOW_WINDOW (64 * 1024)
+
+// 入力nバイトをエンコードしたときの最大長 (末尾の'\0'を含む)
+#define UUENCODE_BOUND(n) ((((n) + 44) / 45 + 1) * 62 + 1)
+#define ESCAPE_ENCODE_BOUND(n) ((n) * 3 + 1)
+#define DENSE_ENCODE_BOUND(n) ((n) * 2 + 1)
 #define TRANS_VERSION "1.3.0"
 
+// flushポリシーのプリセット
+#define FLUSH_INTERACTIVE_LATENCY_US 500
+#define FLUSH_INTERACTIVE_SMALL_READ 128
+#define FLUSH_BULK_LATENCY_US 20000
+#define FLUSH_MAX_LATENCY_US 5000000    // 指定できる遅延の上限。期限の計算が溢れないように抑える
+
 typedef enum {
     METHOD_UUENCODE,
-    METHOD_ESCAPE
+    METHOD_ESCAPE,
+    METHOD_DENSE
 } encode_method_t;
 
+// escapeでエスケープするバイトの表 (encode.c)。--probeで通信路を調べて決める
+typedef struct {
+    unsigned char needed[256];
+    unsigned char lut[2][16];   // SIMD用: 下位4ビットごとに、上位4ビット(0-7, 8-15)のビットを立てる
+} escape_set_t;
+
+// 呼び出しをまたいで、途中で切れたエスケープや行を持ち越すデコーダ (encode.c)
+#define DECODER_HELD_MAX 64
+typedef struct {
+    encode_method_t method;
+    unsigned char held[DECODER_HELD_MAX];   // 途中で切れた\xx、denseの組、uuencodeの行
+    size_t held_len;
+    int skipping;                           // uuencode: 壊れた行の残りを改行まで読み飛ばしている
+} decoder_t;
+
+// コーデックが使うSIMD命令セット (大きいほど新しい)
+typedef enum {
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_SSSE3,
+    SIMD_AVX2
+} simd_level_t;
+
 typedef enum {
     MODE_RECEIVER,
     MODE_SENDER
 } trans_mode_t;
 
+// 部分的に溜まったバッファをいつ書き出すか
+typedef struct {
+    long latency_us;    // 最初のバイトを受け取ってからflushするまでの最大待ち時間
+    size_t small_read;  // 空のバッファへのこのサイズ以下のreadは即時flush (0で無効)
+} flush_policy_t;
+
+// zlibによるストリーム圧縮の状態 (compress.c)
+typedef struct compress_stage compress_stage_t;
+
+// 内容で分けたチャンクの重複除去の状態 (dedup.c)
+typedef struct dedup_stage dedup_stage_t;
+
+// 先頭から消費し、末尾に追加する伸縮バッファ (stream.c)
+typedef struct {
+    unsigned char *data;
+    size_t start;   // 未消費部分の先頭
+    size_t end;     // 未消費部分の末尾
+    size_t cap;
+    int mapped;     // 同じ領域を2度続けてマップしたリングに置く (bytebuf_map)
+} bytebuf_t;
+
 typedef struct {
     trans_mode_t mode;
     int port;
     encode_method_t method;
     char *host;
     char *system_command;
+    int mux;                  // 1本のttyに複数のTCP接続を多重化する
+    int framed;               // 連番とCRC32Cを付けて送り、壊れたフレームを再送する
+    int probe;                // 最初に通信路を調べ、化けるバイトだけをエスケープする
+    int resume;               // ttyが切れても接続を保ち、つながり直したら続きから送る (--framedを含む)
+    int sync;                 // 標準入出力側が書く印を待ってから通信を始める
+    int pipeline;             // エンコード/デコードを方向ごとのスレッドで行う
+    int latency_report;       // 終了時に遅延の分布を出力する
+    size_t flow_window;       // --muxで相手が読み終えていないバイト数の上限 (0でフロー制御しない)
+    int flow_auto;            // flow_windowを届いた速さから決める
     int quiet;
     char *log_port_stdio_file;
     char *log_stdio_port_file;
     char *log_prefix;
     int delay_seconds;
+    size_t buffer_size;       // 入力バッファの上限
+    int backlog;              // listenのbacklog
+    size_t max_memory;        // 受信側の全接続のバッファの上限 (0で無制限)
+    int pool_size;            // 受信側で接続より先に起動しておく-sのコマンドの数
+    int compress_level;       // エンコード前に圧縮するレベル (-1で圧縮しない)
+    size_t dedup_cache;       // 重複除去のキャッシュの大きさ (0で重複除去しない)
+    flush_policy_t flush_ps;  // port -> stdio/command (エンコード側)
+    flush_policy_t flush_sp;  // stdio/command -> port (デコード側)
     char *argv0;
 } config_t;
 
+// fdの監視 (event.c)。Linuxではepoll、それ以外ではpollを使う
+typedef struct event_loop event_loop_t;
+
+#define EVENT_READ 1
+#define EVENT_WRITE 2
+#define EVENT_ERROR 4   // HUPまたはエラー (監視中のfdでのみ報告される)
+
+typedef struct {
+    int fd;
+    int events;
+    void *data;
+} event_t;
+
+// ソケットとコマンド(または標準入出力)の間の双方向の中継 (relay.c)
+typedef struct relay relay_t;
+
+// 通信内容のキャプチャ (capture.c)。--lps/--lspで書き、--convert-captureでテキストにする
+typedef struct capture capture_t;
+
+typedef enum {
+    CAPTURE_MESSAGE,        // flushの理由などのテキスト
+    CAPTURE_TOENC,          // エンコード前
+    CAPTURE_ENC_D,          // エンコード後
+    CAPTURE_TODEC,          // デコード前
+    CAPTURE_DEC_D           // デコード後
+} capture_type_t;
+
+// flushした理由
+typedef enum {
+    FLUSH_TIMEOUT,          // 遅延の上限に達した
+    FLUSH_FULL,             // バッファが埋まった
+    FLUSH_SMALL_READ,       // 単発の小さなread、または多重化の制御フレーム
+    FLUSH_EOF,
+    FLUSH_REASON_COUNT
+} flush_reason_t;
+
+// 一方向の統計。SIGUSR1を受けると標準エラーに出力する
+typedef struct {
+    int conn_id;                        // 表示用の接続番号 (負なら表示しない)
+    unsigned long long bytes_in;        // 変換前のバイト数
+    unsigned long long bytes_out;       // 変換後のバイト数
+    unsigned long long escapes;         // エスケープしたバイト数 (エンコード側)
+    unsigned long long flushes[FLUSH_REASON_COUNT];
+    unsigned long long carry_overs;     // デコードしきれずに次へ持ち越した回数
+    unsigned long long carried_bytes;
+    unsigned long long write_stalls;    // 書き込みがEAGAINになった回数
+    unsigned long long stalled_us;      // 書き込みが詰まっていた時間の合計
+    long long stall_started;            // 詰まり始めた時刻 (0なら詰まっていない)
+    unsigned long long bad_frames;      // CRCが合わないか壊れていたフレーム (--framed、受信側)
+    unsigned long long retransmits;     // 送り直したフレーム (--framed、送信側)
+} stream_stats_t;
+
+// flushした単位ごとの遅延の分布 (latency.c)。SIGUSR1で統計と一緒に出力する
+typedef enum {
+    LATENCY_QUEUE,          // 読んでからflushするまで
+    LATENCY_CODEC,          // 変換にかかった時間
+    LATENCY_WRITE,          // 変換し終えてから書き終えるまで
+    LATENCY_KIND_COUNT
+} latency_kind_t;
+
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_MAX_EXPONENT 40     // これより大きな値 (約12日) は最後の区間に数える
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXPONENT - 2) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long total;
+    long long max;
+} latency_histogram_t;
+
+// 誤り検出と選択的な再送 (link.c)。--framedで送受信のストリームが共有する
+typedef struct link link_t;
+
+// 圧縮とエンコード、デコードと展開をまとめて、バッファからバッファへ変換する (stream.c)
+typedef struct codec_stream {
+    const config_t *config;
+    int encoding;
+    compress_stage_t *compress_stage;
+    bytebuf_t scratch;          // 圧縮データの置き場
+    dedup_stage_t *dedup_stage;
+    bytebuf_t deduped;          // 重複除去した記録の置き場 (エンコード側)
+    capture_t *capture;
+    link_t *link;               // --framedのとき。所有しない
+    const escape_set_t *escapes;  // --probeで決めたエスケープ対象 (NULLなら既定)。所有しない
+    bytebuf_t payload;          // linkから取り出したデータ (圧縮されていれば展開前)
+    decoder_t decoder;          // デコード側: 前回の入力の途中で切れた分を持つ
+    stream_stats_t stats;
+    struct codec_stream *prev;  // 統計を出力するための、使用中のストリームの一覧
+    struct codec_stream *next;
+} codec_stream_t;
+
 // エンコード/デコード関数
 size_t uuencode_data(const unsigned char *input, size_t input_len, unsigned char *output);
 size_t uudecode_data(const unsigned char *input, size_t input_len, unsigned char *output, size_t *remaining_bytes);
 size_t escape_encode_data(const unsigned char *input, size_t input_len, unsigned char *output);
 size_t escape_decode_data(const unsigned char *input, size_t input_len, unsigned char *output, size_t *remaining_bytes);
+size_t dense_encode_data(const unsigned char *input, size_t input_len, unsigned char *output);
+size_t dense_decode_data(const unsigned char *input, size_t input_len, unsigned char *output, size_t *remaining_bytes);
+size_t encode_data(encode_method_t method, const unsigned char *input, size_t input_len, unsigned char *output);
+void escape_set_init(escape_set_t *set, const unsigned char *needed);
+size_t escape_encode_set(const escape_set_t *set, const unsigned char *input, size_t input_len, unsigned char *output);
+size_t encode_data_set(encode_method_t method, const escape_set_t *set, const unsigned char *input,
+                       size_t input_len, unsigned char *output);
+void decoder_init(decoder_t *dec, encode_method_t method);
+size_t decoder_feed(decoder_t *dec, const unsigned char *input, size_t input_len, unsigned char *output);
+size_t decoder_bound(const decoder_t *dec, size_t input_len);
+size_t decode_data(encode_method_t method, const unsigned char *input, size_t input_len, unsigned char *output, size_t *remaining_bytes);
+simd_level_t simd_detect_level(void);
+simd_level_t codec_simd_level(void);
+simd_level_t codec_set_simd_level(simd_level_t level);
+const char *simd_level_name(simd_level_t level);
+size_t encode_bound(encode_method_t method, size_t input_len);
+size_t decode_bound(encode_method_t method, size_t input_len);
+
+// 圧縮
+compress_stage_t *compress_stage_new(int deflating, int level);
+void compress_stage_free(compress_stage_t *stage);
+size_t compress_bound(size_t input_len);
+int compress_parse_header(unsigned char header);
+size_t compress_stage_deflate(compress_stage_t *stage, const unsigned char *input, size_t input_len, unsigned char *output);
+size_t compress_stage_inflate(compress_stage_t *stage, const unsigned char **input, size_t *input_len, const unsigned char **output);
+dedup_stage_t *dedup_stage_new(int encoding, size_t cache_size);
+void dedup_stage_free(dedup_stage_t *stage);
+void dedup_stage_encode(dedup_stage_t *stage, const unsigned char *data, size_t len, bytebuf_t *out);
+void dedup_stage_decode(dedup_stage_t *stage, const unsigned char *data, size_t len, bytebuf_t *out);
+size_t dedup_stage_memory(const dedup_stage_t *stage);
+unsigned long long dedup_stage_saved(const dedup_stage_t *stage, unsigned long long *refs);
+
+// バッファ
+size_t bytebuf_len(const bytebuf_t *buf);
+unsigned char *bytebuf_reserve(bytebuf_t *buf, size_t extra);
+void bytebuf_append(bytebuf_t *buf, const void *data, size_t len);
+void bytebuf_consume(bytebuf_t *buf, size_t len);
+void bytebuf_free(bytebuf_t *buf);
+void bytebuf_map(bytebuf_t *buf);
+
+// コーデックのパイプライン
+int codec_stream_init(codec_stream_t *cs, const config_t *config, int encoding, capture_t *capture);
+void codec_stream_close(codec_stream_t *cs);
+size_t codec_stream_memory(const codec_stream_t *cs);
+void codec_stream_encode(codec_stream_t *cs, const unsigned char *data, size_t len, bytebuf_t *out);
+void codec_stream_decode(codec_stream_t *cs, bytebuf_t *wire, bytebuf_t *out);
+void codec_stream_decode_data(codec_stream_t *cs, const unsigned char *wire, size_t wire_len, bytebuf_t *out);
+void stats_add(unsigned long long *counter, unsigned long long n);
+unsigned long long stats_get(const unsigned long long *counter);
+void stats_write_stalled(stream_stats_t *stats);
+void stats_write_progress(stream_stats_t *stats);
+void stats_dump(FILE *file);
+void stats_dump_if_requested(void);
+void latency_histogram_add(latency_histogram_t *h, long long us);
+long long latency_histogram_percentile(const latency_histogram_t *h, double q);
+void latency_record(int encoding, latency_kind_t kind, long long us);
+void latency_dump(FILE *file);
+long parse_flush_latency(const char *spec);
+int parse_flush_policy(const char *spec, flush_policy_t *policy);
+
+// フレーム化と再送
+unsigned int crc32c(const void *data, size_t len);
+link_t *link_new(const config_t *config, stream_stats_t *tx_stats, stream_stats_t *rx_stats);
+void link_free(link_t *link);
+size_t link_send(link_t *link, const unsigned char *data, size_t len, bytebuf_t *wire);
+void link_receive(link_t *link, unsigned char *data, size_t len, bytebuf_t *out);
+void link_send_eof(link_t *link, bytebuf_t *wire);
+long link_service(link_t *link, bytebuf_t *wire, long long now);
+int link_peer_eof(const link_t *link);
+int link_can_send(const link_t *link);
+int link_idle(const link_t *link);
+void link_rewind(link_t *link);
+void link_set_escapes(link_t *link, const escape_set_t *escapes);
+unsigned long long link_frames_received(const link_t *link);
+size_t link_memory(const link_t *link);
+
+// --muxのフロー制御の窓 (flow.c)
+#define FLOW_MARKS 32
+
+typedef struct {
+    unsigned long long end;     // このflushまでに送ったバイト数
+    long long at;               // 送った時刻
+} flow_mark_t;
+
+typedef struct {
+    size_t window;
+    int automatic;                  // --window auto
+    unsigned long long sent;        // 送ったフレームのバイト数 (CREDITを除く)
+    unsigned long long acked;       // 相手が受け取ったと返してきたバイト数
+    flow_mark_t marks[FLOW_MARKS];  // 遅延を測るための、送った位置と時刻
+    int mark_head;
+    int mark_count;
+    long long rtt;                  // 最後に測った遅延 (μs、0なら未測定)
+    long long min_rtt;
+    long long min_rtt_at;           // min_rttを測り直した時刻
+    long long drain_started;        // 0でなければ、待ち行列を空にして遅延を測り直している
+    long long drain_min_rtt;
+    size_t drained_window;          // 測り直す前の窓
+    int blocked;                    // 今の測定の間に窓が閉じて待たされた
+    long long sample_started;
+    unsigned long long sample_acked;
+} flow_t;
+
+void flow_init(flow_t *flow, size_t window, int automatic);
+size_t flow_room(const flow_t *flow);
+void flow_sent(flow_t *flow, size_t len, long long now);
+void flow_blocked(flow_t *flow);
+void flow_acked(flow_t *flow, unsigned long long acked, long long now);
+
+// 通信路の検査 (probe.c)。両端が全バイト値を送り合い、化けたバイトを教え合う
+typedef struct probe probe_t;
+#define PROBE_TIMEOUT_US (30LL * 1000000)
+probe_t *probe_new(void);
+void probe_free(probe_t *probe);
+void probe_start(probe_t *probe, bytebuf_t *wire);
+int probe_receive(probe_t *probe, bytebuf_t *input, bytebuf_t *wire);
+int probe_escape_set(const probe_t *probe, escape_set_t *set);
+int probe_channel(int input_fd, int output_fd, escape_set_t *set, bytebuf_t *leftover);
+
+// 変換を別スレッドで行うパイプライン (pipeline.c)
+typedef struct pipeline pipeline_t;
+int pipeline_available(void);
+pipeline_t *pipeline_new(codec_stream_t *codec, int encoding, size_t max_chunk);
+void pipeline_free(pipeline_t *p);
+int pipeline_fd(const pipeline_t *p);
+size_t pipeline_space(const pipeline_t *p);
+void pipeline_push(pipeline_t *p, const unsigned char *data, size_t len);
+size_t pipeline_pull(pipeline_t *p, bytebuf_t *out, size_t limit);
+void pipeline_arm(pipeline_t *p);
+int pipeline_idle(const pipeline_t *p);
+size_t pipeline_memory(const pipeline_t *p);
+
+// 通信開始の同期 (sync.c)。標準入出力側の印が届くまで、-s側はttyの出力を捨てる
+#define SYNC_PREAMBLE "@trans-ready:5c1e9a47@"
+#define SYNC_TIMEOUT_US (60LL * 1000000)
+int sync_announce(void);
+int sync_receive(bytebuf_t *input);
+int sync_channel(int input_fd, bytebuf_t *leftover);
+
+// セッションの再開 (session.c)
+#define SESSION_TOKEN_SIZE 32
+#define SESSION_TIMEOUT_US (600LL * 1000000)   // ttyが切れてからこれだけつながらなければ諦める
+void session_new_token(char *token);
+int session_hello(char *line, size_t size, const char *token, int again);
+int session_read_hello(int fd, char *token, int *again);
+int session_listen(const char *token);
+void session_remove(const char *token);
+int session_handover(const char *token, int input_fd, int output_fd);
+int session_accept(int listen_fd, int *conn_fd, int *input_fd, int *output_fd);
+
+// キャプチャ
+capture_t *capture_open(const char *path, const config_t *config);
+void capture_close(capture_t *cap);
+void capture_record(capture_t *cap, capture_type_t type, const void *data, size_t len);
+void capture_message(capture_t *cap, const char *message);
+int capture_convert(const char *path, FILE *out);
+size_t capture_map_header(const unsigned char *map, size_t size, char *prefix);
+int capture_map_record(const unsigned char *map, size_t size, size_t *offset, capture_type_t *type,
+                       long long *time_us, const unsigned char **data, size_t *len);
+
+// 両端のログの照合 (check.c)。表示は以前のdump_checker.rbと同じ
+long long dump_check(int count, char **paths, FILE *out);
+size_t dump_parse_hex(const char *hex, size_t len, unsigned char *out, simd_level_t level, int *foreign);
+
+// イベントループ
+event_loop_t *event_loop_new(void);
+void event_loop_free(event_loop_t *loop);
+int event_loop_set(event_loop_t *loop, int fd, int events, void *data);
+void event_loop_remove(event_loop_t *loop, int fd);
+int event_loop_wait(event_loop_t *loop, event_t *events, int max_events, long timeout_us);
+
+// 中継
+relay_t *relay_new(const config_t *config, event_loop_t *loop, int sockfd, int input_fd, int output_fd);
+void relay_free(relay_t *relay);
+size_t relay_memory(const relay_t *relay);
+int relay_finished(const relay_t *relay);
+long relay_service(relay_t *relay);
+void relay_handle_event(relay_t *relay, const event_t *event);
+void relay_resume_spawner(relay_t *relay, pid_t cmd_pid);
+void relay_resume_holder(relay_t *relay, int session_fd, const char *token);
+pid_t relay_command_pid(const relay_t *relay);
+void relay_preread(relay_t *relay, const bytebuf_t *input, int synced);
+void relay_set_owner(relay_t *relay, void *owner);
+void *relay_owner(const relay_t *relay);
 
 // メイン機能
 int sender_mode(const config_t *config);
 int receiver_mode(const config_t *config);
 void handle_connection(int sockfd, const config_t *config);
-ssize_t read_with_timeout(int fd, void *buffer, size_t count, int timeout_ms);
+int poll_with_timeout_us(struct pollfd *fds, nfds_t nfds, long timeout_us);
 void handle_connection_common(int sockfd, int input_fd, int output_fd, const config_t *config);
+pid_t spawn_command(const char *command, int *input_fd, int *output_fd);
+int open_listener(const config_t *config);
+int accept_nonblocking(int listen_fd, struct sockaddr *addr, socklen_t *addr_len);
+int mux_mode(const config_t *config);
 
 // グローバル変数
 extern volatile int running;
+extern volatile sig_atomic_t stats_requested;
 
 // ユーティリティ
 void parse_arguments(int argc, char *argv[], config_t *config);
 void print_usage(const char *program_name);
 void cleanup_and_exit(int sig);
-void log_message(FILE *file, const config_t *config, const char *message);
-void hex_dump_to_file(FILE *file, const char *prefix, const unsigned char *data, size_t len, const config_t *config);
+void request_stats_dump(int sig);
+long long monotonic_us(void);
 
 #endif